@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lab3a.h"
+#include "bench.h"
+
+
+
+int proc_io = -1;                           /* /proc/self/io, kept open so sampling costs one read   */
+FILE *report;                               /* Where the JSON lines go                               */
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                 SAMPLING                               //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+static double seconds(clockid_t clock) {
+
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Pull one counter ("syscr: 12") out of the text of /proc/self/io.  */
+static unsigned long long io_counter(const char *text, const char *name) {
+
+  const char *p = strstr(text, name);
+
+  return (p ? strtoull(p + strlen(name) + 1, NULL, 10) : 0);
+}
+
+/* Read the clocks and counters. Every earlier sample cost one read() of /proc/self/io, which is taken off.  */
+void take_sample(struct bench_sample *s) {
+
+  static unsigned long long own_reads;
+  char text[512];
+  ssize_t got;
+  struct rusage ru;
+
+  s->wall = seconds(CLOCK_MONOTONIC);
+  s->cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+  getrusage(RUSAGE_SELF, &ru);
+  s->minflt = ru.ru_minflt;
+  s->majflt = ru.ru_majflt;
+  s->syscr = s->syscw = 0;
+  if (proc_io != -1 && (got = pread(proc_io, text, sizeof(text) - 1, 0)) > 0) {
+    text[got] = '\0';
+    s->syscr = io_counter(text, "syscr:") - own_reads++;
+    s->syscw = io_counter(text, "syscw:");
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                  PHASES                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+const char *IMAGE_PATH;                     /* Image being dumped                                    */
+
+static void run_super(void) {
+  if (open_image(IMAGE_PATH) == -1 || load_file_system() == -1) {
+    perror(img.error_text); exit(-1);
+  }
+  write_super_csv();
+}
+
+static void run_group(void) {
+  write_group_csv();
+}
+
+static void run_bitmap(void) {
+
+  struct csv_out *bitmap = csv_open("bitmap.csv");
+
+  if (bitmap == NULL) {
+    perror("open"); exit(-1);
+  }
+  if (for_each_group(emit_bitmap_group, NULL, &bitmap, 1) == -1) {
+    perror(img.error_text); exit(-1);
+  }
+  if (csv_close(bitmap) != 0) {
+    perror("close"); exit(-1);
+  }
+}
+
+/* Run the inode scan with just one of the csv emitters.  */
+static void run_scan(const char *path, struct inode_emitter emitter) {
+
+  struct csv_out *out = csv_open(path);
+  struct inode_scan scan = { &emitter, 1 };
+
+  if (out == NULL) {
+    perror("open"); exit(-1);
+  }
+  emitter.out = out;
+  if (for_each_group(scan_inode_group, &scan, &out, 1) == -1) {
+    perror(img.error_text); exit(-1);
+  }
+  if (csv_close(out) != 0) {
+    perror("close"); exit(-1);
+  }
+}
+
+static void run_inode(void) {
+  run_scan("inode.csv", (struct inode_emitter) { emit_inode_row, NULL, NULL, NULL });
+}
+
+static void run_directory(void) {
+  run_scan("directory.csv", (struct inode_emitter) { emit_directory_inode, emit_directory_block, NULL, NULL });
+}
+
+static void run_indirect(void) {
+  run_scan("indirect.csv", (struct inode_emitter) { emit_indirect_inode, NULL, emit_indirect_row, NULL });
+}
+
+struct bench_phase PHASES[] = {
+  { "super",     "super.csv",     run_super,     0 },
+  { "group",     "group.csv",     run_group,     0 },
+  { "bitmap",    "bitmap.csv",    run_bitmap,    0 },
+  { "inode",     "inode.csv",     run_inode,     1 },
+  { "directory", "directory.csv", run_directory, 1 },
+  { "indirect",  "indirect.csv",  run_indirect,  1 },
+};
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                 REPORTING                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write 's' as a JSON string.  */
+static void json_string(const char *s) {
+
+  fputc('"', report);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', report);
+    if ((unsigned char) *s >= 0x20)
+      fputc(*s, report);
+  }
+  fputc('"', report);
+}
+
+/* Write one JSON line describing the work between samples 'a' and 'b'.  */
+void report_phase(const char *label, const char *phase, int run, int cold, unsigned long long inodes,
+		  unsigned long long image_bytes, unsigned long long out_bytes, int per_inode,
+		  const struct bench_sample *a, const struct bench_sample *b) {
+
+  double wall = b->wall - a->wall;
+
+  fprintf(report, "{\"label\":");
+  json_string(label);
+  fprintf(report, ",\"block_size\":%u,\"groups\":%u,\"inodes\":%llu,\"image_bytes\":%llu,"
+	  "\"jobs\":%u,\"cold\":%d,\"run\":%d,\"phase\":\"%s\",\"wall_s\":%.6f,\"cpu_s\":%.6f,",
+	  sb.block_size, DESCRIPTOR_COUNT, inodes, image_bytes, JOB_COUNT, cold, run, phase,
+	  wall, b->cpu - a->cpu);
+  if (per_inode)
+    fprintf(report, "\"inodes_per_s\":%.1f,", wall > 0 ? inodes / wall : 0);
+  else
+    fprintf(report, "\"inodes_per_s\":null,");
+  fprintf(report, "\"mb_per_s\":%.3f,\"out_bytes\":%llu,\"read_syscalls\":%llu,\"write_syscalls\":%llu,"
+	  "\"minor_faults\":%ld,\"major_faults\":%ld}\n",
+	  wall > 0 ? image_bytes / 1e6 / wall : 0, out_bytes, b->syscr - a->syscr, b->syscw - a->syscw,
+	  b->minflt - a->minflt, b->majflt - a->majflt);
+}
+
+/* Drop the image from the page cache, so the next run reads it from the disk.  */
+void drop_cache(const char *path) {
+
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+    fprintf(stderr, "%s: could not drop from the page cache\n", path);
+  if (fd != -1)
+    close(fd);
+}
+
+/* Time every phase of one dump of the image, writing the csv files into the current directory.  */
+void bench_run(const char *label, int run, int cold) {
+
+  int phase_count = sizeof(PHASES) / sizeof(PHASES[0]);
+  struct bench_sample before[phase_count], after[phase_count];
+  unsigned long long out_bytes[phase_count];
+  unsigned long long inodes = 0, total_out = 0, image_bytes;
+  struct stat st;
+
+  if (cold)
+    drop_cache(IMAGE_PATH);
+
+  for (int p = 0; p < phase_count; p++) {
+    take_sample(&before[p]);
+    PHASES[p].run();
+    take_sample(&after[p]);
+    out_bytes[p] = stat(PHASES[p].csv, &st) == 0 ? (unsigned long long) st.st_size : 0;
+    total_out += out_bytes[p];
+  }
+
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++)
+    inodes += sb.inodes_per_group - gd[i].free_inodes_per_group;
+  image_bytes = img.size;
+
+  for (int p = 0; p < phase_count; p++)
+    report_phase(label, PHASES[p].name, run, cold, inodes, image_bytes, out_bytes[p],
+		 PHASES[p].per_inode, &before[p], &after[p]);
+  report_phase(label, "total", run, cold, inodes, image_bytes, total_out, 1,
+	       &before[0], &after[phase_count - 1]);
+  fflush(report);
+
+  close_image();
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                   MAIN                                 //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Parse a size distribution: "fixed:N", "uniform:A-B" or "exp:MEAN", in bytes.  */
+static void parse_sizes(const char *arg, struct gen_params *p) {
+
+  unsigned long long a, b;
+
+  if (sscanf(arg, "fixed:%llu", &a) == 1)
+    *p = (struct gen_params) { .size_dist = 'f', .size_a = a };
+  else if (sscanf(arg, "uniform:%llu-%llu", &a, &b) == 2 && a <= b)
+    *p = (struct gen_params) { .size_dist = 'u', .size_a = a, .size_b = b };
+  else if (sscanf(arg, "exp:%llu", &a) == 1)
+    *p = (struct gen_params) { .size_dist = 'e', .size_a = a };
+  else {
+    fprintf(stderr, "bad size distribution '%s' (want fixed:N, uniform:A-B or exp:MEAN)\n", arg);
+    exit(-1);
+  }
+}
+
+/* Generate (or take) an image, then time each phase of dumping it, 'repeats' times over.  */
+int main(int argc, char *argv[]) {
+
+  struct gen_params p, sizes;
+  const char *workdir = "/tmp";
+  const char *label = "";
+  const char *gen_only = NULL;
+  const char *existing = NULL;
+  char work_path[PATH_MAX], image_path[PATH_MAX + 32], out_dir[PATH_MAX + 32];
+  int repeats = 3, cold = 0, keep = 0;
+  int opt;
+
+  memset(&p, 0, sizeof(p));
+  p.block_size = 4096;
+  p.groups = 16;
+  p.inode_fill = 0.5;
+  p.fanout = 16;
+  p.dir_ratio = 0.05;
+  p.size_dist = 'e';
+  p.size_a = 16384;
+  p.seed = 1;
+  report = stdout;
+
+  while ((opt = getopt(argc, argv, "b:g:I:f:F:D:s:S:j:r:cw:kG:i:l:o:")) != -1) {
+    switch (opt) {
+      case 'b': p.block_size = atoi(optarg); break;
+      case 'g': p.groups = atoi(optarg); break;
+      case 'I': p.inodes_per_group = atoi(optarg); break;
+      case 'f': p.inode_fill = atof(optarg); break;
+      case 'F': p.fanout = atoi(optarg); break;
+      case 'D': p.dir_ratio = atof(optarg); break;
+      case 's':
+	parse_sizes(optarg, &sizes);
+	p.size_dist = sizes.size_dist;
+	p.size_a = sizes.size_a;
+	p.size_b = sizes.size_b;
+	break;
+      case 'S': p.seed = strtoull(optarg, NULL, 10); break;
+      case 'j': JOB_COUNT = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+      case 'r': repeats = atoi(optarg); break;
+      case 'c': cold = 1; break;
+      case 'w': workdir = optarg; break;
+      case 'k': keep = 1; break;
+      case 'G': gen_only = optarg; break;
+      case 'i': existing = optarg; break;
+      case 'l': label = optarg; break;
+      case 'o':
+	if ((report = fopen(optarg, "a")) == NULL) {
+	  fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+	  exit(-1);
+	}
+	break;
+      default:
+	fprintf(stderr, "usage: %s [-b block size] [-g groups] [-I inodes per group] [-f inode fill]\n"
+		"       [-F fanout] [-D dir ratio] [-s fixed:N|uniform:A-B|exp:MEAN] [-S seed]\n"
+		"       [-j jobs] [-r repeats] [-c] [-w workdir] [-k] [-G image] [-i image]\n"
+		"       [-l label] [-o report]\n", argv[0]);
+	exit(-1);
+    }
+  }
+  if ((p.block_size != 1024 && p.block_size != 2048 && p.block_size != 4096) ||
+      p.groups == 0 || p.fanout == 0) {
+    fprintf(stderr, "%s: need a 1024, 2048 or 4096 byte block size, and at least one group and one entry per directory\n", argv[0]);
+    exit(-1);
+  }
+
+  /* '-G' only writes the image out, for use elsewhere.  */
+  if (gen_only) {
+    generate_image(&p, gen_only);
+    exit(0);
+  }
+
+  /* Paths are made absolute, since the csv files are written from another directory.  */
+  if (realpath(workdir, work_path) == NULL) {
+    fprintf(stderr, "%s: %s\n", workdir, strerror(errno));
+    exit(-1);
+  }
+  workdir = work_path;
+  if (existing) {
+    if (realpath(existing, image_path) == NULL) {
+      fprintf(stderr, "%s: %s\n", existing, strerror(errno));
+      exit(-1);
+    }
+  }
+  else {
+    snprintf(image_path, sizeof(image_path), "%s/bench-%d.img", workdir, (int) getpid());
+    generate_image(&p, image_path);
+  }
+  IMAGE_PATH = image_path;
+
+  /* The csv files go to a scratch directory next to the image.  */
+  snprintf(out_dir, sizeof(out_dir), "%s/bench-%d.out", workdir, (int) getpid());
+  if (mkdir(out_dir, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "%s: %s\n", out_dir, strerror(errno));
+    exit(-1);
+  }
+  if (chdir(out_dir) == -1) {
+    fprintf(stderr, "%s: %s\n", out_dir, strerror(errno));
+    exit(-1);
+  }
+  proc_io = open("/proc/self/io", O_RDONLY);
+
+  for (int run = 0; run < repeats; run++)
+    bench_run(label, run, cold);
+
+  for (unsigned int ph = 0; ph < sizeof(PHASES) / sizeof(PHASES[0]); ph++)
+    unlink(PHASES[ph].csv);
+  if (chdir(workdir) == -1 || rmdir(out_dir) == -1)
+    fprintf(stderr, "%s: could not remove\n", out_dir);
+  if (!existing && !keep)
+    unlink(image_path);
+  else if (!existing)
+    fprintf(stderr, "image kept at %s\n", image_path);
+  exit(0);
+}
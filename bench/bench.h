@@ -0,0 +1,107 @@
+/*
+ *  gen_params
+ *
+ *  Shape of a synthetic ext2 image. Every
+ *  group is full size and holds a backup
+ *  super block and descriptor table. Of the
+ *  inodes, 'inode_fill' are in use, as a tree
+ *  in which every directory has 'fanout'
+ *  entries: the first is a directory, and each
+ *  other one is with chance 'dir_ratio'. File
+ *  sizes are drawn from 'size_dist': 'f'ixed
+ *  at size_a bytes, 'u'niform in
+ *  [size_a, size_b], or 'e'xponential with
+ *  mean size_a. The same 'seed' gives the
+ *  same image.
+ */
+struct gen_params {
+
+  unsigned int block_size;
+  unsigned int groups;
+  unsigned int inodes_per_group;
+  double inode_fill;
+  unsigned int fanout;
+  double dir_ratio;
+  char size_dist;
+  uint64_t size_a;
+  uint64_t size_b;
+  uint64_t seed;
+
+};
+
+/*
+ *  gen
+ *
+ *  An image being generated into 'fd'. Only
+ *  metadata, directory and indirect blocks are
+ *  written; file data is left as a hole. The
+ *  bitmaps and per-group counts are kept in
+ *  memory and written out last.
+ */
+struct gen {
+
+  struct gen_params p;
+  int fd;
+  unsigned int first_data_block;
+  unsigned int block_total;
+  unsigned int inode_total;
+  unsigned int gdt_blocks;
+  unsigned int table_blocks;
+  unsigned int next_block;
+  unsigned int next_inode;
+  unsigned char *block_bitmaps;
+  unsigned char *inode_bitmaps;
+  unsigned int *dirs;
+  uint64_t rng;
+
+};
+
+/*
+ *  gen_dir
+ *
+ *  A directory waiting for its entries to be
+ *  handed out, in the generator's breadth-first
+ *  walk down the tree.
+ */
+struct gen_dir {
+
+  unsigned int inode;
+  unsigned int parent;
+
+};
+
+/*
+ *  bench_sample
+ *
+ *  The clocks and the process's I/O and fault
+ *  counters at one instant; a phase is measured
+ *  as the difference of two samples.
+ */
+struct bench_sample {
+
+  double wall;
+  double cpu;
+  unsigned long long syscr;
+  unsigned long long syscw;
+  long minflt;
+  long majflt;
+
+};
+
+/*
+ *  bench_phase
+ *
+ *  One timed phase of a dump: 'run' does the
+ *  work and writes 'csv'. 'per_inode' phases
+ *  also report inodes per second.
+ */
+struct bench_phase {
+
+  const char *name;
+  const char *csv;
+  void (*run)(void);
+  int per_inode;
+
+};
+
+void generate_image(const struct gen_params *p, const char *path);
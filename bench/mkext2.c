@@ -0,0 +1,465 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+
+
+
+const unsigned int GEN_FIRST_INO  = 11;      /* First inode not reserved for the file system itself   */
+const unsigned int GEN_ROOT_INO   = 2;       /* Inode number of the root directory                    */
+const uint32_t GEN_TIME           = 1500000000; /* Every timestamp in a generated image               */
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                               LOW LEVEL I/O                            //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+static void put_le16(unsigned char *p, unsigned int v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* Write 'len' bytes at byte 'offset' of the image.  */
+static void gen_write(struct gen *g, const void *p, size_t len, off_t offset) {
+
+  ssize_t put;
+
+  while (len > 0) {
+    if ((put = pwrite(g->fd, p, len, offset)) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("pwrite"); exit(-1);
+    }
+    p = (const char *) p + put;
+    len -= put;
+    offset += put;
+  }
+}
+
+/* xorshift64*: a small, fast generator, so a seed always gives the same image.  */
+static uint64_t gen_random(struct gen *g) {
+  g->rng ^= g->rng >> 12;
+  g->rng ^= g->rng << 25;
+  g->rng ^= g->rng >> 27;
+  return (g->rng * 2685821657736338717ULL);
+}
+
+/* A uniform double in (0, 1].  */
+static double gen_uniform(struct gen *g) {
+  return ((gen_random(g) >> 11) + 1.0) / 9007199254740992.0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                ALLOCATION                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Blocks at the start of each group taken by super block, descriptors, bitmaps and inode table.  */
+static unsigned int gen_meta_blocks(struct gen *g) {
+  return (1 + g->gdt_blocks + 2 + g->table_blocks);
+}
+
+/* Hand out the next free data block, front to back across the groups.  */
+static uint32_t gen_alloc_block(struct gen *g) {
+
+  unsigned int bpg = 8 * g->p.block_size;
+  unsigned int group, bit;
+
+  for (;;) {
+    if (g->next_block >= g->block_total) {
+      fprintf(stderr, "generated image is full; use more groups or smaller files\n");
+      exit(-1);
+    }
+    group = (g->next_block - g->first_data_block) / bpg;
+    bit = (g->next_block - g->first_data_block) % bpg;
+    if (bit >= gen_meta_blocks(g))
+      break;
+    g->next_block += gen_meta_blocks(g) - bit;
+  }
+  g->block_bitmaps[(size_t) group * g->p.block_size + bit/8] |= 1 << (bit % 8);
+  return (g->next_block++);
+}
+
+/* Hand out the next inode number, marking it in use.  */
+static uint32_t gen_alloc_inode(struct gen *g, int is_dir) {
+
+  unsigned int number = g->next_inode++;
+  unsigned int group = (number - 1) / g->p.inodes_per_group;
+  unsigned int bit = (number - 1) % g->p.inodes_per_group;
+
+  g->inode_bitmaps[(size_t) group * g->p.block_size + bit/8] |= 1 << (bit % 8);
+  if (is_dir)
+    g->dirs[group]++;
+  return number;
+}
+
+/*
+ * Allocate an indirect block 'level' levels above the data and, under
+ * it, as many of the '*left' data blocks as it can map. Physical data
+ * block numbers are appended to '*phys' (if given) and every block
+ * allocated is counted in '*used'.
+ */
+static uint32_t gen_indirect(struct gen *g, int level, uint64_t *left, uint32_t **phys, uint64_t *used) {
+
+  unsigned int per_block = g->p.block_size / 4;
+  unsigned char ptrs[g->p.block_size];
+  uint32_t self = gen_alloc_block(g);
+  uint32_t ptr;
+
+  (*used)++;
+  memset(ptrs, 0, sizeof(ptrs));
+  for (unsigned int e = 0; e < per_block && *left > 0; e++) {
+    if (level == 1) {
+      ptr = gen_alloc_block(g);
+      (*used)++;
+      (*left)--;
+      if (phys)
+	*(*phys)++ = ptr;
+    }
+    else
+      ptr = gen_indirect(g, level - 1, left, phys, used);
+    put_le32(ptrs + 4*e, ptr);
+  }
+  gen_write(g, ptrs, sizeof(ptrs), (off_t) self * g->p.block_size);
+  return self;
+}
+
+/* Map 'count' data blocks into i_block the way ext2 does; returns how many blocks that took.  */
+static uint64_t gen_block_map(struct gen *g, uint64_t count, unsigned char *i_block, uint32_t *phys) {
+
+  uint64_t used = 0;
+  uint32_t ptr;
+
+  for (int b = 0; b < 12 && count > 0; b++, count--) {
+    ptr = gen_alloc_block(g);
+    used++;
+    if (phys)
+      *phys++ = ptr;
+    put_le32(i_block + 4*b, ptr);
+  }
+  for (int level = 1; level <= 3 && count > 0; level++)
+    put_le32(i_block + 4*(11 + level), gen_indirect(g, level, &count, phys ? &phys : NULL, &used));
+  if (count > 0) {
+    fprintf(stderr, "generated file is too big for a triple indirect block map\n");
+    exit(-1);
+  }
+  return used;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                  INODES                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write inode 'number' into its group's inode table.  */
+static void gen_write_inode(struct gen *g, uint32_t number, unsigned int mode, unsigned int links,
+			    uint64_t size, uint64_t blocks, const unsigned char *i_block) {
+
+  unsigned char raw[128];
+  unsigned int group = (number - 1) / g->p.inodes_per_group;
+  unsigned int index = (number - 1) % g->p.inodes_per_group;
+  off_t table = (off_t) (g->first_data_block + (uint64_t) group * 8 * g->p.block_size + 1 + g->gdt_blocks + 2);
+
+  memset(raw, 0, sizeof(raw));
+  put_le16(raw + 0, mode);
+  put_le32(raw + 4, size);
+  put_le32(raw + 8, GEN_TIME);
+  put_le32(raw + 12, GEN_TIME);
+  put_le32(raw + 16, GEN_TIME);
+  put_le16(raw + 26, links);
+  put_le32(raw + 28, blocks * (g->p.block_size / 512));
+  memcpy(raw + 40, i_block, 60);
+  put_le32(raw + 108, size >> 32);
+  gen_write(g, raw, sizeof(raw), table * g->p.block_size + (off_t) 128 * index);
+}
+
+/* Pick a file size from the configured distribution.  */
+static uint64_t gen_file_size(struct gen *g) {
+
+  switch (g->p.size_dist) {
+    case 'u':
+      return (g->p.size_a + gen_random(g) % (g->p.size_b - g->p.size_a + 1));
+    case 'e':
+      return ((uint64_t) (-log(gen_uniform(g)) * g->p.size_a));
+    default:
+      return g->p.size_a;
+  }
+}
+
+/* Allocate and write one regular file.  */
+static uint32_t gen_file(struct gen *g) {
+
+  unsigned char i_block[60];
+  uint32_t number = gen_alloc_inode(g, 0);
+  uint64_t size = gen_file_size(g);
+  uint64_t blocks;
+
+  memset(i_block, 0, sizeof(i_block));
+  blocks = gen_block_map(g, (size + g->p.block_size - 1) / g->p.block_size, i_block, NULL);
+  gen_write_inode(g, number, 0100644, 1, size, blocks, i_block);
+  return number;
+}
+
+/*
+ * Write directory 'd' with the given entries (after '.' and '..'). Each
+ * entry takes 8 bytes plus its name rounded up to 4, and the last entry
+ * in a block stretches to the end of it.
+ */
+static void gen_write_dir(struct gen *g, const struct gen_dir *d, const uint32_t *children,
+			  const unsigned char *is_dir, unsigned int count, unsigned int subdirs) {
+
+  unsigned int bs = g->p.block_size;
+  unsigned int total = count + 2, fill, len, last;
+  char name[16];
+  uint64_t nblocks = 1;
+  unsigned char i_block[60];
+  unsigned char *data;
+  uint32_t *phys;
+  uint64_t blocks;
+
+  /* Lay the entries out once to count blocks, then again to write them.  */
+  for (int pass = 0; pass < 2; pass++) {
+    fill = 0;
+    last = 0;
+    nblocks = 1;
+    for (unsigned int e = 0; e < total; e++) {
+      if (e == 0)
+	len = snprintf(name, sizeof(name), ".");
+      else if (e == 1)
+	len = snprintf(name, sizeof(name), "..");
+      else
+	len = snprintf(name, sizeof(name), "%c%u", is_dir[e-2] ? 'd' : 'f', children[e-2]);
+      if (fill + 8 + ((len + 3) & ~3u) > bs) {
+	if (pass)
+	  put_le16(data + last + 4, (nblocks * bs) - last);
+	fill = 0;
+	nblocks++;
+      }
+      if (pass) {
+	last = (nblocks - 1) * bs + fill;
+	put_le32(data + last, e == 0 ? d->inode : e == 1 ? d->parent : children[e-2]);
+	put_le16(data + last + 4, 8 + ((len + 3) & ~3u));
+	data[last + 6] = len;
+	data[last + 7] = (e < 2 || is_dir[e-2]) ? 2 : 1;
+	memcpy(data + last + 8, name, len);
+      }
+      fill += 8 + ((len + 3) & ~3u);
+    }
+    if (pass) {
+      put_le16(data + last + 4, (nblocks * bs) - last);
+      break;
+    }
+    if ((data = calloc(nblocks, bs)) == NULL || (phys = malloc(nblocks * sizeof(uint32_t))) == NULL) {
+      perror("malloc"); exit(-1);
+    }
+  }
+
+  memset(i_block, 0, sizeof(i_block));
+  blocks = gen_block_map(g, nblocks, i_block, phys);
+  for (uint64_t b = 0; b < nblocks; b++)
+    gen_write(g, data + b*bs, bs, (off_t) phys[b] * bs);
+  gen_write_inode(g, d->inode, 040755, 2 + subdirs, nblocks * bs, blocks, i_block);
+  free(data);
+  free(phys);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                             SUPER & DESCRIPTORS                        //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write the bitmaps, and a super block and descriptor table at the start of every group.  */
+static void gen_finish(struct gen *g) {
+
+  unsigned int bs = g->p.block_size;
+  unsigned int bpg = 8 * bs;
+  unsigned int ipg = g->p.inodes_per_group;
+  unsigned char super[1024];
+  unsigned char *gdt;
+  unsigned int free_blocks = 0, free_inodes = 0;
+  unsigned int group_free_blocks, group_free_inodes;
+  off_t start;
+
+  if ((gdt = calloc(g->gdt_blocks, bs)) == NULL) {
+    perror("calloc"); exit(-1);
+  }
+
+  for (unsigned int i = 0; i < g->p.groups; i++) {
+    unsigned char *bb = g->block_bitmaps + (size_t) i * bs;
+    unsigned char *ib = g->inode_bitmaps + (size_t) i * bs;
+
+    /* Metadata is in use in every group, and the inode bitmap is padded with ones.  */
+    for (unsigned int b = 0; b < gen_meta_blocks(g); b++)
+      bb[b/8] |= 1 << (b % 8);
+    for (unsigned int b = ipg; b < bpg; b++)
+      ib[b/8] |= 1 << (b % 8);
+
+    group_free_blocks = 0;
+    for (unsigned int b = 0; b < bpg; b++)
+      group_free_blocks += !(bb[b/8] & (1 << (b % 8)));
+    group_free_inodes = 0;
+    for (unsigned int b = 0; b < ipg; b++)
+      group_free_inodes += !(ib[b/8] & (1 << (b % 8)));
+    free_blocks += group_free_blocks;
+    free_inodes += group_free_inodes;
+
+    start = g->first_data_block + (off_t) i * bpg;
+    put_le32(gdt + 32*i + 0, start + 1 + g->gdt_blocks);
+    put_le32(gdt + 32*i + 4, start + 2 + g->gdt_blocks);
+    put_le32(gdt + 32*i + 8, start + 3 + g->gdt_blocks);
+    put_le16(gdt + 32*i + 12, group_free_blocks);
+    put_le16(gdt + 32*i + 14, group_free_inodes);
+    put_le16(gdt + 32*i + 16, g->dirs[i]);
+
+    gen_write(g, bb, bs, (start + 1 + g->gdt_blocks) * bs);
+    gen_write(g, ib, bs, (start + 2 + g->gdt_blocks) * bs);
+  }
+
+  memset(super, 0, sizeof(super));
+  put_le32(super + 0, g->inode_total);
+  put_le32(super + 4, g->block_total);
+  put_le32(super + 12, free_blocks);
+  put_le32(super + 16, free_inodes);
+  put_le32(super + 20, g->first_data_block);
+  put_le32(super + 24, bs == 1024 ? 0 : bs == 2048 ? 1 : 2);
+  put_le32(super + 28, bs == 1024 ? 0 : bs == 2048 ? 1 : 2);
+  put_le32(super + 32, bpg);
+  put_le32(super + 36, bpg);
+  put_le32(super + 40, ipg);
+  put_le32(super + 44, GEN_TIME);
+  put_le32(super + 48, GEN_TIME);
+  put_le16(super + 54, 0xFFFF);
+  put_le16(super + 56, 0xEF53);
+  put_le16(super + 58, 1);
+  put_le16(super + 60, 1);
+  put_le32(super + 64, GEN_TIME);
+  put_le32(super + 76, 1);
+  put_le32(super + 84, GEN_FIRST_INO);
+  put_le16(super + 88, 128);
+  put_le32(super + 96, 0x0002);            /* Directory entries record the file type  */
+  for (int b = 0; b < 16; b++)
+    super[104 + b] = gen_random(g);
+  memcpy(super + 120, "bench", 5);
+
+  for (unsigned int i = 0; i < g->p.groups; i++) {
+    start = g->first_data_block + (off_t) i * bpg;
+    put_le16(super + 90, i);
+    gen_write(g, super, sizeof(super), i == 0 ? 1024 : start * bs);
+    gen_write(g, gdt, (size_t) g->gdt_blocks * bs, (start + 1) * bs);
+  }
+  free(gdt);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                 GENERATOR                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write a synthetic ext2 image shaped by 'p' to 'path'.  */
+void generate_image(const struct gen_params *p, const char *path) {
+
+  struct gen g;
+  struct gen_dir *queue;
+  unsigned int head = 0, tail = 0;
+  unsigned int wanted, children;
+  unsigned char empty[60];
+
+  memset(&g, 0, sizeof(g));
+  g.p = *p;
+  g.rng = p->seed ? p->seed : 1;
+  if (g.p.inodes_per_group == 0)
+    g.p.inodes_per_group = p->block_size;
+  if (g.p.inodes_per_group % (p->block_size / 128) != 0 || g.p.inodes_per_group > 8 * p->block_size) {
+    fprintf(stderr, "inodes per group must be a multiple of %u and at most %u\n",
+	    p->block_size / 128, 8 * p->block_size);
+    exit(-1);
+  }
+  g.first_data_block = (p->block_size == 1024);
+  g.block_total = g.first_data_block + p->groups * 8 * p->block_size;
+  g.inode_total = p->groups * g.p.inodes_per_group;
+  g.gdt_blocks = (32 * p->groups + p->block_size - 1) / p->block_size;
+  g.table_blocks = g.p.inodes_per_group * 128 / p->block_size;
+  g.next_block = g.first_data_block;
+  g.next_inode = 1;
+
+  g.block_bitmaps = calloc(p->groups, p->block_size);
+  g.inode_bitmaps = calloc(p->groups, p->block_size);
+  g.dirs = calloc(p->groups, sizeof(unsigned int));
+  queue = calloc(g.inode_total, sizeof(struct gen_dir));
+  if (g.block_bitmaps == NULL || g.inode_bitmaps == NULL || g.dirs == NULL || queue == NULL) {
+    perror("calloc"); exit(-1);
+  }
+
+  if ((g.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    exit(-1);
+  }
+  if (ftruncate(g.fd, (off_t) g.block_total * p->block_size) == -1) {
+    perror("ftruncate"); exit(-1);
+  }
+
+  /* Inodes up to the first usable one are reserved; the root is one of them.  */
+  while (g.next_inode <= GEN_FIRST_INO - 1)
+    gen_alloc_inode(&g, g.next_inode == GEN_ROOT_INO);
+  memset(empty, 0, sizeof(empty));
+  for (unsigned int i = 1; i < GEN_FIRST_INO; i++)
+    if (i != GEN_ROOT_INO)
+      gen_write_inode(&g, i, 0, 0, 0, 0, empty);
+
+  /* Hand out the rest breadth first, 'fanout' entries per directory.  */
+  wanted = (unsigned int) (p->inode_fill * g.inode_total);
+  if (wanted < GEN_FIRST_INO - 1)
+    wanted = GEN_FIRST_INO - 1;
+  queue[tail++] = (struct gen_dir) { GEN_ROOT_INO, GEN_ROOT_INO };
+  while (head < tail) {
+    struct gen_dir d = queue[head++];
+    uint32_t child[p->fanout];
+    unsigned char is_dir[p->fanout];
+    unsigned int subdirs = 0;
+
+    children = 0;
+    while (children < p->fanout && g.next_inode - 1 < wanted) {
+      is_dir[children] = (children == 0 || gen_uniform(&g) <= p->dir_ratio);
+      if (is_dir[children]) {
+	child[children] = gen_alloc_inode(&g, 1);
+	queue[tail++] = (struct gen_dir) { child[children], d.inode };
+	subdirs++;
+      }
+      else
+	child[children] = gen_file(&g);
+      children++;
+    }
+    gen_write_dir(&g, &d, child, is_dir, children, subdirs);
+  }
+
+  gen_finish(&g);
+  if (close(g.fd) == -1) {
+    perror("close"); exit(-1);
+  }
+  free(g.block_bitmaps);
+  free(g.inode_bitmaps);
+  free(g.dirs);
+  free(queue);
+}
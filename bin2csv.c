@@ -0,0 +1,52 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "lab3a.h"
+
+
+/* Print a table file written by 'lab3a -f binary' back out as the csv
+   lab3a would have written, to stdout or to the file given with '-o'.  */
+int main(int argc, char* argv[]) {
+
+  int opt;
+  const char *out_path = NULL;
+  struct csv_out stdout_csv;
+  struct csv_out *out = &stdout_csv;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+      case 'o':
+	out_path = optarg;
+	break;
+      default:
+	fprintf(stderr, "usage: %s [-o out.csv] table.bin\n", argv[0]);
+	exit(-1);
+    }
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "%s: name for table file not provided\n", argv[0]);
+    exit(-1);
+  }
+
+  if (out_path != NULL) {
+    if ((out = csv_open(out_path)) == NULL) {
+      perror(out_path); exit(-1);
+    }
+  }
+  else
+    csv_init(out, STDOUT_FILENO);
+
+  if (table_to_csv(argv[optind], out) != 0) {
+    perror(argv[optind]); exit(-1);
+  }
+
+  csv_flush(out);
+  if (out_path != NULL && csv_close(out) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  exit(0);
+}
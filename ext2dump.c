@@ -0,0 +1,4907 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#include "lab3a.h"
+
+
+
+struct super_block sb;                      /* Stores the values to be reported in 'super.csv'       */ 
+const int SUPER_OFFSET            = 1024;   /* Offset of super block from beginning of file system.  */
+const int I_CNT_OFFSET            = 0;      /* Rest are offsets from beginning of super block:       */
+const int B_CNT_OFFSET            = 4;          /* Total number of blocks                            */
+const int FIRST_DATA_BLOCK_OFFSET = 20;         /* Superblock's block number                         */
+const int B_SIZ_OFFSET            = 24;         /* Block size                                        */
+const int F_SIZ_OFFSET            = 28;         /* Fragment size                                     */
+const int B_GRP_OFFSET            = 32;         /* Blocks per group                                  */
+const int F_GRP_OFFSET            = 36;         /* Fragments per group                               */
+const int I_GRP_OFFSET            = 40;         /* Inodes per group                                  */
+const int MAGIC_OFFSET            = 56;         /* Magic number                                      */
+const int REV_LEVEL_OFFSET        = 76;         /* Revision level; revision 0 has 128-byte inodes    */
+const int FIRST_INO_OFFSET        = 84;         /* First inode that isn't reserved                   */
+const int INODE_SIZE_OFFSET       = 88;         /* Size of an entry in the inode table               */
+const int COMPAT_OFFSET           = 92;         /* Compatible feature flags                          */
+const int INCOMPAT_OFFSET         = 96;         /* Incompatible feature flags                        */
+const int RO_COMPAT_OFFSET        = 100;        /* Read-only compatible feature flags                */
+const int RESERVED_GDT_OFFSET     = 206;        /* Blocks kept after the descriptors for growing     */
+const int DESC_SIZE_OFFSET        = 254;        /* Size of a group descriptor (64bit)                */
+const int B_CNT_HIGH_OFFSET       = 336;        /* High half of the block count (64bit)              */
+const int FLEX_OFFSET             = 372;        /* Log2 of the groups per flex group (flex_bg)       */
+const int BACKUP_GROUPS_OFFSET    = 588;        /* The two groups with backups (sparse_super2)       */
+const unsigned int EXT2_MAGIC     = 0xEF53;     /* What the magic number must be                     */
+const int MAX_LOG_BLOCK_SIZE      = 6;          /* Blocks are 1024 << 0..6 bytes (64K at most)       */
+int END_OF_SUPER;                           /* Computed once we have found block size for system     */
+
+                                            /* Features that change how the image is read:           */
+const unsigned int COMPAT_RESIZE_INODE     = 0x0010;  /* Reserved GDT blocks follow the descriptors     */
+const unsigned int COMPAT_SPARSE_SUPER2    = 0x0200;  /* Backups only in the two groups named           */
+const unsigned int INCOMPAT_EXTENTS        = 0x0040;  /* Files may map their blocks with extent trees   */
+const unsigned int INCOMPAT_64BIT          = 0x0080;  /* Group descriptors are s_desc_size bytes        */
+const unsigned int INCOMPAT_FLEX_BG        = 0x0200;  /* Bitmaps and inode tables packed per flex group */
+const unsigned int INCOMPAT_UNSUPPORTED    = 0x9019;  /* Compression, meta_bg, inline data and such    */
+const unsigned int RO_COMPAT_SPARSE_SUPER  = 0x0001;  /* Backups in groups 0, 1 and powers of 3, 5, 7   */
+const unsigned int RO_COMPAT_GDT_CSUM      = 0x0010;  /* Descriptors have checksums and flags           */
+const unsigned int RO_COMPAT_METADATA_CSUM = 0x0400;  /* So does everything else                        */
+const unsigned int RO_COMPAT_UNSUPPORTED   = 0x0200;  /* Bigalloc: the bitmaps count clusters           */
+
+unsigned int DESCRIPTOR_COUNT = 0;          /* Total number of groups / group descriptors in system  */
+struct group_descr *gd;                     /* Stores fields of the group descriptor                 */
+static unsigned char **uninit_bitmaps;      /* Block bitmaps made up for BLOCK_UNINIT groups         */
+                                            /* Rest are offsets from beginning of group descriptor:  */
+const int B_FREE_OFFSET   = 12;                 /* Number of free blocks per group                   */
+const int I_FREE_OFFSET   = 14;                 /* Number of free inodes per group                   */
+const int D_USED_OFFSET   = 16;                 /* Number of directories per group                   */
+const int I_BITMAP_OFFSET = 4;                  /* Block id of inode bitmap for a group              */
+const int B_BITMAP_OFFSET = 0;                  /* Block id of block bitmap for a group              */
+const int I_TABLE_OFFSET  = 8;                  /* Block id of inode table for a group               */
+const int G_FLAGS_OFFSET  = 18;                 /* Which of the group's bitmaps were never written   */
+const int B_FREE_HIGH_OFFSET = 44;              /* High halves of the three counts, in descriptors   */
+const int I_FREE_HIGH_OFFSET = 46;              /*   of 64 bytes or more                             */
+const int D_USED_HIGH_OFFSET = 48;
+int GROUP_DESC_SIZE = 32;                       /* Size of a block group descriptor                  */
+const unsigned int BG_INODE_UNINIT = 0x1;       /* Flags: no inode is in use, whatever the bitmap    */
+const unsigned int BG_BLOCK_UNINIT = 0x2;       /*   and the block bitmap was never written          */
+
+                                           /* These are all offsets from start of inode table entry  */ 
+const int I_MODE_OFFSET       = 0;
+const int I_UID_OFFSET        = 2;
+const int I_GID_OFFSET        = 24;
+const int I_LINK_COUNT_OFFSET = 26;
+const int I_CREATE_OFFSET     = 12;
+const int I_MOD_OFFSET        = 16;
+const int I_ACCESS_OFFSET     = 8;
+const int I_SIZE_OFFSET       = 4;
+const int I_BLOCK_OFFSET      = 28;
+const int B_PTRS_OFFSET       = 40;
+const int I_DELETE_OFFSET     = 20;
+const int I_FLAGS_OFFSET      = 32;
+const int I_GENERATION_OFFSET = 100;
+const int I_FILE_ACL_OFFSET   = 104;
+const int I_SIZE_HIGH_OFFSET  = 108;
+const int I_FADDR_OFFSET      = 112;
+const int I_UID_HIGH_OFFSET   = 120;
+const int I_GID_HIGH_OFFSET   = 122;
+int INODE_SIZE                = 128;        /* Size of an entry in the inode table (s_inode_size)    */
+
+/* Computes offset into file system, based on the given block number / block ID.  */
+off_t compute_offset(unsigned int block_num) {
+  return ((off_t) block_num * sb.block_size);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                STATISTICS                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+struct stats stats = { .current = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static double stats_clock(clockid_t clock) {
+
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* The running totals as they are right now, in the shape of a phase.  */
+static void stats_sample(struct stats_phase *p) {
+
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  p->wall = stats_clock(CLOCK_MONOTONIC);
+  p->cpu = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+  p->read_bytes = __atomic_load_n(&stats.read_bytes, __ATOMIC_RELAXED);
+  p->read_calls = __atomic_load_n(&stats.read_calls, __ATOMIC_RELAXED);
+  p->write_bytes = __atomic_load_n(&stats.write_bytes, __ATOMIC_RELAXED);
+  p->write_calls = __atomic_load_n(&stats.write_calls, __ATOMIC_RELAXED);
+  p->minflt = ru.ru_minflt;
+  p->majflt = ru.ru_majflt;
+}
+
+/* Count one read() of the image or one write() of an output file.  */
+static void stats_read(ssize_t bytes) {
+  __atomic_add_fetch(&stats.read_calls, 1, __ATOMIC_RELAXED);
+  if (bytes > 0)
+    __atomic_add_fetch(&stats.read_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static void stats_write(ssize_t bytes) {
+  __atomic_add_fetch(&stats.write_calls, 1, __ATOMIC_RELAXED);
+  if (bytes > 0)
+    __atomic_add_fetch(&stats.write_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Close the phase in progress, if any, charging it with everything since it began.  */
+void stats_end(void) {
+
+  struct stats_phase now, *p;
+
+  if (stats.current < 0)
+    return;
+  stats_sample(&now);
+
+  pthread_mutex_lock(&stats.lock);
+  p = &stats.phases[stats.current];
+  p->wall = now.wall - stats.begun.wall;
+  p->cpu = now.cpu - stats.begun.cpu;
+  p->read_bytes = now.read_bytes - stats.begun.read_bytes;
+  p->read_calls = now.read_calls - stats.begun.read_calls;
+  p->write_bytes = now.write_bytes - stats.begun.write_bytes;
+  p->write_calls = now.write_calls - stats.begun.write_calls;
+  p->minflt = now.minflt - stats.begun.minflt;
+  p->majflt = now.majflt - stats.begun.majflt;
+  stats.current = -1;
+  pthread_mutex_unlock(&stats.lock);
+}
+
+/* End the current phase and start timing a new one.  */
+void stats_begin(const char *name) {
+
+  struct stats_phase *p;
+
+  stats_end();
+
+  pthread_mutex_lock(&stats.lock);
+  if (stats.start == 0)
+    stats.start = stats_clock(CLOCK_MONOTONIC);
+  stats.phases = realloc(stats.phases, (stats.phase_count + 1) * sizeof(struct stats_phase));
+  if (stats.phases == NULL) {
+    perror("realloc"); exit(-1);
+  }
+  p = &stats.phases[stats.phase_count];
+  memset(p, 0, sizeof(*p));
+  p->name = name;
+  stats.groups_done = 0;
+  stats.groups_due = DESCRIPTOR_COUNT;
+  stats_sample(&stats.begun);
+  stats.current = stats.phase_count++;
+  pthread_mutex_unlock(&stats.lock);
+}
+
+/* Run fn on one group, adding how long it took to the current phase.  */
+static void run_group(group_fn fn, unsigned int group, struct csv_out **out, void *arg) {
+
+  struct stats_phase *p;
+  double start = stats_clock(CLOCK_MONOTONIC);
+  double us;
+  size_t mark = cache_hold();
+  unsigned int b, n, i;
+  const unsigned int keep = sizeof(p->slowest) / sizeof(p->slowest[0]);
+  const unsigned int buckets = sizeof(p->histogram) / sizeof(p->histogram[0]);
+
+  /* A diff run skips the groups that haven't changed.  */
+  if (GROUP_SELECT != NULL && !GROUP_SELECT[group]) {
+    pthread_mutex_lock(&stats.lock);
+    stats.groups_done++;
+    pthread_mutex_unlock(&stats.lock);
+    return;
+  }
+
+  /* Anything the group pinned in the block cache is let go as soon as it returns.  */
+  fn(group, out, arg);
+  cache_release(mark);
+  us = (stats_clock(CLOCK_MONOTONIC) - start) * 1e6;
+
+  pthread_mutex_lock(&stats.lock);
+  stats.groups_done++;
+  if (stats.current >= 0) {
+    p = &stats.phases[stats.current];
+    p->groups++;
+    for (b = 0; b < buckets - 1 && us >= (double) (1u << b); b++)
+      ;
+    p->histogram[b]++;
+
+    /* Keep the slowest groups sorted, slowest first.  */
+    n = p->slowest_count;
+    if (n < keep || us > p->slowest_us[n - 1]) {
+      i = (n < keep) ? n++ : n - 1;
+      for (; i > 0 && p->slowest_us[i - 1] < us; i--) {
+	p->slowest[i] = p->slowest[i - 1];
+	p->slowest_us[i] = p->slowest_us[i - 1];
+      }
+      p->slowest[i] = group;
+      p->slowest_us[i] = us;
+      p->slowest_count = n;
+    }
+  }
+  pthread_mutex_unlock(&stats.lock);
+}
+
+/* Print a line on stderr every 'progress_every' seconds until told to stop.  */
+static void *stats_progress_thread(void *arg) {
+
+  struct timespec until;
+  struct rusage ru;
+  double at;
+
+  (void) arg;
+  pthread_mutex_lock(&stats.lock);
+  while (stats.progress_running) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    at = until.tv_nsec / 1e9 + stats.progress_every;
+    until.tv_sec += (time_t) at;
+    until.tv_nsec = (at - (time_t) at) * 1e9;
+    pthread_cond_timedwait(&stats.wake, &stats.lock, &until);
+    if (!stats.progress_running)
+      break;
+
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "%s: %s, %u of %u groups, %.1f MB read, %ld major faults, %.1f s\n",
+	    img.path ? img.path : "lab3a", stats.current >= 0 ? stats.phases[stats.current].name : "-",
+	    stats.groups_done, stats.groups_due, __atomic_load_n(&stats.read_bytes, __ATOMIC_RELAXED) / 1e6,
+	    ru.ru_majflt, stats_clock(CLOCK_MONOTONIC) - stats.start);
+  }
+  pthread_mutex_unlock(&stats.lock);
+  return NULL;
+}
+
+/* Start printing progress every 'seconds' seconds; 0 stops it again.  */
+void stats_progress(double seconds) {
+
+  if (seconds > 0 && !stats.progress_running) {
+    if (stats.start == 0)
+      stats.start = stats_clock(CLOCK_MONOTONIC);
+    stats.progress_every = seconds;
+    stats.progress_running = 1;
+    /* Progress is only a nicety; without a thread for it, run without.  */
+    if (pthread_create(&stats.progress, NULL, stats_progress_thread, NULL) != 0)
+      stats.progress_running = 0;
+  }
+  else if (seconds <= 0 && stats.progress_running) {
+    pthread_mutex_lock(&stats.lock);
+    stats.progress_running = 0;
+    pthread_cond_signal(&stats.wake);
+    pthread_mutex_unlock(&stats.lock);
+    pthread_join(stats.progress, NULL);
+  }
+}
+
+static void json_string(FILE *f, const char *s) {
+
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char) *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+/*
+ * Write everything counted so far as one JSON object to 'path' ('-' for
+ * stdout), ending the phase in progress. Returns 0, or -1 if the report
+ * could not be written.
+ */
+int stats_report(const char *path) {
+
+  FILE *f;
+  struct stats_phase total, *p;
+  uint64_t lookups = stats.cache_hits + stats.cache_misses;
+  int ret;
+
+  stats_end();
+  if (strcmp(path, "-") == 0)
+    f = stdout;
+  else if ((f = fopen(path, "w")) == NULL)
+    return -1;
+
+  stats_sample(&total);
+  fprintf(f, "{\"image\":");
+  json_string(f, img.path ? img.path : "");
+  fprintf(f, ",\"block_size\":%u,\"groups\":%u,\"jobs\":%u,\"streaming\":%d,\"wall_s\":%.6f,\"cpu_s\":%.6f,"
+	  "\"read_bytes\":%llu,\"read_calls\":%llu,\"write_bytes\":%llu,\"write_calls\":%llu,"
+	  "\"minor_faults\":%ld,\"major_faults\":%ld,\n \"phases\":[",
+	  sb.block_size, DESCRIPTOR_COUNT, JOB_COUNT, img.streaming,
+	  stats.start ? total.wall - stats.start : 0, total.cpu,
+	  (unsigned long long) total.read_bytes, (unsigned long long) total.read_calls,
+	  (unsigned long long) total.write_bytes, (unsigned long long) total.write_calls,
+	  total.minflt, total.majflt);
+
+  for (int k = 0; k < stats.phase_count; k++) {
+    p = &stats.phases[k];
+    fprintf(f, "%s\n  {\"name\":", k ? "," : "");
+    json_string(f, p->name);
+    fprintf(f, ",\"wall_s\":%.6f,\"cpu_s\":%.6f,\"read_bytes\":%llu,\"read_calls\":%llu,"
+	    "\"write_bytes\":%llu,\"write_calls\":%llu,\"minor_faults\":%ld,\"major_faults\":%ld,\"groups\":%u",
+	    p->wall, p->cpu, (unsigned long long) p->read_bytes, (unsigned long long) p->read_calls,
+	    (unsigned long long) p->write_bytes, (unsigned long long) p->write_calls,
+	    p->minflt, p->majflt, p->groups);
+
+    /* Only the buckets something landed in.  */
+    fprintf(f, ",\"group_us_histogram\":[");
+    for (unsigned int b = 0, first = 1; b < sizeof(p->histogram) / sizeof(p->histogram[0]); b++) {
+      if (p->histogram[b] == 0)
+	continue;
+      fprintf(f, "%s{\"below_us\":%u,\"count\":%llu}", first ? "" : ",", 1u << b,
+	      (unsigned long long) p->histogram[b]);
+      first = 0;
+    }
+    fprintf(f, "],\"slowest_groups\":[");
+    for (unsigned int i = 0; i < p->slowest_count; i++)
+      fprintf(f, "%s{\"group\":%u,\"us\":%.1f}", i ? "," : "", p->slowest[i], p->slowest_us[i]);
+    fprintf(f, "]}");
+  }
+
+  fprintf(f, "],\n \"cache\":{\"hits\":%llu,\"misses\":%llu,\"hit_rate\":",
+	  (unsigned long long) stats.cache_hits, (unsigned long long) stats.cache_misses);
+  if (lookups)
+    fprintf(f, "%.4f},\n", (double) stats.cache_hits / lookups);
+  else
+    fprintf(f, "null},\n");
+  fprintf(f, " \"holes\":{\"data_runs\":%u,\"hole_bytes\":%llu,\"reads\":%llu}}\n",
+	  img.run_count, (unsigned long long) img.hole_bytes, (unsigned long long) stats.hole_reads);
+
+  ret = (f == stdout) ? fflush(f) : fclose(f);
+  return (ret == 0 ? 0 : -1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                              IMAGE READER                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+struct image img;                           /* The image every pass decodes from                     */
+struct index idx;                           /* The index given to open_index(), once loaded          */
+/* The blocks of a cached image that are in memory.  */
+struct block_cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .loaded = PTHREAD_COND_INITIALIZER };
+const size_t READ_CHUNK = 1 << 20;          /* Size of each read() when the image can't be mapped    */
+static unsigned char hole_zeros[1 << 16];   /* What any read inside a hole sees (a block at most)    */
+static __thread unsigned int thread_failures;  /* What went wrong on this thread, for read_result()  */
+static __thread int thread_error;           /* The errno of the last of them                         */
+
+/* Note something that went wrong with the image: count it, keep the first
+   one's errno and description in 'img', and return -1 with errno set.  */
+static int image_fail(int error, const char *format, ...) {
+
+  va_list ap;
+  int none = 0;
+
+  thread_failures++;
+  thread_error = error;
+  __atomic_fetch_add(&img.failures, 1, __ATOMIC_RELAXED);
+  if (__atomic_compare_exchange_n(&img.error, &none, error, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    va_start(ap, format);
+    vsnprintf(img.error_text, sizeof(img.error_text), format, ap);
+    va_end(ap);
+  }
+  errno = error;
+  return -1;
+}
+
+/* What an entry point returns that took 'failures' from thread_failures as
+   it began: -1 (with errno set) if anything failed since, or 'result'.  */
+static int read_result(unsigned int failures, int result) {
+  if (thread_failures == failures)
+    return result;
+  errno = thread_error;
+  return -1;
+}
+
+/* The same for a group pass, whose reads may have been on any thread.  */
+static int pass_result(unsigned int failures) {
+  if (__atomic_load_n(&img.failures, __ATOMIC_RELAXED) == failures)
+    return 0;
+  errno = img.error;
+  return -1;
+}
+
+/* Pull the whole of a non-mappable input (an odd device) into memory.  */
+static int slurp_image(void) {
+
+  size_t capacity = 0;
+  unsigned char *grown;
+  ssize_t got;
+
+  img.size = 0;
+  img.data = NULL;
+  for (;;) {
+    if (img.size + READ_CHUNK > capacity) {
+      capacity = capacity ? 2 * capacity : 16 * READ_CHUNK;
+      if ((grown = realloc(img.data, capacity)) == NULL)
+	return image_fail(ENOMEM, "%s", img.path);
+      img.data = grown;
+    }
+    got = read(img.fd, img.data + img.size, READ_CHUNK);
+    stats_read(got);
+    if (got == -1) {
+      if (errno == EINTR)
+	continue;
+      return image_fail(errno, "%s", img.path);
+    }
+    if (got == 0)
+      break;
+    img.size += got;
+  }
+  img.mapped = 0;
+  return 0;
+}
+
+/*
+ * Ask the file system which parts of a sparse image file hold data, with
+ * SEEK_DATA and SEEK_HOLE, and keep them in img.runs. A file that is one
+ * run of data, or whose file system can't say, is left with no runs, and
+ * every read goes to the file.
+ */
+static void find_holes(void) {
+
+  off_t data, hole = 0;
+  unsigned int cap = 0;
+  int failed = 0;
+
+  img.run_count = 0;
+  img.hole_bytes = 0;
+  while (hole < (off_t) img.size) {
+
+    /* No data past 'hole' (ENXIO) means the rest of the file is one hole.  */
+    if ((data = lseek(img.fd, hole, SEEK_DATA)) == -1) {
+      failed = (errno != ENXIO);
+      data = img.size;
+    }
+    if (failed)
+      break;
+    if (data > (off_t) img.size)
+      data = img.size;
+    img.hole_bytes += data - hole;
+    if (data == (off_t) img.size)
+      break;
+    if ((hole = lseek(img.fd, data, SEEK_HOLE)) == -1) {
+      failed = 1;
+      break;
+    }
+    if (img.run_count == cap) {
+      cap = cap ? 2*cap : 64;
+      if ((img.runs = realloc(img.runs, 2 * cap * sizeof(off_t))) == NULL) {
+	perror("realloc"); exit(-1);
+      }
+    }
+    img.runs[2*img.run_count] = data;
+    img.runs[2*img.run_count + 1] = hole;
+    img.run_count++;
+  }
+
+  /* Leave out a file with no holes, or one that couldn't be walked to its end.  */
+  if (failed || img.hole_bytes == 0) {
+    free(img.runs);
+    img.runs = NULL;
+    img.run_count = 0;
+    img.hole_bytes = 0;
+  }
+}
+
+/* How many of the 'len' bytes at 'offset' are, like the first of them, all
+   in a hole or all data; '*hole' says which.  */
+static size_t hole_span(off_t offset, size_t len, int *hole) {
+
+  unsigned int lo = 0, hi = img.run_count, mid;
+  off_t edge;
+
+  /* Find the first run of data that ends after 'offset'.  */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (img.runs[2*mid + 1] <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < img.run_count && img.runs[2*lo] <= offset) {
+    *hole = 0;
+    edge = img.runs[2*lo + 1];
+  }
+  else {
+    *hole = (img.run_count > 0);
+    edge = (lo < img.run_count) ? img.runs[2*lo] : offset + (off_t) len;
+  }
+  return ((size_t) (edge - offset) < len) ? (size_t) (edge - offset) : len;
+}
+
+/* Whether all 'len' bytes at 'offset' lie in holes of the image, and so read as zeros.  */
+static int image_hole(off_t offset, size_t len) {
+
+  int hole;
+
+  return (img.run_count > 0 && hole_span(offset, len, &hole) == len && hole);
+}
+
+/* Open the image and make all of it addressable through img.data; 0 or -1.  */
+int open_image(const char *path) {
+
+  struct stat st;
+  off_t end;
+  void *map;
+
+  img.path = path;
+  if (strcmp(path, "-") == 0)
+    img.fd = STDIN_FILENO;
+  else if ((img.fd = open(path, O_RDONLY)) == -1)
+    return image_fail(errno, "%s", path);
+  if (fstat(img.fd, &st) == -1)
+    return image_fail(errno, "%s", path);
+  img.mtime = st.st_mtim;
+
+  /* Pipes can't be mapped or read twice; take them in a single forward pass.  */
+  if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+    img.data = NULL;
+    img.size = 0;
+    img.mapped = 0;
+    img.streaming = 1;
+    return 0;
+  }
+
+  /* Regular files know their size; block devices have to be asked.  */
+  end = -1;
+  if (S_ISREG(st.st_mode))
+    end = st.st_size;
+  else if (S_ISBLK(st.st_mode))
+    end = lseek(img.fd, 0, SEEK_END);
+
+  if (end > 0) {
+    img.size = end;
+    if (S_ISREG(st.st_mode))
+      find_holes();
+    if (CACHE_SIZE == 0) {
+      map = mmap(NULL, end, PROT_READ, MAP_PRIVATE, img.fd, 0);
+      if (map != MAP_FAILED) {
+	img.data = map;
+	img.mapped = 1;
+	return 0;
+      }
+    }
+    /* Asked not to map it ('-C'), or it can't be: read blocks as they are wanted.  */
+    img.cached = 1;
+    return 0;
+  }
+  return slurp_image();
+}
+
+const unsigned char *stream_ptr(off_t offset, size_t len);
+static const unsigned char *cache_ptr(off_t offset, size_t len);
+static void cache_close(void);
+static void cache_prefetch(off_t offset, size_t len);
+
+/* Bounds-checked pointer to 'len' bytes of the image at 'offset', or NULL
+   if they can't be read.  */
+const unsigned char *image_ptr(off_t offset, size_t len) {
+  if (img.streaming && (offset < 0 || (size_t) offset > img.size || len > img.size - offset))
+    return stream_ptr(offset, len);
+  if (offset < 0 || (size_t) offset > img.size || len > img.size - offset) {
+    image_fail(EIO, "%s: read of %zu bytes at offset %lld is past end of image", img.path, len, (long long) offset);
+    return NULL;
+  }
+  if (len <= sizeof(hole_zeros) && image_hole(offset, len)) {
+    __atomic_fetch_add(&stats.hole_reads, 1, __ATOMIC_RELAXED);
+    return hole_zeros;
+  }
+  if (img.cached)
+    return cache_ptr(offset, len);
+  return (img.data + offset);
+}
+
+/* Pointer to the contents of the given block, or NULL if it can't be read.  */
+const unsigned char *read_block(unsigned int block_num) {
+  return image_ptr(compute_offset(block_num), sb.block_size);
+}
+
+/* Values in the file system are little endian.  */
+unsigned int get_le16(const unsigned char *p) {
+  return ((p[0]<<0) | (p[1]<<8));
+}
+
+unsigned int get_le32(const unsigned char *p) {
+  return ((p[0]<<0) | (p[1]<<8) | (p[2]<<16) | ((unsigned int) p[3]<<24));
+}
+
+
+/* Let go of the image and everything decoded from it, so that another can be opened.  */
+void close_image(void) {
+
+  cache_close();
+  free(img.runs);
+  if (img.mapped)
+    munmap(img.data, img.size);
+  else
+    free(img.data);
+  if (img.fd != STDIN_FILENO)
+    close(img.fd);
+  memset(&img, 0, sizeof(img));
+
+  if (idx.loaded) {
+    if (idx.mapped)
+      munmap(idx.data, idx.size);
+    else
+      free(idx.data);
+  }
+  memset(&idx, 0, sizeof(idx));
+
+  for (unsigned int i = 0; uninit_bitmaps != NULL && i < DESCRIPTOR_COUNT; i++)
+    free(uninit_bitmaps[i]);
+  free(uninit_bitmaps);
+  uninit_bitmaps = NULL;
+  free(gd);
+  gd = NULL;
+  DESCRIPTOR_COUNT = 0;
+}
+
+/* Ask the kernel to start reading a range of the image in ahead of use.  */
+void prefetch_range(off_t offset, size_t len) {
+
+  long page = sysconf(_SC_PAGESIZE);
+  off_t start;
+
+  if (!(img.mapped || img.cached) || offset < 0 || (size_t) offset >= img.size)
+    return;
+  if (len > img.size - offset)
+    len = img.size - offset;
+  if (image_hole(offset, len))
+    return;
+  if (img.cached) {
+    cache_prefetch(offset, len);
+    return;
+  }
+  start = offset & ~((off_t) page - 1);
+  madvise(img.data + start, len + (offset - start), MADV_WILLNEED);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                BLOCK CACHE                             //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+size_t CACHE_SIZE = 0;                      /* Bytes of block cache ('-C'); 0 maps the image instead */
+const size_t DEFAULT_CACHE_SIZE = 64 << 20; /* Cache for an image that can't be mapped               */
+const unsigned int MIN_CACHE_SLOTS = 64;    /* Enough for every worker's bitmaps and table block     */
+
+static __thread struct cache_pins pins;     /* Slots pinned by this thread                           */
+
+/* pread() 'len' bytes at 'offset'; bytes past the end of the image, or in its
+   holes, read as zeros. Returns 0 or the errno it failed with.  */
+static int read_exact(unsigned char *buf, size_t len, off_t offset) {
+
+  ssize_t got;
+  size_t span;
+  int hole;
+
+  if ((size_t) offset + len > img.size) {
+    memset(buf + (img.size - offset), 0, (size_t) offset + len - img.size);
+    len = img.size - offset;
+  }
+  while (len > 0) {
+    span = hole_span(offset, len, &hole);
+    if (hole) {
+      memset(buf, 0, span);
+      buf += span;
+      len -= span;
+      offset += span;
+      continue;
+    }
+    got = pread(img.fd, buf, span, offset);
+    stats_read(got);
+    if (got == -1) {
+      if (errno == EINTR)
+	continue;
+      return errno;
+    }
+    if (got == 0)                           /* The image shrank under us  */
+      return EIO;
+    buf += got;
+    len -= got;
+    offset += got;
+  }
+  return 0;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+
+const unsigned int URING_ENTRIES = 256;     /* Most reads the ring has in flight at once             */
+
+/* The ring, when the kernel offers one; otherwise blocks are read on demand with pread().  */
+struct uring ring = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#ifdef IORING_OFF_SQ_RING
+/* A read the ring finished: top it up with pread() if it came back short, then hand the slot over.  */
+static void uring_complete(struct cache_slot *s, int res) {
+
+  stats_read(res);
+  if (res < 0)
+    res = 0;
+  if ((unsigned int) res < sb.block_size)
+    s->error = read_exact(s->data + res, sb.block_size - res, compute_offset(s->block) + res);
+
+  pthread_mutex_lock(&cache.lock);
+  s->ready = 1;
+  s->pins--;
+  ring.in_flight--;
+  pthread_cond_broadcast(&cache.loaded);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/* Runs on its own thread: wait for completions and deal with them as they come, until the NOP
+   with no slot sent by uring_close().  */
+static void *uring_reaper(void *arg) {
+
+  unsigned int head, tail;
+  struct io_uring_cqe *cqe;
+  int done = 0;
+
+  (void) arg;
+  while (!done) {
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+	perror("io_uring_enter"); exit(-1);
+      }
+      continue;
+    }
+    for (; head != tail; head++) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      if (cqe->user_data == 0)
+	done = 1;
+      else
+	uring_complete((struct cache_slot *) (uintptr_t) cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* Put one request (a read of 'block' into slot 's') on the submission queue;
+   uring_submit() hands it to the kernel.  */
+static void uring_queue(int opcode, struct cache_slot *s, unsigned int block) {
+
+  unsigned int tail = *ring.sq_tail;
+  unsigned int slot = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[slot];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = img.fd;
+  if (s != NULL) {
+    sqe->off = compute_offset(block);
+    sqe->addr = (uintptr_t) s->data;
+    sqe->len = sb.block_size;
+    sqe->user_data = (uintptr_t) s;
+  }
+  ring.sq_array[slot] = slot;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+}
+
+static void uring_submit(void) {
+
+  int got;
+
+  while (ring.queued > 0) {
+    got = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 0, 0, NULL, 0);
+    if (got == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      perror("io_uring_enter"); exit(-1);
+    }
+    ring.queued -= got;
+  }
+}
+#endif
+
+#ifdef IORING_OFF_SQ_RING
+/* Take down whatever of the ring got mapped, and the ring itself.  */
+static void uring_unmap(void) {
+  if (ring.sqes != MAP_FAILED)
+    munmap(ring.sqes, ring.sqes_size);
+  if (ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring)
+    munmap(ring.cq_ring, ring.cq_ring_size);
+  if (ring.sq_ring != MAP_FAILED)
+    munmap(ring.sq_ring, ring.sq_ring_size);
+  close(ring.fd);
+}
+#endif
+
+/* Set up the ring and its reaper. Kernels without io_uring (or sandboxes that
+   forbid it, or can't spare what it needs) just leave it inactive.  */
+static void uring_open(void) {
+#ifdef IORING_OFF_SQ_RING
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1)
+    return;
+
+  ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cq_ring_size > ring.sq_ring_size)
+      ring.sq_ring_size = ring.cq_ring_size;
+    ring.cq_ring_size = 0;
+  }
+  ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      ring.fd, IORING_OFF_SQ_RING);
+  ring.cq_ring = ring.cq_ring_size == 0 ? ring.sq_ring :
+    mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ring.fd, IORING_OFF_SQES);
+  if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+    uring_unmap();
+    return;
+  }
+
+  sq = ring.sq_ring;
+  cq = ring.cq_ring;
+  ring.sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned int *) (sq + p.sq_off.array);
+  ring.cq_head = (unsigned int *) (cq + p.cq_off.head);
+  ring.cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  ring.entries = p.sq_entries;
+  ring.queued = 0;
+  ring.in_flight = 0;
+
+  if (pthread_create(&ring.reaper, NULL, uring_reaper, NULL) != 0) {
+    uring_unmap();
+    return;
+  }
+  ring.active = 1;
+#endif
+}
+
+/* Wait out every read still in flight, stop the reaper and take the ring down.  */
+static void uring_close(void) {
+#ifdef IORING_OFF_SQ_RING
+  if (!ring.active)
+    return;
+  pthread_mutex_lock(&cache.lock);
+  while (ring.in_flight > 0)
+    pthread_cond_wait(&cache.loaded, &cache.lock);
+  pthread_mutex_unlock(&cache.lock);
+
+  pthread_mutex_lock(&ring.lock);
+  uring_queue(IORING_OP_NOP, NULL, 0);
+  uring_submit();
+  pthread_mutex_unlock(&ring.lock);
+  pthread_join(ring.reaper, NULL);
+  uring_unmap();
+  ring.active = 0;
+#endif
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+
+/* Lay out the slab, which can only happen once the block size is known.  */
+static void cache_init(void) {
+
+  size_t bytes = CACHE_SIZE ? CACHE_SIZE : DEFAULT_CACHE_SIZE;
+  unsigned int buckets = 1;
+
+  cache.slot_count = bytes / sb.block_size;
+  if (cache.slot_count < MIN_CACHE_SLOTS + 2*JOB_COUNT)
+    cache.slot_count = MIN_CACHE_SLOTS + 2*JOB_COUNT;
+  while (buckets < 2*cache.slot_count)
+    buckets <<= 1;
+
+  cache.slots = calloc(cache.slot_count, sizeof(struct cache_slot));
+  cache.slab = malloc((size_t) cache.slot_count * sb.block_size);
+  cache.buckets = calloc(buckets, sizeof(struct cache_slot *));
+  if (cache.slots == NULL || cache.slab == NULL || cache.buckets == NULL) {
+    perror("malloc"); exit(-1);
+  }
+  for (unsigned int i = 0; i < cache.slot_count; i++)
+    cache.slots[i].data = cache.slab + (size_t) i * sb.block_size;
+  cache.bucket_mask = buckets - 1;
+  cache.hand = 0;
+  uring_open();
+}
+
+/* Free the slab once nothing can be reading into it.  */
+static void cache_close(void) {
+  uring_close();
+  cache_release(0);
+  free(cache.slots);
+  free(cache.slab);
+  free(cache.buckets);
+  cache.slots = NULL;
+  cache.slab = NULL;
+  cache.buckets = NULL;
+}
+
+static void cache_note_pin(struct cache_slot *s) {
+  if (pins.count == pins.cap) {
+    pins.cap = pins.cap ? 2*pins.cap : 64;
+    if ((pins.held = realloc(pins.held, pins.cap * sizeof(struct cache_slot *))) == NULL) {
+      perror("realloc"); exit(-1);
+    }
+  }
+  pins.held[pins.count++] = s;
+}
+
+/* A private, pinned copy of a read that spans blocks, comes before the block
+   size is known, or finds every slot pinned.  */
+static struct cache_slot *cache_spill(off_t offset, size_t len) {
+
+  struct cache_slot *s = calloc(1, sizeof(struct cache_slot));
+
+  if (s == NULL || (s->data = malloc(len ? len : 1)) == NULL) {
+    perror("malloc"); exit(-1);
+  }
+  s->error = read_exact(s->data, len, offset);
+  s->pins = 1;
+  s->ready = 1;
+  s->spill = 1;
+  cache_note_pin(s);
+  return s;
+}
+
+/* The next slot under the clock hand that is unpinned and was not used since the hand last passed.  */
+static struct cache_slot *cache_victim(void) {
+
+  struct cache_slot *s;
+
+  for (unsigned int scanned = 0; scanned < 2*cache.slot_count; scanned++) {
+    s = &cache.slots[cache.hand];
+    cache.hand = (cache.hand + 1) % cache.slot_count;
+    if (s->pins)
+      continue;
+    if (s->referenced) {
+      s->referenced = 0;
+      continue;
+    }
+    return s;
+  }
+  return NULL;
+}
+
+/* The slot holding 'block', or NULL; called with the lock held.  */
+static struct cache_slot *cache_lookup(unsigned int block) {
+
+  struct cache_slot *s;
+
+  for (s = cache.buckets[block & cache.bucket_mask]; s != NULL; s = s->next)
+    if (s->block == block)
+      break;
+  return s;
+}
+
+/* Evict a slot and give it to 'block', pinned once and not yet ready; NULL when
+   every slot is pinned. Called with the lock held.  */
+static struct cache_slot *cache_claim(unsigned int block) {
+
+  struct cache_slot *s, **link;
+
+  if ((s = cache_victim()) == NULL)
+    return NULL;
+  if (s->used) {
+    for (link = &cache.buckets[s->block & cache.bucket_mask]; *link != s; link = &(*link)->next)
+      ;
+    *link = s->next;
+  }
+  s->block = block;
+  s->used = 1;
+  s->ready = 0;
+  s->error = 0;
+  s->pins = 1;
+  s->referenced = 1;
+  s->next = cache.buckets[block & cache.bucket_mask];
+  cache.buckets[block & cache.bucket_mask] = s;
+  return s;
+}
+
+/* Pin the slot holding 'block', reading the block in if it isn't cached yet.  */
+static struct cache_slot *cache_pin(unsigned int block) {
+
+  struct cache_slot *s;
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.slots == NULL)
+    cache_init();
+
+  if ((s = cache_lookup(block)) != NULL) {
+    stats.cache_hits++;
+    s->pins++;
+    s->referenced = 1;
+    while (!s->ready)
+      pthread_cond_wait(&cache.loaded, &cache.lock);
+    pthread_mutex_unlock(&cache.lock);
+    cache_note_pin(s);
+    return s;
+  }
+
+  stats.cache_misses++;
+  if ((s = cache_claim(block)) == NULL) {
+    pthread_mutex_unlock(&cache.lock);
+    return cache_spill(compute_offset(block), sb.block_size);
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  /* Read without the lock held; anyone else after this block waits for 'ready'.  */
+  s->error = read_exact(s->data, sb.block_size, compute_offset(block));
+
+  pthread_mutex_lock(&cache.lock);
+  s->ready = 1;
+  pthread_cond_broadcast(&cache.loaded);
+  pthread_mutex_unlock(&cache.lock);
+  cache_note_pin(s);
+  return s;
+}
+
+/* Pointer to 'len' bytes of a cached image at 'offset', which stays pinned
+   until this thread's pins are released; NULL if they couldn't be read.  */
+static const unsigned char *cache_ptr(off_t offset, size_t len) {
+
+  unsigned int block_size = sb.block_size;
+  struct cache_slot *s;
+
+  if (block_size == 0 || len == 0 || offset / block_size != (offset + (off_t) len - 1) / block_size)
+    s = cache_spill(offset, len);
+  else
+    s = cache_pin(offset / block_size);
+  if (s->error != 0) {
+    image_fail(s->error, "%s: read of %zu bytes at offset %lld", img.path, len, (long long) offset);
+    return NULL;
+  }
+  return (s->spill ? s->data : s->data + offset % block_size);
+}
+
+/*
+ * Start reading in the blocks under 'len' bytes at 'offset'. With a ring,
+ * blocks that aren't cached get a slot and a read each, all submitted in
+ * one go, up to a quarter of the cache and as many as the ring holds; the
+ * reaper marks them ready as they land, and anyone who wants one sooner
+ * waits for it. The rest (or everything, without a ring) is left to the
+ * kernel's readahead.
+ */
+static void cache_prefetch(off_t offset, size_t len) {
+
+  unsigned int first, last, block, budget, count = 0;
+
+  if (sb.block_size == 0 || len == 0)
+    return;
+  first = offset / sb.block_size;
+  last = (offset + (off_t) len - 1) / sb.block_size;
+  block = first;
+
+#ifdef IORING_OFF_SQ_RING
+  struct cache_slot *claimed[URING_ENTRIES];
+  unsigned int claimed_block[URING_ENTRIES];
+  struct cache_slot *s;
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.slots == NULL)
+    cache_init();
+  if (ring.active) {
+    budget = cache.slot_count / 4;
+    if (budget > ring.entries)
+      budget = ring.entries;
+    if (budget > URING_ENTRIES)
+      budget = URING_ENTRIES;
+    budget = (ring.in_flight < budget) ? budget - ring.in_flight : 0;
+    for (; block <= last && count < budget; block++) {
+      if (cache_lookup(block) != NULL || image_hole(compute_offset(block), sb.block_size))
+	continue;
+      if ((s = cache_claim(block)) == NULL)
+	break;
+      claimed[count] = s;
+      claimed_block[count++] = block;
+    }
+    ring.in_flight += count;
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  if (count > 0) {
+    pthread_mutex_lock(&ring.lock);
+    for (unsigned int k = 0; k < count; k++)
+      uring_queue(IORING_OP_READ, claimed[k], claimed_block[k]);
+    uring_submit();
+    pthread_mutex_unlock(&ring.lock);
+  }
+#else
+  (void) budget;
+  (void) count;
+#endif
+
+  if (block <= last)
+    posix_fadvise(img.fd, compute_offset(block), compute_offset(last + 1) - compute_offset(block),
+		  POSIX_FADV_WILLNEED);
+}
+
+/* A mark for cache_release(): how many slots this thread has pinned so far.  */
+size_t cache_hold(void) {
+  return pins.count;
+}
+
+/* Unpin every slot this thread pinned after cache_hold() returned 'mark'.  */
+void cache_release(size_t mark) {
+
+  struct cache_slot *s;
+
+  if (pins.count > mark) {
+    pthread_mutex_lock(&cache.lock);
+    while (pins.count > mark) {
+      s = pins.held[--pins.count];
+      if (--s->pins == 0 && s->spill) {
+	free(s->data);
+	free(s);
+      }
+    }
+    pthread_mutex_unlock(&cache.lock);
+  }
+  if (mark == 0) {
+    free(pins.held);
+    pins.held = NULL;
+    pins.cap = 0;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                FILE SYSTEM                             //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Decode the super block into 'sb' and the group descriptor table into 'gd'; 0 or -1.  */
+int load_file_system(void) {
+
+  /* All of the fields below are read out of the one super block.  */
+  size_t mark = cache_hold();
+  const unsigned char *super_raw = image_ptr(SUPER_OFFSET, 1024);
+  const unsigned char *desc_table;
+  const unsigned char *desc;
+  uint64_t desc_bytes;
+
+  if (super_raw == NULL) {
+    cache_release(mark);
+    return -1;
+  }
+
+  /* MAGIC NUMBER  */
+  sb.magic_number = get_le16(super_raw + MAGIC_OFFSET);
+
+  /* TOTAL NUMBER OF INODES  */
+  sb.inode_total = get_le32(super_raw + I_CNT_OFFSET);
+
+  /* TOTAL NUMBER OF BLOCKS  */
+  sb.block_total = get_le32(super_raw + B_CNT_OFFSET);
+
+  /* BLOCK SIZE  */
+  sb.block_size = get_le32(super_raw + B_SIZ_OFFSET);
+  if (sb.magic_number != EXT2_MAGIC || sb.block_size > (unsigned int) MAX_LOG_BLOCK_SIZE) {
+    image_fail(EINVAL, "%s: not an ext2 file system (magic %#x, log block size %u)", img.path,
+	       sb.magic_number, sb.block_size);
+    cache_release(mark);
+    return -1;
+  }
+  sb.block_size = 1024 << sb.block_size;
+
+  /* FRAGMENT SIZE  */
+  sb.fragment_size = get_le32(super_raw + F_SIZ_OFFSET);
+  if (sb.fragment_size > MAX_LOG_BLOCK_SIZE || sb.fragment_size < -10) {
+    image_fail(EINVAL, "%s: bad log fragment size %d", img.path, sb.fragment_size);
+    cache_release(mark);
+    return -1;
+  }
+  if ( sb.fragment_size >= 0)
+    sb.fragment_size = 1024 << sb.fragment_size;
+  else
+    sb.fragment_size = 1024 >> -sb.fragment_size;
+
+  /* BLOCKS PER GROUP  */
+  sb.blocks_per_group = get_le32(super_raw + B_GRP_OFFSET);
+
+  /* INODES PER GROUP  */
+  sb.inodes_per_group = get_le32(super_raw + I_GRP_OFFSET);
+
+  /* FRAGMENTS PER GROUP  */
+  sb.fragments_per_group = get_le32(super_raw + F_GRP_OFFSET);
+
+  /* FIRST DATA BLOCK  */
+  sb.first_data_block = get_le32(super_raw + FIRST_DATA_BLOCK_OFFSET);
+
+  /* Everything below divides by these, or counts groups from them, and each
+     group's bitmaps are one block, so can't cover more than 8 bits a byte of it.  */
+  if (sb.blocks_per_group == 0 || sb.inodes_per_group == 0 || sb.block_total <= sb.first_data_block ||
+      sb.blocks_per_group > 8 * sb.block_size || sb.inodes_per_group > 8 * sb.block_size) {
+    image_fail(EINVAL, "%s: bad super block (%u blocks from %u, %u blocks and %u inodes per group)", img.path,
+	       sb.block_total, sb.first_data_block, sb.blocks_per_group, sb.inodes_per_group);
+    cache_release(mark);
+    return -1;
+  }
+
+  /* REVISION, FIRST INODE, INODE SIZE AND FEATURE FLAGS (revision 0 has none of the latter)  */
+  sb.rev_level = get_le32(super_raw + REV_LEVEL_OFFSET);
+  sb.first_ino = 11;
+  sb.inode_size = 128;
+  sb.feature_compat = sb.feature_incompat = sb.feature_ro_compat = 0;
+  if (sb.rev_level >= 1) {
+    sb.first_ino = get_le32(super_raw + FIRST_INO_OFFSET);
+    sb.inode_size = get_le16(super_raw + INODE_SIZE_OFFSET);
+    sb.feature_compat = get_le32(super_raw + COMPAT_OFFSET);
+    sb.feature_incompat = get_le32(super_raw + INCOMPAT_OFFSET);
+    sb.feature_ro_compat = get_le32(super_raw + RO_COMPAT_OFFSET);
+  }
+
+  /* GROUP DESCRIPTOR SIZE, RESERVED GDT BLOCKS, FLEX GROUP SIZE AND BACKUP GROUPS  */
+  sb.desc_size = 32;
+  sb.reserved_gdt_blocks = sb.groups_per_flex = 0;
+  sb.backup_groups[0] = sb.backup_groups[1] = 0;
+  if (sb.feature_incompat & INCOMPAT_64BIT)
+    sb.desc_size = get_le16(super_raw + DESC_SIZE_OFFSET);
+  if (sb.feature_compat & COMPAT_RESIZE_INODE)
+    sb.reserved_gdt_blocks = get_le16(super_raw + RESERVED_GDT_OFFSET);
+  if ((sb.feature_incompat & INCOMPAT_FLEX_BG) && super_raw[FLEX_OFFSET] < 32)
+    sb.groups_per_flex = 1u << super_raw[FLEX_OFFSET];
+  if (sb.feature_compat & COMPAT_SPARSE_SUPER2) {
+    sb.backup_groups[0] = get_le32(super_raw + BACKUP_GROUPS_OFFSET);
+    sb.backup_groups[1] = get_le32(super_raw + BACKUP_GROUPS_OFFSET + 4);
+  }
+
+  /* Rather than dump garbage, give up on what this reader would get wrong.  */
+  if ((sb.feature_incompat & INCOMPAT_UNSUPPORTED) || (sb.feature_ro_compat & RO_COMPAT_UNSUPPORTED)) {
+    image_fail(ENOTSUP, "%s: unsupported file system features (incompat %#x, ro_compat %#x)", img.path,
+	       sb.feature_incompat & INCOMPAT_UNSUPPORTED, sb.feature_ro_compat & RO_COMPAT_UNSUPPORTED);
+    cache_release(mark);
+    return -1;
+  }
+  if ((sb.feature_incompat & INCOMPAT_64BIT) && get_le32(super_raw + B_CNT_HIGH_OFFSET) != 0) {
+    image_fail(EFBIG, "%s: more than 2^32 blocks is not supported", img.path);
+    cache_release(mark);
+    return -1;
+  }
+  if (sb.inode_size < 128 || sb.inode_size > sb.block_size || (sb.inode_size & (sb.inode_size - 1)) != 0 ||
+      sb.desc_size < 32 || sb.desc_size > sb.block_size || (sb.desc_size & (sb.desc_size - 1)) != 0) {
+    image_fail(EINVAL, "%s: bad inode size %u or group descriptor size %u", img.path, sb.inode_size, sb.desc_size);
+    cache_release(mark);
+    return -1;
+  }
+  INODE_SIZE = sb.inode_size;
+  GROUP_DESC_SIZE = sb.desc_size;
+
+  /* Now that we know block size, compute the offset to the group descriptor
+     table, which lives in the block right after the super block's.  */
+  END_OF_SUPER = compute_offset(sb.first_data_block + 1);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+
+  /* Create a list of group descriptors in the file system.  A table longer
+     than the image would be read past its end, so give up on it here.  */
+  DESCRIPTOR_COUNT = 1 + (sb.block_total - sb.first_data_block - 1) / sb.blocks_per_group;
+  desc_bytes = (uint64_t) DESCRIPTOR_COUNT * GROUP_DESC_SIZE;
+  if (!img.streaming && (DESCRIPTOR_COUNT > img.size || desc_bytes > img.size)) {
+    image_fail(EINVAL, "%s: %u group descriptors of %u bytes do not fit in the image", img.path,
+	       DESCRIPTOR_COUNT, GROUP_DESC_SIZE);
+    cache_release(mark);
+    return -1;
+  }
+  gd = (struct group_descr *) malloc( sizeof(struct group_descr) * DESCRIPTOR_COUNT );
+  uninit_bitmaps = calloc(DESCRIPTOR_COUNT, sizeof(unsigned char *));
+  if (gd == NULL || uninit_bitmaps == NULL) {
+    image_fail(ENOMEM, "%s: %u group descriptors", img.path, DESCRIPTOR_COUNT);
+    cache_release(mark);
+    return -1;
+  }
+
+  /* The whole descriptor table is contiguous, so bounds-check it once.  */
+  if ((desc_table = image_ptr(END_OF_SUPER, desc_bytes)) == NULL) {
+    cache_release(mark);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
+
+    desc = desc_table + (size_t) i * GROUP_DESC_SIZE;
+
+    /* NUMBER OF CONTAINED BLOCKS  */
+    if (i == (DESCRIPTOR_COUNT - 1)) //Last group holds whatever blocks are left
+      gd[i].contained_blocks = sb.block_total - sb.first_data_block - (i * sb.blocks_per_group);
+    else
+      gd[i].contained_blocks = sb.blocks_per_group;
+
+    /* NUMBER OF FREE BLOCKS, FREE INODES AND DIRECTORIES  */
+    gd[i].free_blocks_per_group = get_le16(desc + B_FREE_OFFSET);
+    gd[i].free_inodes_per_group = get_le16(desc + I_FREE_OFFSET);
+    gd[i].directories_per_group = get_le16(desc + D_USED_OFFSET);
+    if (GROUP_DESC_SIZE >= 64) {
+      gd[i].free_blocks_per_group |= get_le16(desc + B_FREE_HIGH_OFFSET) << 16;
+      gd[i].free_inodes_per_group |= get_le16(desc + I_FREE_HIGH_OFFSET) << 16;
+      gd[i].directories_per_group |= get_le16(desc + D_USED_HIGH_OFFSET) << 16;
+    }
+
+    /* INODE BITMAP, BLOCK BITMAP AND INODE TABLE (START) BLOCKS  */
+    gd[i].inode_bitmap_block = get_le32(desc + I_BITMAP_OFFSET);
+    gd[i].block_bitmap_block = get_le32(desc + B_BITMAP_OFFSET);
+    gd[i].inode_table_start_block = get_le32(desc + I_TABLE_OFFSET);
+
+    /* FLAGS, which only mean anything when the descriptors are checksummed  */
+    gd[i].flags = 0;
+    if (sb.feature_ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM))
+      gd[i].flags = get_le16(desc + G_FLAGS_OFFSET);
+  }
+
+  cache_release(mark);
+  return 0;
+}
+
+/* Whether group 'i' holds a copy of the super block and group descriptors.  */
+static int group_has_super(unsigned int i) {
+
+  uint64_t power;
+
+  if (i == 0)
+    return 1;
+  if (sb.feature_compat & COMPAT_SPARSE_SUPER2)
+    return (i == sb.backup_groups[0] || i == sb.backup_groups[1]);
+  if (!(sb.feature_ro_compat & RO_COMPAT_SPARSE_SUPER))
+    return 1;
+  for (unsigned int base = 3; base <= 7; base += 2) {
+    for (power = 1; power < i; power *= base)
+      ;
+    if (power == i)
+      return 1;
+  }
+  return 0;
+}
+
+/* How many blocks at the start of group 'i' its copy of the super block and
+   descriptors takes up, reserved GDT blocks and all (0 if it has no copy).  */
+unsigned int group_super_blocks(unsigned int i) {
+
+  if (!group_has_super(i))
+    return 0;
+  return 1 + ((uint64_t) DESCRIPTOR_COUNT * GROUP_DESC_SIZE + sb.block_size - 1) / sb.block_size +
+    sb.reserved_gdt_blocks;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                CSV WRITER                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+const size_t CSV_BUFFER_SIZE = 1 << 20;     /* Bytes buffered per output file before a write()       */
+
+static const char DIGIT_PAIRS[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Start an empty stream. With fd == -1 it only grows in memory and is never flushed.  */
+void csv_init(struct csv_out *o, int fd) {
+  o->fd = fd;
+  o->len = 0;
+  o->binary = 0;
+  o->cap = (fd == -1) ? 0 : CSV_BUFFER_SIZE;
+  o->buf = NULL;
+  if (o->cap && (o->buf = malloc(o->cap)) == NULL) {
+    perror("malloc"); exit(-1);
+  }
+}
+
+/* Create / truncate the named file and return a buffered stream for it, or NULL.  */
+struct csv_out *csv_open(const char *path) {
+
+  struct csv_out *o;
+  int fd;
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    return NULL;
+  if ((o = malloc(sizeof(struct csv_out))) == NULL)
+    return NULL;
+  csv_init(o, fd);
+  return o;
+}
+
+static void write_all(int fd, const char *p, size_t n) {
+
+  ssize_t put;
+
+  while (n > 0) {
+    put = write(fd, p, n);
+    stats_write(put);
+    if (put == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("write"); exit(-1);
+    }
+    p += put;
+    n -= put;
+  }
+}
+
+/* Hand everything buffered so far to the kernel (no-op for in-memory streams).  */
+void csv_flush(struct csv_out *o) {
+  if (o->fd == -1 || o->len == 0)
+    return;
+  write_all(o->fd, o->buf, o->len);
+  o->len = 0;
+}
+
+/* Make room for 'need' more bytes: file streams flush, memory streams grow.  */
+static void csv_reserve(struct csv_out *o, size_t need) {
+
+  if (o->len + need <= o->cap)
+    return;
+  if (o->fd != -1) {
+    csv_flush(o);
+    if (need <= o->cap)
+      return;
+  }
+  while (o->len + need > o->cap)
+    o->cap = o->cap ? 2 * o->cap : 4096;
+  if ((o->buf = realloc(o->buf, o->cap)) == NULL) {
+    perror("realloc"); exit(-1);
+  }
+}
+
+/* Flush, close and free a stream from csv_open(); 0 on success like fclose().  */
+int csv_close(struct csv_out *o) {
+
+  int ret;
+
+  csv_flush(o);
+  ret = close(o->fd);
+  free(o->buf);
+  free(o);
+  return ret;
+}
+
+void csv_bytes(struct csv_out *o, const void *p, size_t n) {
+
+  /* An empty group buffer may not even have been allocated.  */
+  if (n == 0)
+    return;
+
+  /* Big blocks (merged group buffers) skip the copy into a file stream's buffer.  */
+  if (o->fd != -1 && n >= o->cap) {
+    csv_flush(o);
+    write_all(o->fd, p, n);
+    return;
+  }
+  csv_reserve(o, n);
+  memcpy(o->buf + o->len, p, n);
+  o->len += n;
+}
+
+void csv_char(struct csv_out *o, char c) {
+  csv_reserve(o, 1);
+  o->buf[o->len++] = c;
+}
+
+/* A binary stream's field: 32 bits, little-endian, and no separator.  */
+static void csv_word(struct csv_out *o, uint32_t v) {
+
+  unsigned char tmp[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+  csv_bytes(o, tmp, 4);
+}
+
+/* Signed decimal followed by 'sep'; prints exactly what "%d" would.  */
+void csv_dec(struct csv_out *o, int v, char sep) {
+
+  char tmp[16];
+  char *p = tmp + sizeof(tmp);
+  unsigned int u = (v < 0) ? 0u - (unsigned int) v : (unsigned int) v;
+
+  if (o->binary) {
+    csv_word(o, v);
+    return;
+  }
+  *--p = sep;
+  while (u >= 100) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + 2*(u % 100), 2);
+    u /= 100;
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + 2*u, 2);
+  }
+  else
+    *--p = '0' + u;
+  if (v < 0)
+    *--p = '-';
+  csv_bytes(o, p, tmp + sizeof(tmp) - p);
+}
+
+/* Unsigned 64-bit decimal followed by 'sep', as "%llu"; a binary stream gets 64 bits.  */
+void csv_u64(struct csv_out *o, uint64_t v, char sep) {
+
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  unsigned char raw[8];
+
+  if (o->binary) {
+    for (int k = 0; k < 8; k++)
+      raw[k] = v >> 8*k;
+    csv_bytes(o, raw, 8);
+    return;
+  }
+  *--p = sep;
+  while (v >= 100) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + 2*(v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + 2*v, 2);
+  }
+  else
+    *--p = '0' + v;
+  csv_bytes(o, p, tmp + sizeof(tmp) - p);
+}
+
+/* Lowercase hex followed by 'sep', as "%x".  */
+void csv_hex(struct csv_out *o, unsigned int v, char sep) {
+
+  char tmp[16];
+  char *p = tmp + sizeof(tmp);
+
+  if (o->binary) {
+    csv_word(o, v);
+    return;
+  }
+  *--p = sep;
+  do {
+    *--p = "0123456789abcdef"[v & 0xF];
+    v >>= 4;
+  } while (v);
+  csv_bytes(o, p, tmp + sizeof(tmp) - p);
+}
+
+/* Octal followed by 'sep', as "%o".  */
+void csv_oct(struct csv_out *o, unsigned int v, char sep) {
+
+  char tmp[16];
+  char *p = tmp + sizeof(tmp);
+
+  if (o->binary) {
+    csv_word(o, v);
+    return;
+  }
+  *--p = sep;
+  do {
+    *--p = '0' + (v & 7);
+    v >>= 3;
+  } while (v);
+  csv_bytes(o, p, tmp + sizeof(tmp) - p);
+}
+
+/* One character followed by 'sep'; a binary stream gets just the character.  */
+void csv_letter(struct csv_out *o, char c, char sep) {
+
+  char tmp[2] = { c, sep };
+
+  csv_bytes(o, tmp, o->binary ? 1 : 2);
+}
+
+/* 'n' bytes in double quotes followed by 'sep'; a binary stream gets a
+   16-bit length and then the bytes.  */
+void csv_quoted(struct csv_out *o, const void *p, size_t n, char sep) {
+
+  unsigned char len[2] = { n, n >> 8 };
+
+  if (o->binary) {
+    csv_bytes(o, len, 2);
+    csv_bytes(o, p, n);
+    return;
+  }
+  csv_char(o, '"');
+  csv_bytes(o, p, n);
+  csv_char(o, '"');
+  csv_char(o, sep);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                               TABLE FILES                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * With '-f binary' each table is written through a binary csv_out into
+ * 'name.bin.tmp', one row after another exactly as the csv would have it
+ * but with every field in raw bytes. When the table is closed the rows are
+ * turned around into columns in 'name.bin', which can be mapped and read
+ * column by column, and table_to_csv() prints the csv back from it.
+ */
+
+const char *OUTPUT_FORMAT = "csv";          /* '-f': csv, binary, or packed (binary, with packed block columns)  */
+const char TABLE_MAGIC[8] = "LAB3ATBL";
+const uint32_t TABLE_VERSION = 1;
+const uint32_t TABLE_MAX_COLUMNS = 256;     /* More columns than any table has; caps what table_to_csv() will believe  */
+
+/* Bytes a field of the given format takes in a staged row, whose string
+   fields are a 16-bit length followed by that many bytes.  */
+static size_t table_field_size(char format, const unsigned char *p) {
+  switch (format) {
+    case 'c':
+      return 1;
+    case 's':
+      return 2 + get_le16(p);
+    case 'u':
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+/* Store 'v' as a varint (7 bits per byte, low bits first) at 'p', if not
+   NULL, and return how many bytes it takes.  */
+static size_t table_varint(unsigned char *p, uint64_t v) {
+
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    if (p)
+      p[n] = v | 0x80;
+    n++;
+    v >>= 7;
+  }
+  if (p)
+    p[n] = v;
+  return n + 1;
+}
+
+/* The packed form of 'v' coming after 'prev': the difference, zigzagged so small negatives stay small.  */
+static uint64_t table_zigzag(uint32_t v, uint32_t prev) {
+
+  int64_t d = (int64_t) v - (int64_t) prev;
+
+  return ((uint64_t) d << 1) ^ (uint64_t) (d >> 63);
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+  put_le32(p, v);
+  put_le32(p + 4, v >> 32);
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+  return get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+/* The header and column headers are stored little-endian, field by field,
+   whatever the byte order of the machine writing or reading them.  */
+static void table_put_header(unsigned char *p, const struct table_header *h) {
+  memcpy(p + offsetof(struct table_header, magic), h->magic, sizeof(h->magic));
+  put_le32(p + offsetof(struct table_header, version), h->version);
+  put_le32(p + offsetof(struct table_header, column_count), h->column_count);
+  put_le64(p + offsetof(struct table_header, row_count), h->row_count);
+  memcpy(p + offsetof(struct table_header, name), h->name, sizeof(h->name));
+}
+
+static void table_get_header(const unsigned char *p, struct table_header *h) {
+  memcpy(h->magic, p + offsetof(struct table_header, magic), sizeof(h->magic));
+  h->version = get_le32(p + offsetof(struct table_header, version));
+  h->column_count = get_le32(p + offsetof(struct table_header, column_count));
+  h->row_count = get_le64(p + offsetof(struct table_header, row_count));
+  memcpy(h->name, p + offsetof(struct table_header, name), sizeof(h->name));
+}
+
+static void table_put_column(unsigned char *p, const struct table_column_header *ch) {
+  memset(p, 0, sizeof(*ch));
+  memcpy(p + offsetof(struct table_column_header, name), ch->name, sizeof(ch->name));
+  p[offsetof(struct table_column_header, format)] = ch->format;
+  p[offsetof(struct table_column_header, width)] = ch->width;
+  p[offsetof(struct table_column_header, encoding)] = ch->encoding;
+  put_le64(p + offsetof(struct table_column_header, offset), ch->offset);
+  put_le64(p + offsetof(struct table_column_header, size), ch->size);
+}
+
+static void table_get_column(const unsigned char *p, struct table_column_header *ch) {
+  memset(ch, 0, sizeof(*ch));
+  memcpy(ch->name, p + offsetof(struct table_column_header, name), sizeof(ch->name));
+  ch->format = p[offsetof(struct table_column_header, format)];
+  ch->width = p[offsetof(struct table_column_header, width)];
+  ch->encoding = p[offsetof(struct table_column_header, encoding)];
+  ch->offset = get_le64(p + offsetof(struct table_column_header, offset));
+  ch->size = get_le64(p + offsetof(struct table_column_header, size));
+}
+
+/* Map a whole file read-only; an empty file gives NULL and a size of 0.  */
+static const unsigned char *table_map(const char *path, size_t *size) {
+
+  struct stat st;
+  void *data;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return MAP_FAILED;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return MAP_FAILED;
+  }
+  *size = st.st_size;
+  data = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  return data;
+}
+
+/* Turn the rows staged in 'rows_path' into the columns of table file 'path'.  */
+static int table_build(const struct table *t, const char *rows_path, const char *path) {
+
+  int n = t->column_count, c, fd;
+  int packed = (strcmp(OUTPUT_FORMAT, "packed") == 0);
+  const unsigned char *rows, *p, *end;
+  struct table_header h;
+  struct table_column_header ch[n];
+  uint64_t size[n], at[n], heap[n];
+  uint32_t prev[n];
+  unsigned char *data;
+  size_t rows_size, total, len;
+  uint64_t row_count = 0;
+
+  if ((rows = table_map(rows_path, &rows_size)) == MAP_FAILED)
+    return -1;
+  end = rows + rows_size;
+
+  /* First pass: count the rows and how much each column will take.  */
+  memset(size, 0, sizeof(size));
+  memset(prev, 0, sizeof(prev));
+  for (p = rows; p < end; row_count++) {
+    for (c = 0; c < n; c++) {
+      if (t->columns[c].format == 's')
+	size[c] += get_le16(p);
+      else if (packed && t->columns[c].packed) {
+	size[c] += table_varint(NULL, table_zigzag(get_le32(p), prev[c]));
+	prev[c] = get_le32(p);
+      }
+      p += table_field_size(t->columns[c].format, p);
+    }
+  }
+
+  /* Then lay the columns out, each 8-byte aligned after the headers.  */
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TABLE_MAGIC, sizeof(h.magic));
+  h.version = TABLE_VERSION;
+  h.column_count = n;
+  h.row_count = row_count;
+  strncpy(h.name, t->name, sizeof(h.name) - 1);
+  total = sizeof(h) + n * sizeof(struct table_column_header);
+  memset(ch, 0, sizeof(ch));
+  for (c = 0; c < n; c++) {
+    strncpy(ch[c].name, t->columns[c].name, sizeof(ch[c].name) - 1);
+    ch[c].format = t->columns[c].format;
+    ch[c].width = (ch[c].format == 's' || ch[c].format == 'u') ? 8 : (ch[c].format == 'c') ? 1 : 4;
+    ch[c].encoding = (packed && t->columns[c].packed);
+    if (ch[c].format == 's')
+      size[c] += (row_count + 1) * 8;
+    else if (!ch[c].encoding)
+      size[c] = row_count * ch[c].width;
+    total = (total + 7) & ~(size_t) 7;
+    ch[c].offset = total;
+    ch[c].size = size[c];
+    at[c] = total;
+    heap[c] = total + (row_count + 1) * 8;
+    total += size[c];
+  }
+
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+    return -1;
+  if (ftruncate(fd, total) == -1 ||
+      (data = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  table_put_header(data, &h);
+  for (c = 0; c < n; c++)
+    table_put_column(data + sizeof(h) + c * sizeof(ch[c]), &ch[c]);
+
+  /* Second pass: scatter each row's fields into the columns.  */
+  memset(prev, 0, sizeof(prev));
+  for (c = 0; c < n; c++)
+    if (ch[c].format == 's')
+      put_le64(data + at[c], 0);
+  for (p = rows; p < end; ) {
+    for (c = 0; c < n; c++) {
+      if (ch[c].format == 's') {
+	len = get_le16(p);
+	memcpy(data + heap[c], p + 2, len);
+	heap[c] += len;
+	at[c] += 8;
+	put_le64(data + at[c], heap[c] - ch[c].offset - (row_count + 1) * 8);
+      }
+      else if (ch[c].encoding) {
+	at[c] += table_varint(data + at[c], table_zigzag(get_le32(p), prev[c]));
+	prev[c] = get_le32(p);
+      }
+      else if (ch[c].format == 'c')
+	data[at[c]++] = *p;
+      else {
+	memcpy(data + at[c], p, ch[c].width);
+	at[c] += ch[c].width;
+      }
+      p += table_field_size(ch[c].format, p);
+    }
+  }
+
+  if (rows_size)
+    munmap((void *) rows, rows_size);
+  munmap(data, total);
+  return close(fd);
+}
+
+/* Open 'name.csv', or with '-f binary' the staging file for 'name.bin'.  */
+struct csv_out *table_open(const struct table *t) {
+
+  char path[64];
+  struct csv_out *o;
+  int binary = (strcmp(OUTPUT_FORMAT, "csv") != 0);
+
+  snprintf(path, sizeof(path), binary ? "%s.bin.tmp" : "%s.csv", t->name);
+  if ((o = csv_open(path)) != NULL)
+    o->binary = binary;
+  return o;
+}
+
+/* Close a stream from table_open(), building 'name.bin' if it was binary; 0 on success.  */
+int table_close(struct csv_out *o, const struct table *t) {
+
+  char rows_path[64], path[64];
+  int binary = o->binary;
+
+  if (csv_close(o) != 0)
+    return -1;
+  if (!binary)
+    return 0;
+  snprintf(rows_path, sizeof(rows_path), "%s.bin.tmp", t->name);
+  snprintf(path, sizeof(path), "%s.bin", t->name);
+  if (table_build(t, rows_path, path) != 0)
+    return -1;
+  return unlink(rows_path);
+}
+
+/* Decode the varint at 'p', at most 'len' bytes long, into 'z'; the bytes
+   it took, or 0 if it runs past 'len' or past 64 bits.  */
+static size_t table_get_varint(const unsigned char *p, uint64_t len, uint64_t *z) {
+
+  size_t n = 0;
+  int shift;
+
+  *z = 0;
+  for (shift = 0; n < len && shift <= 63; shift += 7) {
+    *z |= (uint64_t) (p[n] & 0x7F) << shift;
+    if (!(p[n++] & 0x80))
+      return n;
+  }
+  return 0;
+}
+
+/* Whether column 'ch' of a table with 'rows' rows, in a file of 'size'
+   bytes, holds what its header says it does: every value, and for a
+   string column offsets that stay in order and inside its bytes.  */
+static int table_column_ok(const unsigned char *data, size_t size, uint64_t rows,
+			   const struct table_column_header *ch) {
+
+  const unsigned char *col;
+  uint64_t r, at, z, from, to, heap_size;
+  size_t n;
+
+  if (ch->offset > size || ch->size > size - ch->offset)
+    return 0;
+  col = data + ch->offset;
+  switch (ch->format) {
+    case 'd':
+    case 'x':
+    case 'o':
+      if (ch->width != 4 || ch->encoding > 1)
+	return 0;
+      if (ch->encoding == 0)
+	return (rows <= ch->size / 4);
+      for (r = 0, at = 0; r < rows; r++, at += n)
+	if ((n = table_get_varint(col + at, ch->size - at, &z)) == 0)
+	  return 0;
+      return 1;
+    case 'c':
+      return (ch->width == 1 && ch->encoding == 0 && rows <= ch->size);
+    case 'u':
+      return (ch->width == 8 && ch->encoding == 0 && rows <= ch->size / 8);
+    case 's':
+      if (ch->width != 8 || ch->encoding != 0 || rows >= ch->size / 8)
+	return 0;
+      heap_size = ch->size - (rows + 1) * 8;
+      for (r = 0, from = get_le64(col); r < rows; r++, from = to) {
+	to = get_le64(col + 8*r + 8);
+	if (from > to || to > heap_size)
+	  return 0;
+      }
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Print table file 'path' to 'out' as the csv it was made in place of; -1 if it isn't one.  */
+int table_to_csv(const char *path, struct csv_out *out) {
+
+  const unsigned char *data, *col, *heap;
+  struct table_header h;
+  size_t size, n;
+  uint64_t r, z, from, to;
+  uint32_t c, v;
+  char sep;
+
+  if ((data = table_map(path, &size)) == MAP_FAILED)
+    return -1;
+  if (size >= sizeof(h))
+    table_get_header(data, &h);
+  if (size < sizeof(h) || memcmp(h.magic, TABLE_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != TABLE_VERSION || h.column_count == 0 || h.column_count > TABLE_MAX_COLUMNS ||
+      size < sizeof(h) + h.column_count * sizeof(struct table_column_header)) {
+    if (size)
+      munmap((void *) data, size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Check every column against the row count before printing any of them.  */
+  struct table_column_header ch[h.column_count];
+  for (c = 0; c < h.column_count; c++) {
+    table_get_column(data + sizeof(h) + c * sizeof(ch[c]), &ch[c]);
+    if (!table_column_ok(data, size, h.row_count, &ch[c])) {
+      munmap((void *) data, size);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  /* Packed columns are read front to back, each from where its last value ended.  */
+  uint64_t at[h.column_count];
+  uint32_t prev[h.column_count];
+  for (c = 0; c < h.column_count; c++) {
+    at[c] = 0;
+    prev[c] = 0;
+  }
+  for (r = 0; r < h.row_count; r++) {
+    for (c = 0; c < h.column_count; c++) {
+      col = data + ch[c].offset;
+      sep = (c + 1 == h.column_count) ? '\n' : ',';
+      if (ch[c].format == 's') {
+	heap = col + (h.row_count + 1) * 8;
+	from = get_le64(col + 8*r);
+	to = get_le64(col + 8*r + 8);
+	csv_quoted(out, heap + from, to - from, sep);
+	continue;
+      }
+      if (ch[c].format == 'c') {
+	csv_letter(out, col[r], sep);
+	continue;
+      }
+      if (ch[c].format == 'u') {
+	csv_u64(out, get_le64(col + 8*r), sep);
+	continue;
+      }
+      if (ch[c].encoding) {
+	n = table_get_varint(col + at[c], ch[c].size - at[c], &z);
+	at[c] += n;
+	v = prev[c] + (uint32_t) ((z >> 1) ^ -(z & 1));
+	prev[c] = v;
+      }
+      else
+	v = get_le32(col + 4*r);
+      if (ch[c].format == 'x')
+	csv_hex(out, v, sep);
+      else if (ch[c].format == 'o')
+	csv_oct(out, v, sep);
+      else
+	csv_dec(out, (int) v, sep);
+    }
+  }
+
+  munmap((void *) data, size);
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                               GROUP WORKERS                            //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+unsigned int JOB_COUNT = 1;                 /* Number of worker threads ('-j'); 1 means serial       */
+
+/* Runs on each worker: claim the next unclaimed group until none are left.  */
+static void *group_worker(void *arg) {
+
+  struct group_pool *pool = arg;
+  struct csv_out *out[pool->stream_count];
+  unsigned int group;
+  int s;
+
+  for (;;) {
+    /* Groups are handed out one at a time, so threads that land on nearly
+       empty groups simply come back for more instead of sitting idle.  */
+    group = __atomic_fetch_add(&pool->next_group, 1, __ATOMIC_RELAXED);
+    if (group >= DESCRIPTOR_COUNT)
+      break;
+
+    for (s = 0; s < pool->stream_count; s++) {
+      out[s] = &pool->bufs[group*pool->stream_count + s];
+      csv_init(out[s], -1);
+      out[s]->binary = pool->out[s]->binary;
+    }
+
+    run_group(pool->fn, group, out, pool->arg);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done[group] = 1;
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+/*
+ * Call fn once for every group, writing to the given output streams. With
+ * more than one job the groups are spread over a pool of threads, each
+ * group writing into its own in-memory buffers, and the buffers are copied
+ * to 'out' strictly in group order so the result is byte-identical to a
+ * serial run. Returns 0, or -1 if any group couldn't be read in full.
+ */
+int for_each_group(group_fn fn, void *arg, struct csv_out **out, int stream_count) {
+
+  struct group_pool pool;
+  pthread_t *workers;
+  unsigned int thread_count, started, i;
+  unsigned int failures = __atomic_load_n(&img.failures, __ATOMIC_RELAXED);
+  size_t slot;
+  int s;
+
+  if (JOB_COUNT <= 1 || DESCRIPTOR_COUNT <= 1) {
+    for (i = 0; i < DESCRIPTOR_COUNT; i++)
+      run_group(fn, i, out, arg);
+    return pass_result(failures);
+  }
+
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.out = out;
+  pool.stream_count = stream_count;
+  pool.next_group = 0;
+  pool.bufs = calloc((size_t) DESCRIPTOR_COUNT * stream_count, sizeof(struct csv_out));
+  pool.done = calloc(DESCRIPTOR_COUNT, 1);
+  if ((pool.bufs == NULL && stream_count > 0) || pool.done == NULL) {
+    perror("calloc"); exit(-1);
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.finished, NULL);
+
+  thread_count = JOB_COUNT < DESCRIPTOR_COUNT ? JOB_COUNT : DESCRIPTOR_COUNT;
+  workers = malloc(thread_count * sizeof(pthread_t));
+  if (workers == NULL) {
+    perror("malloc"); exit(-1);
+  }
+  /* Make do with however many threads can be had, or with none but this one.  */
+  for (started = 0; started < thread_count; started++)
+    if (pthread_create(&workers[started], NULL, group_worker, &pool) != 0)
+      break;
+  if (started == 0)
+    group_worker(&pool);
+
+  /* Merge each group's output as soon as it and all groups before it are done.  */
+  for (i = 0; i < DESCRIPTOR_COUNT; i++) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.done[i])
+      pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (s = 0; s < stream_count; s++) {
+      slot = (size_t) i*stream_count + s;
+      csv_bytes(out[s], pool.bufs[slot].buf, pool.bufs[slot].len);
+      free(pool.bufs[slot].buf);
+    }
+  }
+
+  for (i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  pthread_cond_destroy(&pool.finished);
+  pthread_mutex_destroy(&pool.lock);
+  free(workers);
+  free(pool.done);
+  free(pool.bufs);
+  return pass_result(failures);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                              BITMAP ITERATOR                           //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Load the 64 bits of the bitmap starting at bit 'pos' (a multiple of 64);
+   bit n of the bitmap is bit n%64 of the word. Bytes past 'nbits' read as 0.  */
+static uint64_t bitmap_word(const struct bitmap_iter *it, unsigned int pos) {
+
+  uint64_t word = 0;
+  unsigned int bytes = (it->nbits - pos + 7) / 8;
+
+  memcpy(&word, it->map + pos/8, bytes < 8 ? bytes : 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/* Start walking the first 'nbits' bits of 'map', stopping on bits equal to
+   'want_set'. A NULL map (one that couldn't be read) has no bits.  */
+void bitmap_iter_init(struct bitmap_iter *it, const unsigned char *map, unsigned int nbits, int want_set) {
+  it->map = map;
+  it->nbits = (map != NULL) ? nbits : 0;
+  it->pos = 0;
+  it->flip = want_set ? 0 : ~(uint64_t) 0;
+}
+
+/*
+ * Return the index of the next wanted bit, or -1 once the bitmap is used
+ * up. Words with nothing wanted in them (all ones when looking for clear
+ * bits, all zeros when looking for set bits) are skipped in one step,
+ * wider runs of them with SSE2/AVX2 where available, and count-trailing-
+ * zeros jumps straight to the wanted bit inside a word.
+ */
+int bitmap_next(struct bitmap_iter *it) {
+
+  uint64_t word;
+  unsigned int base;
+
+  while (it->pos < it->nbits) {
+    base = it->pos & ~63u;
+    word = (bitmap_word(it, base) ^ it->flip) & (~(uint64_t) 0 << (it->pos - base));
+    if (word) {
+      it->pos = base + __builtin_ctzll(word);
+      if (it->pos >= it->nbits)
+	break;
+      return it->pos++;
+    }
+    it->pos = base + 64;
+
+#if defined(__AVX2__)
+    const __m256i flip256 = _mm256_set1_epi64x((long long) it->flip);
+    while (it->pos + 256 <= it->nbits) {
+      __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (it->map + it->pos/8)), flip256);
+      if (!_mm256_testz_si256(v, v))
+	break;
+      it->pos += 256;
+    }
+#elif defined(__SSE2__)
+    const __m128i flip128 = _mm_set1_epi64x((long long) it->flip);
+    while (it->pos + 128 <= it->nbits) {
+      __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (it->map + it->pos/8)), flip128);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+	break;
+      it->pos += 128;
+    }
+#endif
+  }
+  it->pos = it->nbits;
+  return -1;
+}
+
+/* Return the start of the next run of wanted bits and set '*length' to how
+   many there are, or -1 once the bitmap is used up. The end of the run is
+   found the same way as its start, by looking for the next unwanted bit.  */
+int bitmap_next_run(struct bitmap_iter *it, unsigned int *length) {
+
+  int start, end;
+
+  if ((start = bitmap_next(it)) == -1)
+    return -1;
+  it->flip = ~it->flip;
+  end = bitmap_next(it);
+  it->flip = ~it->flip;
+  if (end == -1)
+    end = it->nbits;
+  *length = end - start;
+  return start;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                INDEX FILE                              //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * With '-x FILE', the bitmaps and the location of every allocated inode
+ * are saved to FILE on the first run over an image, and later runs map
+ * FILE instead of reading the bitmaps again. The file is only trusted
+ * while the image's size and modification time are unchanged and its
+ * super block and descriptor table still hash (and decode) the same;
+ * otherwise it is quietly rebuilt.
+ */
+
+const char *INDEX_PATH = NULL;              /* Index file given to open_index(), if any              */
+const char INDEX_MAGIC[8] = "LAB3AIDX";     /* First bytes of every index file                       */
+const uint32_t INDEX_VERSION = 4;           /* Bumped whenever the layout changes                    */
+
+/* Round up to the next multiple of 8, so every section is aligned for its type.  */
+static size_t index_align(size_t n) {
+  return ((n + 7) & ~(size_t) 7);
+}
+
+/* FNV-1a hash of the super block and descriptor table.  */
+static uint64_t index_checksum(void) {
+
+  const unsigned char *p = image_ptr(SUPER_OFFSET, 1024);
+  size_t n = 1024;
+  uint64_t h = 14695981039346656037ULL;
+
+  for (int part = 0; part < 2 && p != NULL; part++) {
+    for (size_t k = 0; k < n; k++) {
+      h ^= p[k];
+      h *= 1099511628211ULL;
+    }
+    n = (size_t) DESCRIPTOR_COUNT * GROUP_DESC_SIZE;
+    p = image_ptr(END_OF_SUPER, n);
+  }
+  return h;
+}
+
+/* Fill in the key and section offsets of an index for this image.  */
+static void index_layout(struct index_header *h, uint64_t inode_count) {
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, INDEX_MAGIC, sizeof(h->magic));
+  h->version = INDEX_VERSION;
+  h->group_count = DESCRIPTOR_COUNT;
+  h->image_size = img.size;
+  h->mtime_sec = img.mtime.tv_sec;
+  h->mtime_nsec = img.mtime.tv_nsec;
+  h->checksum = index_checksum();
+  h->block_bitmap_bytes = index_align((sb.blocks_per_group + 7) / 8);
+  h->inode_bitmap_bytes = index_align((sb.inodes_per_group + 7) / 8);
+  h->inode_count = inode_count;
+
+  h->super_at = index_align(sizeof(*h));
+  h->groups_at = h->super_at + index_align(sizeof(sb));
+  h->block_bitmaps_at = h->groups_at + index_align(DESCRIPTOR_COUNT * sizeof(struct group_descr));
+  h->inode_bitmaps_at = h->block_bitmaps_at + (uint64_t) DESCRIPTOR_COUNT * h->block_bitmap_bytes;
+  h->first_at = h->inode_bitmaps_at + (uint64_t) DESCRIPTOR_COUNT * h->inode_bitmap_bytes;
+  h->hashes_at = h->first_at + (DESCRIPTOR_COUNT + 1) * sizeof(uint64_t);
+  h->offsets_at = h->hashes_at + DESCRIPTOR_COUNT * sizeof(uint64_t);
+  h->file_size = h->offsets_at + inode_count * sizeof(uint64_t);
+}
+
+/* Point idx's sections into 'data'.  */
+static void index_attach(unsigned char *data, size_t size, int mapped) {
+  idx.data = data;
+  idx.mapped = mapped;
+  idx.size = size;
+  idx.hdr = (const struct index_header *) data;
+  idx.block_bitmaps = data + idx.hdr->block_bitmaps_at;
+  idx.inode_bitmaps = data + idx.hdr->inode_bitmaps_at;
+  idx.first = (const uint64_t *) (data + idx.hdr->first_at);
+  idx.hashes = (const uint64_t *) (data + idx.hdr->hashes_at);
+  idx.offsets = (const uint64_t *) (data + idx.hdr->offsets_at);
+  idx.loaded = 1;
+}
+
+/* Map INDEX_PATH if it is an index of this image as it is now; returns whether it was.  */
+static int index_load(void) {
+
+  struct stat st;
+  struct index_header want;
+  const struct index_header *h;
+  unsigned char *map;
+  int fd, ok;
+
+  if ((fd = open(INDEX_PATH, O_RDONLY)) == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(want)) {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  /* Everything but the inode count follows from the image itself.  */
+  h = (const struct index_header *) map;
+  index_layout(&want, h->inode_count);
+  ok = (memcmp(h, &want, sizeof(want)) == 0 && want.file_size == (uint64_t) st.st_size &&
+	memcmp(map + h->super_at, &sb, sizeof(sb)) == 0 &&
+	memcmp(map + h->groups_at, gd, DESCRIPTOR_COUNT * sizeof(struct group_descr)) == 0);
+  if (!ok) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+  index_attach(map, st.st_size, 1);
+  return 1;
+}
+
+static uint64_t hash_group(unsigned int group);
+
+/* Read every group's bitmaps, write the index out to INDEX_PATH and use it from memory; 0 or -1.  */
+static int index_build(void) {
+
+  struct index_header h;
+  struct bitmap_iter it;
+  const unsigned char *map;
+  unsigned int failures = thread_failures;
+  unsigned char *data;
+  uint64_t *first, *hashes, *offsets;
+  uint64_t inode_count = 0;
+  off_t table_offset;
+  size_t mark;
+  int bit, fd;
+  size_t tmp_len = strlen(INDEX_PATH) + sizeof(".tmp");
+  char tmp[tmp_len];
+
+  /* Count the allocated inodes first, to size the file.  */
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
+    mark = cache_hold();
+    bitmap_iter_init(&it, group_inode_bitmap(i), sb.inodes_per_group, 1);
+    while (bitmap_next(&it) != -1)
+      inode_count++;
+    cache_release(mark);
+  }
+
+  index_layout(&h, inode_count);
+  if ((data = calloc(1, h.file_size)) == NULL)
+    return image_fail(ENOMEM, "%s", INDEX_PATH);
+  memcpy(data, &h, sizeof(h));
+  memcpy(data + h.super_at, &sb, sizeof(sb));
+  memcpy(data + h.groups_at, gd, DESCRIPTOR_COUNT * sizeof(struct group_descr));
+  first = (uint64_t *) (data + h.first_at);
+  hashes = (uint64_t *) (data + h.hashes_at);
+  offsets = (uint64_t *) (data + h.offsets_at);
+
+  inode_count = 0;
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
+    mark = cache_hold();
+    if ((map = group_block_bitmap(i)) != NULL)
+      memcpy(data + h.block_bitmaps_at + (size_t) i * h.block_bitmap_bytes, map, (gd[i].contained_blocks + 7) / 8);
+    if ((map = group_inode_bitmap(i)) != NULL)
+      memcpy(data + h.inode_bitmaps_at + (size_t) i * h.inode_bitmap_bytes, map, (sb.inodes_per_group + 7) / 8);
+
+    first[i] = inode_count;
+    table_offset = compute_offset(gd[i].inode_table_start_block);
+    bitmap_iter_init(&it, group_inode_bitmap(i), sb.inodes_per_group, 1);
+    while ((bit = bitmap_next(&it)) != -1)
+      offsets[inode_count++] = table_offset + (off_t) INODE_SIZE*bit;
+    hashes[i] = hash_group(i);
+    cache_release(mark);
+  }
+  first[DESCRIPTOR_COUNT] = inode_count;
+
+  /* Never save an index of bitmaps that couldn't all be read.  */
+  if (read_result(failures, 0) == -1) {
+    free(data);
+    return -1;
+  }
+
+  /* Write to a temporary name and rename, so a reader never sees half an index.  */
+  snprintf(tmp, tmp_len, "%s.tmp", INDEX_PATH);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    free(data);
+    return image_fail(errno, "%s", tmp);
+  }
+  write_all(fd, (const char *) data, h.file_size);
+  if (close(fd) == -1 || rename(tmp, INDEX_PATH) == -1) {
+    free(data);
+    return image_fail(errno, "%s", INDEX_PATH);
+  }
+
+  index_attach(data, h.file_size, 0);
+  return 0;
+}
+
+/* Use 'path' as the index of the open image, building it first if it is
+   missing or stale; 0 or -1.  */
+int open_index(const char *path) {
+
+  size_t mark;
+  int result = 0;
+
+  INDEX_PATH = path;
+  if (INDEX_PATH == NULL)
+    return 0;
+  if (img.streaming) {
+    fprintf(stderr, "%s: an index needs a seekable image; ignoring -x\n", img.path);
+    return 0;
+  }
+  mark = cache_hold();
+  if (!index_load())
+    result = index_build();
+  cache_release(mark);
+  return result;
+}
+
+/* Mark block 'block' in the bitmap of the group starting at 'start', if it is in the group.  */
+static void uninit_mark(unsigned char *map, unsigned int i, unsigned int start, unsigned int block) {
+  if (block >= start && block - start < gd[i].contained_blocks)
+    map[(block - start) / 8] |= 1 << ((block - start) % 8);
+}
+
+/* The block bitmap of a group whose bitmap was never written (BLOCK_UNINIT),
+   as the kernel would fill it in: everything is free but the group's copy
+   of the super block and descriptors, and its own bitmaps and inode table
+   if they are in the group (with flex_bg they usually aren't). Made once,
+   by whichever thread asks first.  */
+static const unsigned char *uninit_block_bitmap(unsigned int i) {
+
+  unsigned char *map = __atomic_load_n(&uninit_bitmaps[i], __ATOMIC_ACQUIRE);
+  unsigned char *made = NULL;
+  unsigned int start = sb.first_data_block + sb.blocks_per_group * i;
+  unsigned int table_blocks = ((uint64_t) sb.inodes_per_group * INODE_SIZE + sb.block_size - 1) / sb.block_size;
+
+  if (map != NULL)
+    return map;
+  if ((map = calloc(1, sb.block_size)) == NULL) {
+    perror("calloc"); exit(-1);
+  }
+  for (unsigned int b = group_super_blocks(i); b > 0; b--)
+    uninit_mark(map, i, start, start + b - 1);
+  uninit_mark(map, i, start, gd[i].block_bitmap_block);
+  uninit_mark(map, i, start, gd[i].inode_bitmap_block);
+  for (unsigned int b = 0; b < table_blocks; b++)
+    uninit_mark(map, i, start, gd[i].inode_table_start_block + b);
+
+  if (!__atomic_compare_exchange_n(&uninit_bitmaps[i], &made, map, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(map);
+    map = made;
+  }
+  return map;
+}
+
+/* A group's block bitmap, from the index when there is one; NULL if it can't be read.  */
+const unsigned char *group_block_bitmap(unsigned int i) {
+  if (idx.loaded)
+    return (idx.block_bitmaps + (size_t) i * idx.hdr->block_bitmap_bytes);
+  if (gd[i].flags & BG_BLOCK_UNINIT)
+    return uninit_block_bitmap(i);
+  return read_block(gd[i].block_bitmap_block);
+}
+
+/* A group's inode bitmap, from the index when there is one; NULL if it can't
+   be read. A group with no inodes in use yet (INODE_UNINIT) may never have
+   had it written.  */
+const unsigned char *group_inode_bitmap(unsigned int i) {
+  if (idx.loaded)
+    return (idx.inode_bitmaps + (size_t) i * idx.hdr->inode_bitmap_bytes);
+  if (gd[i].flags & BG_INODE_UNINIT)
+    return hole_zeros;
+  return read_block(gd[i].inode_bitmap_block);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                               SNAPSHOT DIFF                            //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+struct diff_base base;                      /* Group hashes of the snapshot given to '-d'            */
+unsigned char *GROUP_SELECT = NULL;         /* Groups the passes run on; NULL runs them all          */
+
+/* A fast 64-bit hash of 'n' bytes, carrying on from 'h': eight bytes at a time,
+   each mixed in with a multiply and a shift.  */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n) {
+
+  const unsigned char *p = data;
+  uint64_t w;
+
+  for (; n >= 8; p += 8, n -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+  }
+  if (n > 0) {
+    w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w ^ ((uint64_t) n << 56)) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+/*
+ * Hash everything in a group that the dump of it depends on: the file
+ * system's shape, the group's descriptor, both bitmaps, and its inode
+ * table up to the last allocated inode. The table is needed because
+ * changing a file (or adding to a directory) rewrites its inode without
+ * touching either bitmap.
+ */
+static uint64_t hash_group(unsigned int group) {
+
+  size_t mark = cache_hold();
+  const unsigned char *inode_bitmap = group_inode_bitmap(group);
+  const unsigned char *block_bitmap = group_block_bitmap(group);
+  const unsigned char *p;
+  size_t bitmap_bytes = (sb.inodes_per_group + 7) / 8;
+  size_t table_bytes, chunk;
+  off_t table = compute_offset(gd[group].inode_table_start_block);
+  uint64_t h = hash_bytes(14695981039346656037ULL, &sb, sizeof(sb));
+
+  /* A group that can't be read has no hash worth comparing; the failure is what counts.  */
+  if (inode_bitmap == NULL || block_bitmap == NULL) {
+    cache_release(mark);
+    return 0;
+  }
+  h = hash_bytes(h, &gd[group], sizeof(struct group_descr));
+  h = hash_bytes(h, block_bitmap, (gd[group].contained_blocks + 7) / 8);
+  h = hash_bytes(h, inode_bitmap, bitmap_bytes);
+
+  /* Inodes past the last allocated one are not dumped, so they don't count.  */
+  while (bitmap_bytes > 0 && inode_bitmap[bitmap_bytes - 1] == 0)
+    bitmap_bytes--;
+  table_bytes = 0;
+  if (bitmap_bytes > 0)
+    table_bytes = (size_t) ((bitmap_bytes - 1) * 8 + 32 - __builtin_clz(inode_bitmap[bitmap_bytes - 1])) * INODE_SIZE;
+  if (table_bytes > (size_t) sb.inodes_per_group * INODE_SIZE)
+    table_bytes = (size_t) sb.inodes_per_group * INODE_SIZE;
+
+  /* A block at a time, so a cached image never needs the whole table at once.  */
+  for (size_t done = 0; done < table_bytes; done += chunk) {
+    chunk = (table_bytes - done < sb.block_size) ? table_bytes - done : sb.block_size;
+    if ((p = image_ptr(table + done, chunk)) == NULL)
+      break;
+    h = hash_bytes(h, p, chunk);
+  }
+  cache_release(mark);
+  return h;
+}
+
+/* The group's hash, taken from the index when there is one.  */
+uint64_t group_hash(unsigned int i) {
+  if (idx.loaded)
+    return idx.hashes[i];
+  return hash_group(i);
+}
+
+static void hash_group_into(unsigned int i, struct csv_out **out, void *arg) {
+  (void) out;
+  ((uint64_t *) arg)[i] = group_hash(i);
+}
+
+/*
+ * Remember the group hashes of an earlier snapshot, before the new image
+ * is opened. 'path' is either an index file written with '-x' (which
+ * holds them) or the earlier image itself, which is opened, hashed and
+ * closed again. Returns 0 or -1.
+ */
+int load_diff_base(const char *path) {
+
+  struct index_header h;
+  int fd, result = 0;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return image_fail(errno, "%s", path);
+  if (read(fd, &h, sizeof(h)) == (ssize_t) sizeof(h) && memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) == 0) {
+    base.group_count = h.group_count;
+    if (h.version != INDEX_VERSION)
+      result = image_fail(EINVAL, "%s: index is version %u, not %u; pass the image or rebuild the index",
+			  path, h.version, INDEX_VERSION);
+    else if ((base.hashes = malloc(base.group_count * sizeof(uint64_t))) == NULL)
+      result = image_fail(ENOMEM, "%s", path);
+    else if (pread(fd, base.hashes, base.group_count * sizeof(uint64_t), h.hashes_at) !=
+	     (ssize_t) (base.group_count * sizeof(uint64_t)))
+      result = image_fail(EIO, "%s: index is cut short", path);
+    close(fd);
+    return result;
+  }
+  close(fd);
+
+  if (open_image(path) == -1)
+    return -1;
+  if (img.streaming)
+    return image_fail(ESPIPE, "%s: an earlier snapshot to diff against has to be seekable", path);
+  if (load_file_system() == -1)
+    return -1;
+  base.group_count = DESCRIPTOR_COUNT;
+  if ((base.hashes = malloc(base.group_count * sizeof(uint64_t))) == NULL)
+    return image_fail(ENOMEM, "%s", path);
+  if (for_each_group(hash_group_into, base.hashes, NULL, 0) == -1)
+    return -1;
+  close_image();
+  return 0;
+}
+
+/*
+ * Compare the open image's groups against the base and point GROUP_SELECT
+ * at the ones that differ (or that the base didn't have), so that the
+ * passes run only on those. Returns how many there are, or -1. A streamed
+ * image can't be hashed ahead of its passes, so it leaves GROUP_SELECT NULL
+ * and every group is dumped.
+ */
+int select_changed_groups(void) {
+
+  uint64_t *now;
+  unsigned int changed = 0;
+
+  if (img.streaming) {
+    fprintf(stderr, "%s: a diff needs a seekable image; dumping every group\n", img.path);
+    return DESCRIPTOR_COUNT;
+  }
+
+  if ((now = malloc(DESCRIPTOR_COUNT * sizeof(uint64_t))) == NULL)
+    return image_fail(ENOMEM, "%s", img.path);
+  if (for_each_group(hash_group_into, now, NULL, 0) == -1) {
+    free(now);
+    return -1;
+  }
+  if ((GROUP_SELECT = calloc(DESCRIPTOR_COUNT, 1)) == NULL) {
+    free(now);
+    return image_fail(ENOMEM, "%s", img.path);
+  }
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
+    GROUP_SELECT[i] = (i >= base.group_count || now[i] != base.hashes[i]);
+    changed += GROUP_SELECT[i];
+  }
+  free(now);
+  return changed;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                            BLOCK MAP TRAVERSAL                         //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+const int DIRECT_BLOCKS = 12;               /* i_block[0..11] point straight at data blocks          */
+const unsigned int EXTENTS_FL       = 0x80000;     /* i_block holds the root of an extent tree       */
+const unsigned int EXTENT_MAGIC     = 0xF30A;      /* First two bytes of every extent tree node      */
+const unsigned int EXTENT_MAX_DEPTH = 5;           /* Deeper than the kernel will ever build         */
+const unsigned int EXTENT_INIT_MAX  = 32768;       /* Longer leaf extents are uninitialized          */
+const size_t EXTENT_ROOT_SIZE       = 60;          /* The root node fills i_block                    */
+
+/* Prefetch the blocks named by 'count' pointers, one request per run of consecutive blocks.  */
+void prefetch_blocks(const unsigned char *ptrs, unsigned int count) {
+
+  unsigned int first, run, next;
+
+  for (unsigned int e = 0; e < count; e += run) {
+    first = get_le32(ptrs + 4*e);
+    for (run = 1; e + run < count; run++) {
+      next = get_le32(ptrs + 4*(e + run));
+      if (next != first + run)
+	break;
+    }
+    if (first != 0 && first < sb.block_total)
+      prefetch_range(compute_offset(first), (size_t) run * sb.block_size);
+  }
+}
+
+/* Whether the inode's i_block holds block pointers or an extent tree
+   (fast symlinks keep their target there).  */
+int has_block_map(const unsigned char *raw) {
+
+  unsigned int file_type = get_le16(raw + I_MODE_OFFSET) & 0xF000;
+
+  if (file_type == 0x8000 || file_type == 0x4000)
+    return 1;
+  return (file_type == 0xA000 && get_le32(raw + I_BLOCK_OFFSET) != 0);
+}
+
+/* Whether the inode's block map is an extent tree rather than block pointers.  */
+int has_extents(const unsigned char *raw) {
+  return ((get_le32(raw + I_FLAGS_OFFSET) & EXTENTS_FL) != 0);
+}
+
+/* The entries of the extent tree node at 'node' ('size' bytes of it), with
+   '*count' and '*depth' set from its header; NULL if it isn't a node.  */
+static const unsigned char *extent_node(const unsigned char *node, size_t size,
+					unsigned int *count, unsigned int *depth) {
+
+  unsigned int max;
+
+  if (get_le16(node) != EXTENT_MAGIC)
+    return NULL;
+  *count = get_le16(node + 2);
+  max = get_le16(node + 4);
+  *depth = get_le16(node + 6);
+  if (*count > max || max > (size - 12) / 12 || *depth > EXTENT_MAX_DEPTH)
+    return NULL;
+  return (node + 12);
+}
+
+/*
+ * Decode entry 'k' of a node 'depth' levels above the leaves. A leaf entry
+ * is (logical, length, start high, start low), with lengths past 32768
+ * marking uninitialized extents; an index entry is (logical, child low,
+ * child high). Block numbers past 32 bits can't be in the image, and come
+ * out as 0 like any other pointer to nowhere.
+ */
+static void extent_entry(const unsigned char *entries, unsigned int k, unsigned int depth,
+			 struct extent_ref *e) {
+
+  const unsigned char *p = entries + 12*k;
+  unsigned int high;
+
+  e->entry = k;
+  e->depth = depth;
+  e->logical = get_le32(p);
+  if (depth == 0) {
+    e->len = get_le16(p + 4);
+    e->uninit = (e->len > EXTENT_INIT_MAX);
+    if (e->uninit)
+      e->len -= EXTENT_INIT_MAX;
+    high = get_le16(p + 6);
+    e->start = get_le32(p + 8);
+  }
+  else {
+    e->len = 0;
+    e->uninit = 0;
+    e->start = get_le32(p + 4);
+    high = get_le16(p + 8);
+  }
+  if (high != 0 || e->start >= sb.block_total)
+    e->start = 0;
+}
+
+/* Hand fn each entry of the extent node at 'node' (in block 'block', 0 for
+   the root), each followed by the entries below it, so leaf extents come in
+   logical order. The children are prefetched before the first is read. A
+   node that couldn't be read (NULL) has no entries.  */
+static int extent_walk_node(unsigned int inode_number, const unsigned char *node, size_t size,
+			    unsigned int block, unsigned int want_depth, extent_cb fn, void *arg) {
+
+  const unsigned char *entries;
+  struct extent_ref e;
+  unsigned int count, depth;
+  int result;
+
+  if (node == NULL || (entries = extent_node(node, size, &count, &depth)) == NULL)
+    return 0;
+  if (block != 0 && depth != want_depth)   /* A child must be one level below its parent  */
+    return 0;
+
+  if (depth > 0) {
+    for (unsigned int k = 0; k < count; k++) {
+      extent_entry(entries, k, depth, &e);
+      if (e.start != 0)
+	prefetch_range(compute_offset(e.start), sb.block_size);
+    }
+  }
+
+  for (unsigned int k = 0; k < count; k++) {
+    extent_entry(entries, k, depth, &e);
+    e.node = block;
+    if ((result = fn(inode_number, &e, arg)) != 0)
+      return result;
+    if (depth > 0 && e.start != 0 &&
+	(result = extent_walk_node(inode_number, read_block(e.start), sb.block_size, e.start,
+				   depth - 1, fn, arg)) != 0)
+      return result;
+  }
+  return 0;
+}
+
+/* Call fn on every entry of an inode's extent tree, from the root in
+   i_block down; stops at (and returns) the first non-zero result, or -1 if
+   a node couldn't be read. An inode without a usable tree has no entries.  */
+int iterate_extents(unsigned int inode_number, const unsigned char *raw, extent_cb fn, void *arg) {
+
+  unsigned int failures = thread_failures;
+
+  return read_result(failures, extent_walk_node(inode_number, raw + B_PTRS_OFFSET, EXTENT_ROOT_SIZE, 0, 0,
+						fn, arg));
+}
+
+/* Feed one extent tree entry to a walk_blocks() walk: the entries held in
+   nodes below the root go to 'indirect', and the blocks of initialized
+   leaf extents to 'data', read ahead a whole extent at a time.  */
+static int walk_extent(unsigned int inode_number, const struct extent_ref *e, void *arg) {
+
+  struct block_walk *w = arg;
+  unsigned int len = e->len;
+
+  (void) inode_number;
+  if (e->node != 0 && e->start != 0 && w->indirect)
+    w->indirect(w, e->node, e->entry, e->start);
+  if (e->depth > 0 || e->uninit || e->start == 0 || w->data == NULL || w->stop)
+    return w->stop;
+
+  if (len > sb.block_total - e->start)
+    len = sb.block_total - e->start;
+  prefetch_range(compute_offset(e->start), (size_t) len * sb.block_size);
+  for (unsigned int k = 0; k < len && !w->stop; k++)
+    w->data(w, (uint64_t) e->logical + k, e->start + k);
+  return w->stop;
+}
+
+/*
+ * Visit one indirect block 'level' levels above the data, whose first
+ * pointer maps logical block 'logical'. The block's own entries are
+ * reported first and then walked in order. Before walking, the children
+ * are prefetched, so the next level is being read in while this one is
+ * decoded.
+ */
+static void walk_indirect(struct block_walk *w, unsigned int block, int level, uint64_t logical) {
+
+  unsigned int per_block = sb.block_size / 4;
+  uint64_t span = 1;
+  const unsigned char *ptrs;
+  unsigned int ptr;
+
+  for (int l = 1; l < level; l++)
+    span *= per_block;
+
+  if ((ptrs = read_block(block)) == NULL)
+    return;
+
+  if (w->indirect) {
+    for (unsigned int e = 0; e < per_block && !w->stop; e++) {
+      ptr = get_le32(ptrs + 4*e);
+      if (ptr != 0)
+	w->indirect(w, block, e, ptr);
+    }
+  }
+
+  if (level > 1 || w->data)
+    prefetch_blocks(ptrs, per_block);
+
+  for (unsigned int e = 0; e < per_block && !w->stop; e++) {
+    ptr = get_le32(ptrs + 4*e);
+    if (ptr == 0 || ptr >= sb.block_total)   /* A hole, or a pointer off the end of the image  */
+      continue;
+    if (level > 1)
+      walk_indirect(w, ptr, level - 1, logical + e*span);
+    else if (w->data)
+      w->data(w, logical + e, ptr);
+  }
+}
+
+/*
+ * Resolve the inode's logical-to-physical block map, following the single,
+ * double and triple indirect pointers in i_block[12..14] (or the extent
+ * tree, for an inode that has one). 'data' (if set)
+ * sees each data block in logical order and 'indirect' (if set) each
+ * pointer held in an indirect block, exactly once, so one walk can feed
+ * several consumers and no indirect block is read twice. Either callback
+ * can set 'stop' to end the walk early. Returns 0, or -1 if a block of
+ * the walk (the callbacks' own reads included) couldn't be read.
+ */
+int walk_blocks(struct block_walk *w) {
+
+  const unsigned char *i_block = w->raw + B_PTRS_OFFSET;
+  unsigned int per_block = sb.block_size / 4;
+  uint64_t logical = DIRECT_BLOCKS;
+  uint64_t span = 1;
+  unsigned int ptr;
+  unsigned int failures = thread_failures;
+
+  /* A walk that wants the data gets all of it read ahead, not just the indirect blocks.  */
+  w->stop = 0;
+  if (has_extents(w->raw)) {
+    iterate_extents(w->inode_number, w->raw, walk_extent, w);
+    return read_result(failures, 0);
+  }
+  if (w->data)
+    prefetch_blocks(i_block, DIRECT_BLOCKS + 3);
+  else
+    prefetch_blocks(i_block + 4*DIRECT_BLOCKS, 3);
+
+  if (w->data) {
+    for (int b = 0; b < DIRECT_BLOCKS && !w->stop; b++) {
+      ptr = get_le32(i_block + 4*b);
+      if (ptr != 0 && ptr < sb.block_total)
+	w->data(w, b, ptr);
+    }
+  }
+
+  for (int level = 1; level <= 3 && !w->stop; level++) {
+    span *= per_block;
+    ptr = get_le32(i_block + 4*(DIRECT_BLOCKS + level - 1));
+    if (ptr != 0 && ptr < sb.block_total)
+      walk_indirect(w, ptr, level, logical);
+    logical += span;
+  }
+  return read_result(failures, 0);
+}
+
+/* The entry of a node (of 'count' sorted by logical block) whose range
+   takes in 'logical': the last one starting at or before it, or -1.  */
+static int extent_search(const unsigned char *entries, unsigned int count, uint64_t logical) {
+
+  unsigned int lo = 0, hi = count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (get_le32(entries + 12*mid) <= logical)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (int) lo - 1;
+}
+
+/* map_block() through an extent tree: a binary search of each node on the
+   way down, so one block read per level below the root.  */
+static unsigned int map_extent(const unsigned char *raw, uint64_t logical) {
+
+  const unsigned char *node = raw + B_PTRS_OFFSET, *entries;
+  size_t size = EXTENT_ROOT_SIZE;
+  unsigned int count, depth, want_depth = 0;
+  struct extent_ref e;
+  int k;
+
+  if (logical > UINT32_MAX)
+    return 0;
+  for (int level = 0; ; level++) {
+    if ((entries = extent_node(node, size, &count, &depth)) == NULL)
+      return 0;
+    if (level > 0 && depth != want_depth)
+      return 0;
+    if ((k = extent_search(entries, count, logical)) < 0)
+      return 0;
+    extent_entry(entries, k, depth, &e);
+    if (e.start == 0)
+      return 0;
+    if (depth == 0)
+      break;
+    if ((node = read_block(e.start)) == NULL)
+      return 0;
+    size = sb.block_size;
+    want_depth = depth - 1;
+  }
+
+  if (e.uninit || logical - e.logical >= e.len || e.start + (logical - e.logical) >= sb.block_total)
+    return 0;
+  return e.start + (logical - e.logical);
+}
+
+/* The block holding logical block 'logical' of the inode, or 0 for a hole
+   (or a pointer off the end of the image, or one behind a block that
+   couldn't be read). Only the indirect blocks on the way to it are read,
+   one per level.  */
+unsigned int map_block(const unsigned char *raw, uint64_t logical) {
+
+  const unsigned char *i_block = raw + B_PTRS_OFFSET;
+  unsigned int per_block = sb.block_size / 4;
+  uint64_t span = 1;
+  const unsigned char *ptrs;
+  unsigned int ptr;
+  int level;
+
+  if (has_extents(raw))
+    return map_extent(raw, logical);
+  if (logical < (uint64_t) DIRECT_BLOCKS)
+    return get_le32(i_block + 4*logical) < sb.block_total ? get_le32(i_block + 4*logical) : 0;
+
+  /* Find which of the indirect trees covers it, and where in that tree it is.  */
+  logical -= DIRECT_BLOCKS;
+  for (level = 1; level <= 3; level++) {
+    span *= per_block;
+    if (logical < span)
+      break;
+    logical -= span;
+  }
+  if (level > 3)
+    return 0;
+
+  ptr = get_le32(i_block + 4*(DIRECT_BLOCKS + level - 1));
+  for (; level > 0 && ptr != 0 && ptr < sb.block_total; level--) {
+    span /= per_block;
+    if ((ptrs = read_block(ptr)) == NULL)
+      return 0;
+    ptr = get_le32(ptrs + 4*(logical / span));
+    logical %= span;
+  }
+  return (ptr < sb.block_total) ? ptr : 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                        INODES & DIRECTORY ENTRIES                      //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Decode every field of an on-disk inode.  */
+void decode_inode(const unsigned char *raw, struct inode *ino) {
+
+  ino->mode = get_le16(raw + I_MODE_OFFSET);
+  ino->uid = get_le16(raw + I_UID_OFFSET) | (get_le16(raw + I_UID_HIGH_OFFSET) << 16);
+  ino->size = get_le32(raw + I_SIZE_OFFSET);
+  ino->atime = get_le32(raw + I_ACCESS_OFFSET);
+  ino->ctime = get_le32(raw + I_CREATE_OFFSET);
+  ino->mtime = get_le32(raw + I_MOD_OFFSET);
+  ino->dtime = get_le32(raw + I_DELETE_OFFSET);
+  ino->gid = get_le16(raw + I_GID_OFFSET) | (get_le16(raw + I_GID_HIGH_OFFSET) << 16);
+  ino->links_count = get_le16(raw + I_LINK_COUNT_OFFSET);
+  ino->blocks = get_le32(raw + I_BLOCK_OFFSET);
+  ino->flags = get_le32(raw + I_FLAGS_OFFSET);
+  for (int b = 0; b < 15; b++)
+    ino->block[b] = get_le32(raw + B_PTRS_OFFSET + 4*b);
+  ino->generation = get_le32(raw + I_GENERATION_OFFSET);
+  ino->file_acl = get_le32(raw + I_FILE_ACL_OFFSET);
+  ino->size_high = get_le32(raw + I_SIZE_HIGH_OFFSET);
+  ino->faddr = get_le32(raw + I_FADDR_OFFSET);
+}
+
+/* The on-disk entry of inode 'inode_number' (counted from 1), or NULL with
+   errno set: ENOENT if there is no such inode, or why it couldn't be read.  */
+const unsigned char *get_inode(unsigned int inode_number) {
+
+  unsigned int group, index;
+
+  errno = ENOENT;
+  if (inode_number == 0 || sb.inodes_per_group == 0)
+    return NULL;
+  group = (inode_number - 1) / sb.inodes_per_group;
+  index = (inode_number - 1) % sb.inodes_per_group;
+  if (group >= DESCRIPTOR_COUNT)
+    return NULL;
+  return image_ptr(compute_offset(gd[group].inode_table_start_block) + (off_t) INODE_SIZE*index, INODE_SIZE);
+}
+
+/* Call fn on every group descriptor in order; stops at (and returns) the first non-zero result.  */
+int iterate_groups(group_cb fn, void *arg) {
+
+  int result;
+
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++)
+    if ((result = fn(i, &gd[i], arg)) != 0)
+      return result;
+  return 0;
+}
+
+unsigned int INODE_FIRST = 0;               /* Only inodes INODE_FIRST..INODE_LAST are scanned ('-i');  */
+unsigned int INODE_LAST  = 0;               /*   0 leaves that end open                               */
+int DECODE_ALL = 1;                         /* Whether batches decode every column, or only the few   */
+                                            /*   a filter looks at (number, mode, links, uid, mtime)  */
+
+/* The slots of a group's inode table, [*from, *to), that INODE_FIRST..INODE_LAST leaves in.  */
+void group_inode_slots(unsigned int group, unsigned int *from, unsigned int *to) {
+
+  uint64_t base = (uint64_t) sb.inodes_per_group * group;
+
+  *from = 0;
+  *to = sb.inodes_per_group;
+  if (INODE_FIRST > base + 1)
+    *from = (INODE_FIRST - base - 1 < sb.inodes_per_group) ? INODE_FIRST - base - 1 : sb.inodes_per_group;
+  if (INODE_LAST != 0 && INODE_LAST < base + sb.inodes_per_group)
+    *to = (INODE_LAST > base) ? INODE_LAST - base : 0;
+  if (*to < *from)
+    *to = *from;
+}
+
+/* Whether a group's inode bitmap is in a hole of the image, or was never
+   written (INODE_UNINIT): none of its inodes are in use then, and nothing
+   of its inode table needs reading.  */
+static int group_unused(unsigned int group) {
+  return (!idx.loaded && ((gd[group].flags & BG_INODE_UNINIT) ||
+			  image_hole(compute_offset(gd[group].inode_bitmap_block), sb.block_size)));
+}
+
+/* Start walking a group's inode bitmap over just the slots INODE_FIRST..INODE_LAST
+   leaves in; -1 (and nothing to walk) if the bitmap couldn't be read.  */
+int group_inode_iter_init(struct bitmap_iter *it, unsigned int group, int want_set) {
+
+  const unsigned char *map = NULL;
+  unsigned int from, to;
+
+  group_inode_slots(group, &from, &to);
+  if (want_set && group_unused(group))
+    from = to;
+  if (from < to)
+    map = group_inode_bitmap(group);
+  bitmap_iter_init(it, map, to, want_set);
+  it->pos = from;
+  return (from < to && map == NULL) ? -1 : 0;
+}
+
+/* Whether a scan reads any of a group's inode table, and if so which slots of it.  */
+static int group_scanned(unsigned int group, unsigned int *from, unsigned int *to) {
+
+  if (group >= DESCRIPTOR_COUNT || (GROUP_SELECT != NULL && !GROUP_SELECT[group]))
+    return 0;
+  group_inode_slots(group, from, to);
+  return (*from < *to && !group_unused(group));
+}
+
+/* Prefetch the inode bitmaps (or, with 'tables', the scanned part of the
+   inode tables) of the groups 'group'..'last'-1 that a scan reads, one
+   request for each run of them lying end to end on disk.  */
+static void prefetch_flex(unsigned int group, unsigned int last, int tables) {
+
+  unsigned int from, to;
+  off_t run = 0, run_end = 0, offset;
+  size_t len;
+
+  for (unsigned int g = group; g < last; g++) {
+    if (!group_scanned(g, &from, &to))
+      continue;
+    if (tables) {
+      offset = compute_offset(gd[g].inode_table_start_block) + (off_t) INODE_SIZE*from;
+      len = (size_t) (to - from) * INODE_SIZE;
+    }
+    else {
+      offset = compute_offset(gd[g].inode_bitmap_block);
+      len = sb.block_size;
+    }
+    if (offset != run_end) {
+      if (run_end > run)
+	prefetch_range(run, run_end - run);
+      run = offset;
+    }
+    run_end = offset + len;
+  }
+  if (run_end > run)
+    prefetch_range(run, run_end - run);
+}
+
+/*
+ * Start reading in what a scan of a group reads first: its inode bitmap
+ * (unless the index stands in for it) and the part of its inode table the
+ * scan covers. Groups the passes skip are left alone. With flex_bg the
+ * bitmaps and inode tables of a whole flex group sit side by side, so the
+ * first group of a flex that is scanned asks for all of them at once, in a
+ * few large reads, and the rest ask for nothing.
+ */
+static void prefetch_group(unsigned int group) {
+
+  unsigned int from, to, first, last;
+
+  if (!group_scanned(group, &from, &to))
+    return;
+  if (sb.groups_per_flex <= 1) {
+    if (!idx.loaded)
+      prefetch_range(compute_offset(gd[group].inode_bitmap_block), sb.block_size);
+    prefetch_range(compute_offset(gd[group].inode_table_start_block) + (off_t) INODE_SIZE*from,
+		   (size_t) (to - from) * INODE_SIZE);
+    return;
+  }
+
+  first = group - group % sb.groups_per_flex;
+  for (unsigned int g = first; g < group; g++)
+    if (group_scanned(g, &from, &to))
+      return;
+  last = (DESCRIPTOR_COUNT - first > sb.groups_per_flex) ? first + sb.groups_per_flex : DESCRIPTOR_COUNT;
+  if (!idx.loaded)
+    prefetch_flex(group, last, 0);
+  prefetch_flex(group, last, 1);
+}
+
+/* Start enumerating the allocated inodes of one group. Its inode table is
+   prefetched, and so is the next group's, so that it is on its way while this
+   one is decoded.  */
+static void inode_cursor_init(struct inode_cursor *c, unsigned int group) {
+
+  c->group = group;
+  c->table_offset = compute_offset(gd[group].inode_table_start_block);
+  prefetch_group(group);
+  prefetch_group(group + 1);
+
+  /* The index already lists where the allocated inodes are; otherwise find them in the bitmap.  */
+  group_inode_slots(group, &c->from, &c->to);
+  if (idx.loaded) {
+    c->next = idx.first[group];
+    c->end = idx.first[group+1];
+  }
+  else
+    group_inode_iter_init(&c->it, group, 1);
+}
+
+/* The index in the group's table of the next allocated inode, or -1 once there are no more.  */
+static int inode_cursor_next(struct inode_cursor *c) {
+
+  unsigned int slot;
+
+  if (!idx.loaded)
+    return bitmap_next(&c->it);
+  while (c->next < c->end) {
+    slot = (idx.offsets[c->next++] - c->table_offset) / INODE_SIZE;
+    if (slot >= c->to)
+      break;
+    if (slot >= c->from)
+      return slot;
+  }
+  c->next = c->end;
+  return -1;
+}
+
+/*
+ * Call fn on every allocated inode of one group, in inode order, with a
+ * pointer to its entry in the inode table; stops at (and returns) the
+ * first non-zero result. The table is prefetched as a whole, so it is
+ * read in with large sequential reads rather than one entry at a time.
+ * Inodes that can't be read are passed over, and -1 returned at the end.
+ */
+int iterate_inodes(unsigned int group, inode_cb fn, void *arg) {
+
+  struct inode_cursor c;
+  const unsigned char *raw;
+  unsigned int failures = thread_failures;
+  int slot, result = 0;
+
+  inode_cursor_init(&c, group);
+  while ((slot = inode_cursor_next(&c)) != -1) {
+    if ((raw = image_ptr(c.table_offset + (off_t) INODE_SIZE*slot, INODE_SIZE)) == NULL)
+      continue;
+    if ((result = fn((sb.inodes_per_group * group) + slot + 1, raw, arg)) != 0)
+      break;
+  }
+  return read_result(failures, result);
+}
+
+/* Decode the inodes at 'slots' of one inode table block into rows 0..count-1 of the batch's columns.  */
+void decode_inode_batch(struct inode_batch *b, const unsigned char *entries,
+			unsigned int first_number, const unsigned int *slots, unsigned int count) {
+
+  const unsigned char *p;
+
+  for (unsigned int k = 0; k < count; k++) {
+    p = entries + INODE_SIZE*slots[k];
+    b->raw[k] = p;
+    b->number[k] = first_number + slots[k];
+    b->mode[k] = get_le16(p + I_MODE_OFFSET);
+    b->links_count[k] = get_le16(p + I_LINK_COUNT_OFFSET);
+    b->uid[k] = get_le16(p + I_UID_OFFSET) | (get_le16(p + I_UID_HIGH_OFFSET) << 16);
+    b->mtime[k] = get_le32(p + I_MOD_OFFSET);
+    if (!DECODE_ALL)
+      continue;
+    b->gid[k] = get_le16(p + I_GID_OFFSET) | (get_le16(p + I_GID_HIGH_OFFSET) << 16);
+    b->size[k] = get_le32(p + I_SIZE_OFFSET);
+    b->atime[k] = get_le32(p + I_ACCESS_OFFSET);
+    b->ctime[k] = get_le32(p + I_CREATE_OFFSET);
+    b->blocks[k] = get_le32(p + I_BLOCK_OFFSET);
+    for (int e = 0; e < 15; e++)
+      b->block[15*k + e] = get_le32(p + B_PTRS_OFFSET + 4*e);
+  }
+  b->count = count;
+}
+
+/*
+ * Call fn once per block of one group's inode table that holds allocated
+ * inodes, with those inodes decoded into columns; stops at (and returns)
+ * the first non-zero result. The batch (and the raw pointers in it) is
+ * only valid during the call. Blocks that can't be read are passed over,
+ * and -1 returned at the end.
+ */
+int iterate_inode_batches(unsigned int group, batch_cb fn, void *arg) {
+
+  struct inode_cursor c;
+  struct inode_batch b;
+  unsigned int per_block = sb.block_size / INODE_SIZE;
+  unsigned int slots[per_block];
+  unsigned int count = 0, table_block = 0, first, entries;
+  unsigned int failures = thread_failures;
+  const unsigned char *table;
+  int slot, result = 0;
+
+  /* A table block holds at most 512 inodes, so the columns fit on the stack.  */
+  const unsigned char *raw[per_block];
+  uint32_t number[per_block], uid[per_block], gid[per_block], size[per_block];
+  uint32_t atime[per_block], ctime[per_block], mtime[per_block], blocks[per_block];
+  uint32_t block[15 * per_block];
+  uint16_t mode[per_block], links_count[per_block];
+
+  b.raw = raw;
+  b.number = number;
+  b.mode = mode;
+  b.links_count = links_count;
+  b.uid = uid;
+  b.gid = gid;
+  b.size = size;
+  b.atime = atime;
+  b.ctime = ctime;
+  b.mtime = mtime;
+  b.blocks = blocks;
+  b.block = block;
+
+  inode_cursor_init(&c, group);
+  do {
+    slot = inode_cursor_next(&c);
+
+    /* Decode what was gathered for the previous table block before moving on.  */
+    if (count > 0 && (slot == -1 || (unsigned int) slot / per_block != table_block)) {
+      first = table_block * per_block;
+      entries = sb.inodes_per_group - first < per_block ? sb.inodes_per_group - first : per_block;
+      table = image_ptr(c.table_offset + (off_t) INODE_SIZE*first, (size_t) INODE_SIZE*entries);
+      if (table != NULL) {
+	decode_inode_batch(&b, table, (sb.inodes_per_group * group) + first + 1, slots, count);
+	if ((result = fn(&b, arg)) != 0)
+	  break;
+      }
+      count = 0;
+    }
+    if (slot != -1) {
+      table_block = slot / per_block;
+      slots[count++] = slot % per_block;
+    }
+  } while (slot != -1);
+
+  return read_result(failures, result);
+}
+
+/*
+ * Call fn on every in-use entry of one data block of a directory, where
+ * the block maps logical block 'logical' of the directory; stops at (and
+ * returns) the first non-zero result, or -1 if the block can't be read.
+ * Blocks past the end of the directory hold no entries.
+ */
+int iterate_dirent_block(unsigned int inode_number, const unsigned char *raw,
+			 uint64_t logical, unsigned int block, dirent_cb fn, void *arg) {
+
+  const unsigned char *dir_block;
+  const unsigned char *entry;
+  unsigned int entry_offset = 0;
+  struct dirent_ref d;
+  int result;
+
+  if (logical * sb.block_size >= get_le32(raw + I_SIZE_OFFSET))
+    return 0;
+
+  if ((dir_block = read_block(block)) == NULL)
+    return -1;
+  d.entry = 0;
+
+  while (entry_offset + 8 <= sb.block_size) {
+    entry = dir_block + entry_offset;
+    d.rec_len = get_le16(entry + 4);
+
+    /* A zero-length record would never advance; the block is corrupt.  */
+    if (d.rec_len == 0)
+      break;
+
+    if ((d.inode = get_le32(entry)) != 0) {
+      d.name_len = entry[6];
+      d.file_type = entry[7];
+      d.name = entry + 8;
+
+      /* The name is not NUL terminated on disk; never let it run past the block.  */
+      d.name_bytes = d.name_len;
+      if (d.name_bytes > sb.block_size - entry_offset - 8)
+	d.name_bytes = sb.block_size - entry_offset - 8;
+
+      if ((result = fn(inode_number, &d, arg)) != 0)
+	return result;
+      d.entry++;
+    }
+
+    entry_offset += d.rec_len;
+  }
+  return 0;
+}
+
+/* Hand one directory block of a walk to iterate_dirent_block.  */
+static void dirent_walk_block(struct block_walk *w, uint64_t logical, unsigned int block) {
+
+  struct dirent_walk *dw = w->arg;
+
+  dw->result = iterate_dirent_block(w->inode_number, w->raw, logical, block, dw->fn, dw->arg);
+  if (dw->result != 0)
+    w->stop = 1;
+}
+
+/* Call fn on every entry of a directory, block by block in logical order;
+   stops at (and returns) the first non-zero result, or -1 if a block of it
+   couldn't be read.  */
+int iterate_dirents(unsigned int inode_number, const unsigned char *raw, dirent_cb fn, void *arg) {
+
+  struct dirent_walk dw = { fn, arg, 0 };
+  struct block_walk w = { inode_number, raw, dirent_walk_block, NULL, &dw, 0 };
+
+  if ((get_le16(raw + I_MODE_OFFSET) & 0xF000) != 0x4000)
+    return 0;
+  if (walk_blocks(&w) == -1)
+    return -1;
+  return dw.result;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                              DIRECTORY TREE                            //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+const unsigned int ROOT_INODE     = 2;      /* Inode of the root directory                           */
+const unsigned int DIR_MEMO_SLOTS = 4096;   /* Path prefixes remembered by dir_tree_lookup()         */
+
+/* Every name the directory pass has seen, once dir_tree_init() has been called.  */
+struct dir_tree tree = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Start an empty tree; the directory pass adds to it from then on.  */
+void dir_tree_init(void) {
+
+  tree.inode_count = sb.inode_total;
+  tree.link = calloc((size_t) tree.inode_count + 1, sizeof(uint32_t));
+  tree.bucket_count = 1024;
+  tree.buckets = calloc(tree.bucket_count, sizeof(uint32_t));
+  tree.memo = calloc(DIR_MEMO_SLOTS, sizeof(struct dir_memo));
+  if (tree.link == NULL || tree.buckets == NULL || tree.memo == NULL) {
+    perror("calloc"); exit(-1);
+  }
+}
+
+static uint32_t *dir_tree_bucket(unsigned int parent, const void *name, size_t len) {
+  return &tree.buckets[hash_bytes(parent, name, len) & (tree.bucket_count - 1)];
+}
+
+/* Double the hash buckets once there are more links than buckets, so chains stay short.  */
+static void dir_tree_rehash(void) {
+
+  struct dir_link *l;
+  uint32_t *bucket;
+
+  free(tree.buckets);
+  tree.bucket_count *= 2;
+  if ((tree.buckets = calloc(tree.bucket_count, sizeof(uint32_t))) == NULL) {
+    perror("calloc"); exit(-1);
+  }
+  for (uint32_t n = 1; n <= tree.link_count; n++) {
+    l = &tree.links[n];
+    bucket = dir_tree_bucket(l->parent, tree.names + l->name_at, l->name_len);
+    l->next = *bucket;
+    *bucket = n;
+  }
+}
+
+/* Whether the path of an inode with links 'a' and 'b' should go through 'a'.  */
+static int dir_link_before(const struct dir_link *a, const struct dir_link *b) {
+
+  int order;
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  order = memcmp(tree.names + a->name_at, tree.names + b->name_at,
+		 a->name_len < b->name_len ? a->name_len : b->name_len);
+  return order < 0 || (order == 0 && a->name_len < b->name_len);
+}
+
+/* Add entry 'd' of directory 'parent'. Which link an inode's path goes through
+   doesn't depend on the order entries come in, so '-j' gives the same tree.  */
+void dir_tree_add(unsigned int parent, const struct dirent_ref *d) {
+
+  struct dir_link *l;
+  uint32_t *bucket, n;
+
+  if (d->inode == 0 || d->inode > tree.inode_count || d->name_bytes == 0)
+    return;
+  if (d->name[0] == '.' && (d->name_bytes == 1 || (d->name_bytes == 2 && d->name[1] == '.')))
+    return;
+
+  pthread_mutex_lock(&tree.lock);
+
+  /* Links are numbered from 1, so that 0 can mean none.  */
+  if (tree.link_count + 1 >= tree.link_cap) {
+    tree.link_cap = tree.link_cap ? 2 * tree.link_cap : 1024;
+    if ((tree.links = realloc(tree.links, tree.link_cap * sizeof(struct dir_link))) == NULL) {
+      perror("realloc"); exit(-1);
+    }
+  }
+  while (tree.names_len + d->name_bytes > tree.names_cap) {
+    tree.names_cap = tree.names_cap ? 2 * tree.names_cap : 65536;
+    if ((tree.names = realloc(tree.names, tree.names_cap)) == NULL) {
+      perror("realloc"); exit(-1);
+    }
+  }
+
+  n = ++tree.link_count;
+  l = &tree.links[n];
+  l->parent = parent;
+  l->inode = d->inode;
+  l->name_len = d->name_bytes;
+  l->name_at = tree.names_len;
+  memcpy(tree.names + tree.names_len, d->name, d->name_bytes);
+  tree.names_len += d->name_bytes;
+
+  bucket = dir_tree_bucket(parent, d->name, d->name_bytes);
+  l->next = *bucket;
+  *bucket = n;
+  if (tree.link_count > tree.bucket_count)
+    dir_tree_rehash();
+
+  if (tree.link[d->inode] == 0 || dir_link_before(l, &tree.links[tree.link[d->inode]]))
+    tree.link[d->inode] = n;
+
+  pthread_mutex_unlock(&tree.lock);
+}
+
+/* Write the path of 'inode' at the end of 'buf' and return where it starts,
+   or NULL if it has no name, can't be traced to the root, or won't fit.  */
+const char *dir_tree_path(unsigned int inode, char *buf, size_t size) {
+
+  char *p = buf + size;
+  const struct dir_link *l;
+
+  if (size < 2)
+    return NULL;
+  *--p = '\0';
+  if (inode == ROOT_INODE) {
+    *--p = '/';
+    return p;
+  }
+  while (inode != ROOT_INODE) {
+    if (inode == 0 || inode > tree.inode_count || tree.link[inode] == 0)
+      return NULL;
+    l = &tree.links[tree.link[inode]];
+    if ((size_t) (p - buf) < l->name_len + 1)
+      return NULL;
+    p -= l->name_len;
+    memcpy(p, tree.names + l->name_at, l->name_len);
+    *--p = '/';
+    inode = l->parent;
+  }
+  return p;
+}
+
+/* The inode 'name' names in directory 'parent', or 0.  */
+static unsigned int dir_tree_child(unsigned int parent, const char *name, size_t len) {
+
+  const struct dir_link *l;
+
+  if (len == 1 && name[0] == '.')
+    return parent;
+  if (len == 2 && name[0] == '.' && name[1] == '.') {
+    if (parent == ROOT_INODE)
+      return parent;
+    return tree.link[parent] ? tree.links[tree.link[parent]].parent : 0;
+  }
+  for (uint32_t n = *dir_tree_bucket(parent, name, len); n != 0; n = l->next) {
+    l = &tree.links[n];
+    if (l->parent == parent && l->name_len == len && memcmp(tree.names + l->name_at, name, len) == 0)
+      return l->inode;
+  }
+  return 0;
+}
+
+/*
+ * Return the inode a path from the root leads to, or 0 if there isn't one.
+ * Each prefix of the path is hashed as it goes by, and the walk starts from
+ * the longest one an earlier lookup already resolved, so looking up many
+ * paths in the same deep directory only walks down to it once.
+ */
+unsigned int dir_tree_lookup(const char *path) {
+
+  size_t len = strlen(path), at = 0, k, count = 0;
+  uint64_t h = ROOT_INODE;
+  unsigned int inode = ROOT_INODE;
+  struct dir_memo *m;
+  struct { const char *name; size_t len; uint64_t hash; } names[len / 2 + 1];
+
+  /* Split the path into names, hashing each prefix.  */
+  while (at < len) {
+    while (at < len && path[at] == '/')
+      at++;
+    if (at == len)
+      break;
+    names[count].name = path + at;
+    while (at < len && path[at] != '/')
+      at++;
+    names[count].len = path + at - names[count].name;
+    h = hash_bytes(h ^ names[count].len, names[count].name, names[count].len);
+    names[count++].hash = h;
+  }
+
+  /* Start below the longest prefix already resolved.  */
+  for (k = count; k > 0; k--) {
+    m = &tree.memo[names[k-1].hash & (DIR_MEMO_SLOTS - 1)];
+    if (m->hash == names[k-1].hash && m->len == k && m->inode != 0) {
+      inode = m->inode;
+      break;
+    }
+  }
+
+  for (; k < count; k++) {
+    if ((inode = dir_tree_child(inode, names[k].name, names[k].len)) == 0)
+      return 0;
+    m = &tree.memo[names[k].hash & (DIR_MEMO_SLOTS - 1)];
+    *m = (struct dir_memo) { names[k].hash, k + 1, inode };
+  }
+  return inode;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                           HASHED DIRECTORIES                           //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * A directory with the index flag (ext3's dir_index) keeps a hash tree over
+ * its ordinary directory blocks. Logical block 0 starts with "." and ".."
+ * like any other, but ".." stretches over the rest of the block, which
+ * holds the root: a small header, then (hash, block) entries sorted by
+ * hash. Each entry sends the names hashing to at least its hash (and less
+ * than the next entry's) to a block; below the root there may be a level
+ * of index blocks of the same shape, each hidden behind one empty entry
+ * that covers the whole block, and under those are the leaves. Since both
+ * kinds of index block read as directory blocks with no entries in use,
+ * the linear walks above go straight through them.
+ */
+
+const unsigned int INDEX_FLAG      = 0x1000;  /* i_flags bit of a directory with a hash index        */
+const unsigned int UNSIGNED_HASH   = 0x2;     /* s_flags bit: names hash as unsigned chars           */
+const int HASH_SEED_OFFSET         = 236;     /* Super block offset of the four words of hash seed   */
+const int S_FLAGS_OFFSET           = 352;     /* Super block offset of s_flags                       */
+const int DX_ROOT_INFO_OFFSET      = 24;      /* Root header, just past the "." and ".." entries     */
+const int DX_NODE_OFFSET           = 8;       /* Entries of an index block, past its empty entry     */
+const unsigned int DX_MAX_LEVELS   = 2;       /* Index levels below the root (largedir allows two)   */
+
+/* Which word of input each step of half MD4 adds in, and how far it rotates.  */
+static const unsigned char MD4_WORD[24]  = { 0, 1, 2, 3, 4, 5, 6, 7,  1, 3, 5, 7, 0, 2, 4, 6,  3, 7, 2, 6, 1, 5, 0, 4 };
+static const unsigned char MD4_SHIFT[24] = { 3, 7, 11, 19, 3, 7, 11, 19,  3, 5, 9, 13, 3, 5, 9, 13,  3, 9, 11, 15, 3, 9, 11, 15 };
+static const uint32_t MD4_ROUND[3]       = { 0, 013240474631, 015666365641 };
+
+/* A byte of a name, as a signed or an unsigned char.  */
+static int dx_char(const struct htree *h, unsigned char c) {
+  return h->unsigned_chars ? (int) c : (int) (signed char) c;
+}
+
+/* The original hash, from before half MD4 became the default.  */
+static uint32_t dx_legacy(const struct htree *h, const unsigned char *name, size_t len) {
+
+  uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+  for (size_t i = 0; i < len; i++) {
+    hash = hash1 + (hash0 ^ (uint32_t) (dx_char(h, name[i]) * 7152373));
+    if (hash & 0x80000000)
+      hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return (hash0 << 1);
+}
+
+/* Pack up to 4*count bytes of a name into 'count' words, four to a word,
+   filling out with a pattern made from the length of what's left.  */
+static void dx_words(const struct htree *h, const unsigned char *name, size_t len, uint32_t *words, int count) {
+
+  uint32_t pad = (uint32_t) len | ((uint32_t) len << 8), val;
+
+  pad |= pad << 16;
+  val = pad;
+  if (len > (size_t) count * 4)
+    len = count * 4;
+  for (size_t i = 0; i < len; i++) {
+    val = (uint32_t) dx_char(h, name[i]) + (val << 8);
+    if (i % 4 == 3) {
+      *words++ = val;
+      val = pad;
+      count--;
+    }
+  }
+  if (--count >= 0)
+    *words++ = val;
+  while (--count >= 0)
+    *words++ = pad;
+}
+
+/* Three rounds of MD4 (F, G and H) over eight words, added into 'buf'.  */
+static void dx_half_md4(uint32_t buf[4], const uint32_t in[8]) {
+
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3], f, t;
+
+  for (int r = 0; r < 24; r++) {
+    if (r < 8)
+      f = d ^ (b & (c ^ d));
+    else if (r < 16)
+      f = (b & c) + ((b ^ c) & d);
+    else
+      f = b ^ c ^ d;
+    a += f + in[MD4_WORD[r]] + MD4_ROUND[r / 8];
+    a = (a << MD4_SHIFT[r]) | (a >> (32 - MD4_SHIFT[r]));
+
+    /* The next step works on the word before, with the others moved along one.  */
+    t = d; d = c; c = b; b = a; a = t;
+  }
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+/* Sixteen rounds of TEA over four words, added into the first two of 'buf'.  */
+static void dx_tea(uint32_t buf[4], const uint32_t in[4]) {
+
+  uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+
+  for (int n = 0; n < 16; n++) {
+    sum += 0x9E3779B9;
+    b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+    b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+  }
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/* The hash a name is filed under in a directory's index. The low bit is
+   left clear; in an index entry it marks names that overflowed into the
+   next block.  */
+uint32_t htree_hash(const struct htree *h, const void *name, size_t len) {
+
+  const unsigned char *p = name;
+  uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  uint32_t in[8], hash;
+
+  if (h->seed[0] | h->seed[1] | h->seed[2] | h->seed[3])
+    memcpy(buf, h->seed, sizeof(buf));
+
+  switch (h->hash_version) {
+    case 1:
+      for (; len > 0; len -= (len < 32 ? len : 32), p += 32) {
+	dx_words(h, p, len, in, 8);
+	dx_half_md4(buf, in);
+      }
+      hash = buf[1];
+      break;
+    case 2:
+      for (; len > 0; len -= (len < 16 ? len : 16), p += 16) {
+	dx_words(h, p, len, in, 4);
+	dx_tea(buf, in);
+      }
+      hash = buf[0];
+      break;
+    default:
+      hash = dx_legacy(h, p, len);
+      break;
+  }
+
+  /* The largest hash is kept back to mean "the end of the directory".  */
+  hash &= ~1u;
+  if (hash == 0xFFFFFFFE)
+    hash = 0xFFFFFFFC;
+  return hash;
+}
+
+/* Check that a directory has a usable hash index and read its parameters
+   into 'h'; return 1 if it has, 0 for a directory to be read linearly, or
+   -1 if its root can't be read.  */
+int htree_open(const unsigned char *raw, struct htree *h) {
+
+  const unsigned char *root, *super, *info;
+  unsigned int block;
+
+  if ((get_le16(raw + I_MODE_OFFSET) & 0xF000) != 0x4000 || !(get_le32(raw + I_FLAGS_OFFSET) & INDEX_FLAG))
+    return 0;
+  if ((block = map_block(raw, 0)) == 0)
+    return 0;
+
+  /* "." is 12 bytes and ".." covers the rest of the block, root and all.  */
+  if ((root = read_block(block)) == NULL)
+    return -1;
+  info = root + DX_ROOT_INFO_OFFSET;
+  if (get_le16(root + 4) != 12 || get_le16(root + 12 + 4) != sb.block_size - 12 ||
+      get_le32(info) != 0 || info[4] > 2 || info[5] != 8 || info[6] > DX_MAX_LEVELS)
+    return 0;
+
+  if ((super = image_ptr(SUPER_OFFSET, 1024)) == NULL)
+    return -1;
+  h->hash_version = info[4];
+  h->unsigned_chars = (get_le32(super + S_FLAGS_OFFSET) & UNSIGNED_HASH) != 0;
+  for (int w = 0; w < 4; w++)
+    h->seed[w] = get_le32(super + HASH_SEED_OFFSET + 4*w);
+  h->levels = info[6];
+  return 1;
+}
+
+/* The entries of index block 'logical' of a directory (the root if
+   'logical' is 0), with '*count' set to how many there are; NULL if the
+   block isn't there, can't be read or doesn't look like an index block.  */
+static const unsigned char *htree_node(const unsigned char *raw, unsigned int logical, unsigned int *count) {
+
+  const unsigned char *node;
+  unsigned int block, offset, limit;
+
+  if ((block = map_block(raw, logical)) == 0 || (node = read_block(block)) == NULL)
+    return NULL;
+  if (logical == 0)
+    offset = DX_ROOT_INFO_OFFSET + node[DX_ROOT_INFO_OFFSET + 5];
+  else if (get_le32(node) == 0 && get_le16(node + 4) == sb.block_size)
+    offset = DX_NODE_OFFSET;
+  else
+    return NULL;
+
+  /* The first entry's hash is taken up by the block's limit and count.  */
+  limit = get_le16(node + offset);
+  *count = get_le16(node + offset + 2);
+  if (*count == 0 || *count > limit || limit > (sb.block_size - offset) / 8)
+    return NULL;
+  return (node + offset);
+}
+
+static uint32_t htree_entry_hash(const unsigned char *entries, unsigned int e) {
+  return (e == 0) ? 0 : get_le32(entries + 8*e);
+}
+
+/* Only the low 28 bits of an entry's block are the block.  */
+static unsigned int htree_entry_block(const unsigned char *entries, unsigned int e) {
+  return (get_le32(entries + 8*e + 4) & 0x0FFFFFFF);
+}
+
+/* Hand fn each entry of index block 'logical' (at 'level') and then those
+   of the index blocks below it, depth first.  */
+static int htree_walk_node(unsigned int inode_number, const unsigned char *raw, const struct htree *h,
+			   unsigned int logical, unsigned int level, htree_cb fn, void *arg) {
+
+  const unsigned char *entries;
+  struct htree_ref e;
+  unsigned int count;
+  int result;
+
+  if ((entries = htree_node(raw, logical, &count)) == NULL)
+    return 0;
+  for (e.entry = 0; e.entry < count; e.entry++) {
+    e.level = level;
+    e.node = logical;
+    e.hash = htree_entry_hash(entries, e.entry);
+    e.child = htree_entry_block(entries, e.entry);
+    if ((result = fn(inode_number, &e, arg)) != 0)
+      return result;
+    if (level < h->levels && (result = htree_walk_node(inode_number, raw, h, e.child, level + 1, fn, arg)) != 0)
+      return result;
+  }
+  return 0;
+}
+
+/* Call fn on every entry of a directory's hash index, from the root down;
+   stops at (and returns) the first non-zero result, or -1 if a block of it
+   couldn't be read. A directory without a usable index has no entries.  */
+int iterate_htree(unsigned int inode_number, const unsigned char *raw, htree_cb fn, void *arg) {
+
+  struct htree h;
+  unsigned int failures = thread_failures;
+  int result;
+
+  if ((result = htree_open(raw, &h)) != 1)
+    return result;
+  return read_result(failures, htree_walk_node(inode_number, raw, &h, 0, 0, fn, arg));
+}
+
+/* The name a lookup is after, 'len' bytes of it.  */
+struct name_match {
+  const char *name;
+  size_t len;
+};
+
+static int match_name(unsigned int inode_number, const struct dirent_ref *d, void *arg) {
+
+  const struct name_match *m = arg;
+
+  (void) inode_number;
+  if (d->name_bytes == m->len && memcmp(d->name, m->name, m->len) == 0)
+    return d->inode;
+  return 0;
+}
+
+/*
+ * Find 'name' through a directory's hash index: hash it, go down from the
+ * root choosing at each index block (by binary search) the last entry
+ * whose hash isn't above the name's, and look through the leaf that leads
+ * to. A name whose hash also starts the next leaf (marked by the low bit
+ * of that leaf's entry) may have spilled into it, so that one is read too.
+ * '*inode' is set to the name's inode, or 0 if it isn't there; -1 is
+ * returned if the index turns out to be broken or can't be read.
+ */
+int htree_lookup(const unsigned char *raw, const struct htree *h, const char *name, size_t len,
+		 unsigned int *inode) {
+
+  struct { const unsigned char *entries; unsigned int count, at; } frames[DX_MAX_LEVELS + 1];
+  struct name_match m = { name, len };
+  uint32_t hash = htree_hash(h, name, len);
+  unsigned int logical = 0, level, lo, hi, mid, block;
+  int found;
+
+  for (level = 0; level <= h->levels; level++) {
+    if ((frames[level].entries = htree_node(raw, logical, &frames[level].count)) == NULL)
+      return -1;
+    lo = 1;
+    hi = frames[level].count;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (htree_entry_hash(frames[level].entries, mid) > hash)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+    frames[level].at = lo - 1;
+    logical = htree_entry_block(frames[level].entries, lo - 1);
+  }
+
+  for (;;) {
+    if ((block = map_block(raw, logical)) == 0)
+      return -1;
+    if ((found = iterate_dirent_block(0, raw, logical, block, match_name, &m)) == -1)
+      return -1;
+    if ((*inode = found) != 0)
+      return 0;
+
+    /* Move on to the next leaf, going up as far as it takes to find one.  */
+    for (level = h->levels; frames[level].at + 1 >= frames[level].count; level--)
+      if (level == 0)
+	return 0;
+    frames[level].at++;
+    if ((htree_entry_hash(frames[level].entries, frames[level].at) & ~1u) != hash)
+      return 0;
+    logical = htree_entry_block(frames[level].entries, frames[level].at);
+    for (level++; level <= h->levels; level++) {
+      if ((frames[level].entries = htree_node(raw, logical, &frames[level].count)) == NULL)
+	return -1;
+      frames[level].at = 0;
+      logical = htree_entry_block(frames[level].entries, 0);
+    }
+  }
+}
+
+/* The inode 'name' names in directory 'dir', or 0 (if it isn't there, or
+   can't be read). Indexed directories are searched through their index, the
+   rest (and "." and "..", which the index leaves out) block by block.  */
+unsigned int lookup_name(unsigned int dir, const char *name, size_t len) {
+
+  const unsigned char *raw = get_inode(dir);
+  struct name_match m = { name, len };
+  struct htree h;
+  unsigned int inode;
+  int found;
+
+  if (raw == NULL)
+    return 0;
+  if (!(len <= 2 && name[0] == '.' && (len == 1 || name[1] == '.')) &&
+      htree_open(raw, &h) == 1 && htree_lookup(raw, &h, name, len, &inode) == 0)
+    return inode;
+  found = iterate_dirents(dir, raw, match_name, &m);
+  return (found == -1) ? 0 : found;
+}
+
+/* Return the inode a path from the root leads to, or 0 if there isn't one,
+   reading only the directories along the way.  */
+unsigned int lookup_path(const char *path) {
+
+  unsigned int inode = ROOT_INODE;
+  const char *name;
+  size_t len;
+
+  while (*path != '\0' && inode != 0) {
+    while (*path == '/')
+      path++;
+    if (*path == '\0')
+      break;
+    name = path;
+    while (*path != '\0' && *path != '/')
+      path++;
+    len = path - name;
+    inode = lookup_name(inode, name, len);
+  }
+  return inode;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                              FILE EXTRACTION                           //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Copy 'len' bytes at 'in_off' in the image to 'out_off' in 'fd', letting
+ * the kernel move them: copy_file_range() where it can, sendfile() where
+ * that isn't offered between these two files, and write() straight out of
+ * the image as a last resort (an image read into memory, say). Returns 0
+ * or an errno.
+ */
+static int extract_copy(int fd, off_t in_off, off_t out_off, size_t len) {
+
+  static int no_copy_range;                 /* Set once copy_file_range() turns out not to be offered */
+  const unsigned char *p;
+  size_t chunk;
+  ssize_t got = 0;
+
+#ifdef SYS_copy_file_range
+  while (len > 0 && !__atomic_load_n(&no_copy_range, __ATOMIC_RELAXED)) {
+    got = syscall(SYS_copy_file_range, img.fd, &in_off, fd, &out_off, len, 0);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got == -1 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL))
+      __atomic_store_n(&no_copy_range, 1, __ATOMIC_RELAXED);
+    if (got <= 0)
+      break;
+    len -= got;
+  }
+#else
+  (void) no_copy_range;
+#endif
+
+#ifdef __linux__
+  if (len > 0 && lseek(fd, out_off, SEEK_SET) != -1) {
+    while (len > 0) {
+      got = sendfile(fd, img.fd, &in_off, len);
+      if (got == -1 && errno == EINTR)
+	continue;
+      if (got <= 0)
+	break;
+      len -= got;
+      out_off += got;
+    }
+  }
+#endif
+
+  /* A block at a time, so a cached image only ever pins one block for it.  */
+  while (len > 0) {
+    chunk = sb.block_size - in_off % sb.block_size;
+    if (chunk > len)
+      chunk = len;
+    if ((p = image_ptr(in_off, chunk)) == NULL)
+      return errno;
+    if ((got = pwrite(fd, p, chunk, out_off)) == -1) {
+      if (errno == EINTR)
+	continue;
+      return errno;
+    }
+    in_off += got;
+    out_off += got;
+    len -= got;
+  }
+  return 0;
+}
+
+/* Copy the run gathered so far, cut off at the end of the file. A run that
+   falls in a hole of the image is left as a hole in the file too.  */
+static void extract_flush(struct extract_run *r) {
+
+  uint64_t at = r->logical * sb.block_size;
+  uint64_t len = (uint64_t) r->count * sb.block_size;
+
+  if (r->count == 0 || r->error || at >= r->size)
+    return;
+  if (len > r->size - at)
+    len = r->size - at;
+  r->count = 0;
+  if (image_hole(compute_offset(r->block), len))
+    return;
+  r->error = extract_copy(r->fd, compute_offset(r->block), at, len);
+  r->bytes += len;
+}
+
+/* A data block of the file being extracted: add it to the run, or start a new one.  */
+static void extract_walk_block(struct block_walk *w, uint64_t logical, unsigned int block) {
+
+  struct extract_run *r = w->arg;
+
+  if (logical * sb.block_size >= r->size) {
+    w->stop = 1;
+    return;
+  }
+  if (r->count > 0 && logical == r->logical + r->count && block == r->block + r->count) {
+    r->count++;
+    return;
+  }
+  extract_flush(r);
+  r->logical = logical;
+  r->block = block;
+  r->count = 1;
+  if (r->error)
+    w->stop = 1;
+}
+
+/*
+ * Write the contents of a regular file to 'dest', with its permission
+ * bits. Its blocks are walked in logical order and merged into runs that
+ * are contiguous both in the file and on disk, and each run is copied in
+ * one go. Blocks the file has no pointer for are never written, so they
+ * end up as holes once the file is cut to its size. Returns 0 or an errno
+ * (ENOENT for no such inode, EISDIR or EINVAL for one that isn't a regular file),
+ * with '*bytes' set to how much data was copied.
+ */
+int extract_inode(unsigned int inode, const char *dest, uint64_t *bytes) {
+
+  const unsigned char *raw = get_inode(inode);
+  struct extract_run r = { -1, 0, 0, 0, 0, 0, 0 };
+  struct block_walk w = { inode, raw, extract_walk_block, NULL, &r, 0 };
+  unsigned int mode;
+
+  *bytes = 0;
+  if (raw == NULL)
+    return errno;
+  if (get_le16(raw + I_LINK_COUNT_OFFSET) == 0)
+    return ENOENT;
+  if (((mode = get_le16(raw + I_MODE_OFFSET)) & 0xF000) != 0x8000)
+    return ((mode & 0xF000) == 0x4000) ? EISDIR : EINVAL;
+  r.size = get_le32(raw + I_SIZE_OFFSET) | ((uint64_t) get_le32(raw + I_SIZE_HIGH_OFFSET) << 32);
+
+  if ((r.fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777)) == -1)
+    return errno;
+  if (walk_blocks(&w) == -1 && r.error == 0)
+    r.error = errno;
+  extract_flush(&r);
+  if (r.error == 0 && ftruncate(r.fd, r.size) == -1)
+    r.error = errno;
+  if (close(r.fd) == -1 && r.error == 0)
+    r.error = errno;
+  *bytes = r.bytes;
+  return r.error;
+}
+
+/* Resolve one job's source and extract it, letting go of whatever it pinned.  */
+static void extract_job_run(struct extract_job *job) {
+
+  size_t mark = cache_hold();
+  char *end;
+
+  if (job->source[0] == '#') {
+    job->inode = strtoul(job->source + 1, &end, 10);
+    if (*end != '\0')
+      job->inode = 0;
+  }
+  else
+    job->inode = lookup_path(job->source);
+
+  job->result = job->inode ? extract_inode(job->inode, job->dest, &job->bytes) : ENOENT;
+  cache_release(mark);
+}
+
+/* Runs on each worker: take the next job until there are none left.  */
+static void *extract_worker(void *arg) {
+
+  struct extract_pool *pool = arg;
+  unsigned int n;
+
+  while ((n = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+    extract_job_run(&pool->jobs[n]);
+  return NULL;
+}
+
+/* Extract every job's file, spread over JOB_COUNT threads; each job's
+   'result' says how it went.  */
+void extract_files(struct extract_job *jobs, unsigned int count) {
+
+  struct extract_pool pool = { jobs, count, 0 };
+  unsigned int thread_count = JOB_COUNT < count ? JOB_COUNT : count;
+  unsigned int started = 0;
+  pthread_t workers[thread_count ? thread_count : 1];
+
+  /* Make do with however many threads can be had, or with none but this one.  */
+  while (thread_count > 1 && started < thread_count &&
+	 pthread_create(&workers[started], NULL, extract_worker, &pool) == 0)
+    started++;
+  if (started == 0)
+    extract_worker(&pool);
+  for (unsigned int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                              CONTENT HASHES                            //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * File contents are hashed with CRC-32C (the Castagnoli polynomial, as
+ * iSCSI and ext4's checksums use it), which x86 has an instruction for
+ * since SSE4.2, taking eight bytes at a time. Every data block is hashed
+ * just once: a CRC is linear, so appending B to A takes crc(A) to
+ * crc(A)*x^(8|B|) + crc(B) modulo the polynomial, and the file's CRC is
+ * put together from its blocks' CRCs. Holes, in the file or in the image,
+ * are runs of zeros appended the same way, without reading anything.
+ */
+
+const uint32_t CRC32C_POLY = 0x82F63B78;    /* The Castagnoli polynomial, bit-reversed               */
+
+static uint32_t crc32c_table[256];          /* The CRC of each byte, where there's no instruction    */
+static uint32_t crc32c_x2n[32];             /* x^(2^n) modulo the polynomial                         */
+static int crc32c_hw;                       /* Whether the CPU has SSE4.2's crc32                    */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* a*b modulo the polynomial, both bit-reversed (x^0 is the top bit).  */
+static uint32_t crc32c_mult(uint32_t a, uint32_t b) {
+
+  uint32_t m = 1u << 31;
+  uint32_t p = 0;
+
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+	break;
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/* x^(8n) modulo the polynomial: what n bytes appended multiply a CRC by.  */
+static uint32_t crc32c_shift(uint64_t n) {
+
+  uint32_t p = 1u << 31;
+
+  for (int k = 3; n != 0; n >>= 1, k++)
+    if (n & 1)
+      p = crc32c_mult(crc32c_x2n[k & 31], p);
+  return p;
+}
+
+static void crc32c_init(void) {
+
+  uint32_t c;
+
+  for (unsigned int i = 0; i < 256; i++) {
+    c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[i] = c;
+  }
+  crc32c_x2n[0] = 1u << 30;
+  for (int n = 1; n < 32; n++)
+    crc32c_x2n[n] = crc32c_mult(crc32c_x2n[n - 1], crc32c_x2n[n - 1]);
+#if defined(__x86_64__) && defined(__GNUC__)
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+
+  uint64_t c = ~crc;
+  uint64_t word;
+
+  for (; len > 0 && ((uintptr_t) p & 7) != 0; len--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&word, p, 8);
+    c = __builtin_ia32_crc32di(c, word);
+  }
+  for (; len > 0; len--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  return ~c;
+}
+#endif
+
+/* The CRC-32C of 'len' more bytes, carrying on from 'crc' (0 to start).  */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+
+  const unsigned char *p = data;
+
+  pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (crc32c_hw)
+    return crc32c_sse42(crc, p, len);
+#endif
+  crc = ~crc;
+  while (len-- > 0)
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+  return ~crc;
+}
+
+/* The CRC-32C of 'len' more zero bytes, carrying on from 'crc'.  */
+static uint32_t crc32c_zeros(uint32_t crc, uint64_t len) {
+  return ~crc32c_mult(crc32c_shift(len), ~crc);
+}
+
+/* A data block of the file being hashed: hash it, and append it (and any
+   hole before it) to the file's CRC, cut off at the end of the file.  */
+static void hash_walk_block(struct block_walk *w, uint64_t logical, unsigned int block) {
+
+  struct file_hash *h = w->arg;
+  uint64_t at = logical * sb.block_size;
+  const unsigned char *data = NULL;
+  uint32_t crc;
+
+  if (at >= h->size) {
+    w->stop = 1;
+    return;
+  }
+  if (at > h->next)
+    h->crc = crc32c_zeros(h->crc, at - h->next);
+
+  /* A block in a hole of the image is all zeros, so its CRC is known without reading it.  */
+  if (image_hole(compute_offset(block), sb.block_size))
+    crc = crc32c_zeros(0, sb.block_size);
+  else if ((data = read_block(block)) != NULL)
+    crc = crc32c(0, data, sb.block_size);
+  else {
+    w->stop = 1;
+    return;
+  }
+  if (h->block)
+    h->block(w->inode_number, logical, block, crc, h->arg);
+
+  if (h->size - at >= sb.block_size) {
+    h->crc = crc32c_mult(h->shift, h->crc) ^ crc;
+    h->next = at + sb.block_size;
+  }
+  else {
+    h->crc = data ? crc32c(h->crc, data, h->size - at) : crc32c_zeros(h->crc, h->size - at);
+    h->next = h->size;
+  }
+  h->blocks++;
+}
+
+/*
+ * The CRC-32C of a regular file's contents, its first i_size bytes with
+ * holes reading as zeros: the same CRC-32C any other tool gives for the
+ * file once copied out. If 'fn' is set it is called with the CRC of
+ * each whole data block in the file, in logical order. '*blocks' is set to
+ * how many data blocks there were. A block that can't be read cuts the
+ * hash short there, and leaves the failure for the group pass to report.
+ */
+uint32_t hash_file(unsigned int inode_number, const unsigned char *raw, block_hash_cb fn, void *arg,
+		   unsigned int *blocks) {
+
+  struct file_hash h = { 0, 0, 0, 0, 0, fn, arg };
+  struct block_walk w = { inode_number, raw, hash_walk_block, NULL, &h, 0 };
+  size_t mark = cache_hold();
+
+  pthread_once(&crc32c_once, crc32c_init);
+  h.size = get_le32(raw + I_SIZE_OFFSET) | ((uint64_t) get_le32(raw + I_SIZE_HIGH_OFFSET) << 32);
+  h.shift = crc32c_shift(sb.block_size);
+  walk_blocks(&w);
+  if (h.next < h.size)
+    h.crc = crc32c_zeros(h.crc, h.size - h.next);
+  cache_release(mark);
+
+  *blocks = h.blocks;
+  return h.crc;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                             STREAMING READER                           //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * A pipe can only be read front to back, once. The super block and
+ * descriptor table are read up front into img.data (the "head"); after
+ * that the image is consumed block by block and only the blocks some group
+ * still needs are kept: its bitmaps and inode table, its inodes' indirect
+ * blocks and its directories' data blocks. Once everything a group needs
+ * has gone by, the group passes run for it from memory and its blocks are
+ * dropped again.
+ *
+ * Blocks a group asks for after they have already gone by (say, a
+ * directory block allocated in an earlier group) are caught by keeping,
+ * until the last inode table and the last indirect block or extent node
+ * anyone asked for have been read, any block that could plausibly be an
+ * indirect block, extent node or directory block. (With flex_bg the inode
+ * tables all come early, and a map block after them can still point back.)
+ */
+
+const unsigned int STREAM_BUCKETS = 1 << 16;  /* Hash buckets for the blocks held in memory            */
+const int STREAM_EXTENT_NODE = 4;             /* Waiter level for an extent tree node below the root   */
+
+struct stream strm;
+
+/* Read forward until the head holds the first 'end' bytes of the image; 0 or -1.  */
+static int stream_extend_head(size_t end) {
+
+  size_t capacity = img.size;
+  unsigned char *grown;
+  ssize_t got;
+
+  if (end <= img.size)
+    return 0;
+  while (capacity < end)
+    capacity = capacity ? 2 * capacity : READ_CHUNK;
+  if ((grown = realloc(img.data, capacity)) == NULL)
+    return image_fail(ENOMEM, "%s", img.path);
+  img.data = grown;
+  while (img.size < end) {
+    got = read(img.fd, img.data + img.size, end - img.size);
+    stats_read(got);
+    if (got == -1) {
+      if (errno == EINTR)
+	continue;
+      return image_fail(errno, "%s", img.path);
+    }
+    if (got == 0)
+      return image_fail(EIO, "%s: image ended after %zu bytes", img.path, img.size);
+    img.size += got;
+  }
+  return 0;
+}
+
+static struct stream_block *stream_lookup(unsigned int block) {
+
+  struct stream_block *b;
+
+  for (b = strm.buckets[block & (STREAM_BUCKETS - 1)]; b != NULL; b = b->next)
+    if (b->block == block)
+      return b;
+  return NULL;
+}
+
+static struct stream_block *stream_insert(unsigned int block) {
+
+  struct stream_block *b = calloc(1, sizeof(struct stream_block));
+
+  if (b == NULL) {
+    perror("calloc"); exit(-1);
+  }
+  b->block = block;
+  b->next = strm.buckets[block & (STREAM_BUCKETS - 1)];
+  strm.buckets[block & (STREAM_BUCKETS - 1)] = b;
+  return b;
+}
+
+static void stream_remove(struct stream_block *gone) {
+
+  struct stream_block **p = &strm.buckets[gone->block & (STREAM_BUCKETS - 1)];
+
+  while (*p != gone)
+    p = &(*p)->next;
+  *p = gone->next;
+  free(gone->data);
+  free(gone);
+}
+
+/* Pointer into a block held in memory, or NULL; streaming's answer to image_ptr().  */
+const unsigned char *stream_ptr(off_t offset, size_t len) {
+
+  unsigned int block;
+  struct stream_block *b;
+
+  /* Until the head has been read, the block size isn't known yet.  */
+  if (!strm.started)
+    return (stream_extend_head(offset + len) == 0) ? img.data + offset : NULL;
+  block = offset / sb.block_size;
+  b = stream_lookup(block);
+  if (b == NULL || b->data == NULL || (offset % sb.block_size) + len > sb.block_size) {
+    image_fail(EIO, "%s: block %u is not held in memory while streaming", img.path, block);
+    return NULL;
+  }
+  return (b->data + offset % sb.block_size);
+}
+
+/* Is every byte of this block zero?  */
+static int stream_is_zero(const unsigned char *data) {
+
+  for (unsigned int e = 0; e < sb.block_size; e += 4)
+    if (get_le32(data + e) != 0)
+      return 0;
+  return 1;
+}
+
+/* Could this block be an indirect block, or a directory block?  */
+static int stream_worth_keeping(const unsigned char *data) {
+
+  unsigned int rec_len = get_le16(data + 4);
+  int nonzero = 0;
+
+  if (get_le16(data) == EXTENT_MAGIC)
+    return 1;
+  if (rec_len >= 12 && rec_len <= sb.block_size && rec_len % 4 == 0 && data[6] + 8u <= rec_len)
+    return 1;
+  for (unsigned int e = 0; e < sb.block_size; e += 4) {
+    if (get_le32(data + e) >= sb.block_total)
+      return 0;
+    nonzero |= (get_le32(data + e) != 0);
+  }
+  return nonzero;
+}
+
+static void stream_deliver(struct stream_block *b, struct stream_waiter *w);
+
+/* Group 'group' needs block 'block' for the reason described by 'w'.  */
+static void stream_want(unsigned int group, unsigned int block, int level, uint64_t logical, uint64_t dir_blocks) {
+
+  struct stream_group *g = &strm.groups[group];
+  struct stream_block *b;
+  struct stream_waiter w = { group, level, logical, dir_blocks, NULL };
+  struct stream_waiter *waiter;
+
+  /* Blocks inside the head are already at hand.  */
+  if (((off_t) block + 1) * sb.block_size <= (off_t) img.size) {
+    struct stream_block head = { block, img.data + (size_t) block * sb.block_size, 0, NULL, NULL };
+    stream_deliver(&head, &w);
+    return;
+  }
+
+  if ((b = stream_lookup(block)) == NULL) {
+    b = stream_insert(block);
+    if (block < strm.next_block) {
+      /* Gone by without looking like anything we'd need: read it as zeros,
+	 which is only a guess unless it was all zeros to begin with.  */
+      if (!(strm.zero[block / 8] & (1 << (block % 8))))
+	fprintf(stderr, "%s: block %u was needed after it had been streamed past; treating it as empty\n",
+		img.path, block);
+      if ((b->data = calloc(1, sb.block_size)) == NULL) {
+	perror("calloc"); exit(-1);
+      }
+    }
+  }
+
+  b->refs++;
+  if (g->held_count == g->held_capacity) {
+    g->held_capacity = g->held_capacity ? 2 * g->held_capacity : 64;
+    if ((g->held = realloc(g->held, g->held_capacity * sizeof(unsigned int))) == NULL) {
+      perror("realloc"); exit(-1);
+    }
+  }
+  g->held[g->held_count++] = block;
+
+  if (b->data != NULL) {
+    stream_deliver(b, &w);
+    return;
+  }
+
+  if ((waiter = malloc(sizeof(struct stream_waiter))) == NULL) {
+    perror("malloc"); exit(-1);
+  }
+  *waiter = w;
+  waiter->next = b->waiters;
+  b->waiters = waiter;
+  g->pending++;
+  if (level > 0)
+    strm.maps_left++;
+}
+
+/* Ask for what one extent tree node (the root, or a block of 'size'
+   bytes) maps: the nodes below it and, for a directory, its data blocks.  */
+static void stream_extent_node(unsigned int group, const unsigned char *node, size_t size, uint64_t dir_blocks) {
+
+  const unsigned char *entries;
+  struct extent_ref e;
+  unsigned int count, depth;
+
+  if ((entries = extent_node(node, size, &count, &depth)) == NULL)
+    return;
+  for (unsigned int k = 0; k < count; k++) {
+    extent_entry(entries, k, depth, &e);
+    if (e.start == 0)
+      continue;
+    if (depth > 0)
+      stream_want(group, e.start, STREAM_EXTENT_NODE, e.logical, dir_blocks);
+    else if (!e.uninit)
+      for (unsigned int b = 0; b < e.len && e.logical + (uint64_t) b < dir_blocks && e.start + b < sb.block_total; b++)
+	stream_want(group, e.start + b, 0, e.logical + b, dir_blocks);
+  }
+}
+
+/* Everything in a group's inode table is known: ask for the blocks its inodes map.  */
+static void stream_walk_group(unsigned int group) {
+
+  struct bitmap_iter it;
+  const unsigned char *raw;
+  const unsigned char *i_block;
+  unsigned int per_block = sb.block_size / 4;
+  uint64_t span, logical, dir_blocks;
+  unsigned int ptr;
+  int bit;
+
+  /* Nothing is kept for the groups and inodes the passes will skip.  */
+  if (GROUP_SELECT != NULL && !GROUP_SELECT[group])
+    return;
+  group_inode_iter_init(&it, group, 1);
+  while ((bit = bitmap_next(&it)) != -1) {
+    raw = image_ptr(compute_offset(gd[group].inode_table_start_block) + (off_t) INODE_SIZE*bit, INODE_SIZE);
+    if (raw == NULL || !has_block_map(raw))
+      continue;
+
+    /* Directories need their data blocks as well; everything else just its indirect blocks.  */
+    dir_blocks = 0;
+    if ((get_le16(raw + I_MODE_OFFSET) & 0xF000) == 0x4000)
+      dir_blocks = (get_le32(raw + I_SIZE_OFFSET) + (uint64_t) sb.block_size - 1) / sb.block_size;
+
+    i_block = raw + B_PTRS_OFFSET;
+    if (has_extents(raw)) {
+      stream_extent_node(group, i_block, EXTENT_ROOT_SIZE, dir_blocks);
+      continue;
+    }
+    for (int d = 0; d < DIRECT_BLOCKS && (uint64_t) d < dir_blocks; d++) {
+      ptr = get_le32(i_block + 4*d);
+      if (ptr != 0 && ptr < sb.block_total)
+	stream_want(group, ptr, 0, d, dir_blocks);
+    }
+
+    logical = DIRECT_BLOCKS;
+    span = 1;
+    for (int level = 1; level <= 3; level++) {
+      span *= per_block;
+      ptr = get_le32(i_block + 4*(DIRECT_BLOCKS + level - 1));
+      if (ptr != 0 && ptr < sb.block_total)
+	stream_want(group, ptr, level, logical, dir_blocks);
+      logical += span;
+    }
+  }
+}
+
+/* A block a group was waiting for is here (waiters with level < 0 are waiting on metadata).  */
+static void stream_deliver(struct stream_block *b, struct stream_waiter *w) {
+
+  struct stream_group *g = &strm.groups[w->group];
+  unsigned int per_block = sb.block_size / 4;
+  uint64_t span = 1;
+  unsigned int ptr;
+
+  if (w->level < 0) {
+    if (--g->meta_pending == 0) {
+      strm.tables_left--;
+      stream_walk_group(w->group);
+    }
+    return;
+  }
+  if (w->level == 0)
+    return;
+  if (w->level == STREAM_EXTENT_NODE) {
+    stream_extent_node(w->group, b->data, sb.block_size, w->dir_blocks);
+    return;
+  }
+
+  /* An indirect block: ask for the next level down, or for the directory blocks it maps.  */
+  for (int l = 1; l < w->level; l++)
+    span *= per_block;
+  for (unsigned int e = 0; e < per_block; e++) {
+    ptr = get_le32(b->data + 4*e);
+    if (ptr == 0 || ptr >= sb.block_total)
+      continue;
+    if (w->level > 1)
+      stream_want(w->group, ptr, w->level - 1, w->logical + e*span, w->dir_blocks);
+    else if (w->logical + e < w->dir_blocks)
+      stream_want(w->group, ptr, 0, w->logical + e, w->dir_blocks);
+  }
+}
+
+/* Queue the group up to be finished if nothing it needs is still outstanding.  */
+static void stream_check(unsigned int group) {
+
+  struct stream_group *g = &strm.groups[group];
+
+  if (!g->queued && g->meta_pending == 0 && g->pending == 0) {
+    g->queued = 1;
+    strm.ready[strm.ready_count++] = group;
+  }
+}
+
+/* Run every pass for a group whose blocks are all in memory, then let them go.  */
+static void stream_finish_group(unsigned int group, struct group_pass *passes, int pass_count) {
+
+  struct stream_group *g = &strm.groups[group];
+  struct stream_block *b;
+  int p, s;
+
+  g->out = malloc(pass_count * sizeof(struct csv_out *));
+  if (g->out == NULL) {
+    perror("malloc"); exit(-1);
+  }
+  for (p = 0; p < pass_count; p++) {
+    if ((g->out[p] = malloc(passes[p].stream_count * sizeof(struct csv_out))) == NULL) {
+      perror("malloc"); exit(-1);
+    }
+    struct csv_out *out[passes[p].stream_count];
+    for (s = 0; s < passes[p].stream_count; s++) {
+      out[s] = &g->out[p][s];
+      csv_init(out[s], -1);
+      out[s]->binary = passes[p].out[s]->binary;
+    }
+    run_group(passes[p].fn, group, out, passes[p].arg);
+  }
+
+  for (unsigned int h = 0; h < g->held_count; h++) {
+    b = stream_lookup(g->held[h]);
+    if (--b->refs == 0)
+      stream_remove(b);
+  }
+  free(g->held);
+  g->done = 1;
+
+  /* Hand over the output of every finished group that is next in line.  */
+  while (strm.next_flush < DESCRIPTOR_COUNT && strm.groups[strm.next_flush].done) {
+    g = &strm.groups[strm.next_flush++];
+    for (p = 0; p < pass_count; p++) {
+      for (s = 0; s < passes[p].stream_count; s++) {
+	csv_bytes(passes[p].out[s], g->out[p][s].buf, g->out[p][s].len);
+	free(g->out[p][s].buf);
+      }
+      free(g->out[p]);
+    }
+    free(g->out);
+  }
+}
+
+/* Once every inode table has gone by, blocks kept on spec that nobody asked for can go.  */
+static void stream_drop_unclaimed(void) {
+
+  struct stream_block *b, *next;
+
+  for (unsigned int k = 0; k < STREAM_BUCKETS; k++) {
+    for (b = strm.buckets[k]; b != NULL; b = next) {
+      next = b->next;
+      if (b->refs == 0)
+	stream_remove(b);
+    }
+  }
+}
+
+/*
+ * Run the given passes for every group in one forward pass over the
+ * stream. Groups finish in whatever order their blocks go by; their output
+ * is buffered and handed over in group order, so the files match a
+ * regular run byte for byte. Returns 0, or -1 if the stream broke off or
+ * a pass couldn't read something.
+ */
+int stream_groups(struct group_pass *passes, int pass_count) {
+
+  unsigned char *chunk;
+  size_t have, used;
+  ssize_t got;
+  unsigned int block, finished = 0;
+  struct stream_block *b;
+  struct stream_waiter *w, *next;
+  off_t table;
+  unsigned int table_blocks = ((size_t) sb.inodes_per_group * INODE_SIZE + sb.block_size - 1) / sb.block_size;
+  unsigned int failures = img.failures;
+
+  /* Line the stream up on a block boundary before leaving the head behind.  */
+  if (stream_extend_head(((img.size + sb.block_size - 1) / sb.block_size) * sb.block_size) == -1)
+    return -1;
+  strm.next_block = img.size / sb.block_size;
+  strm.started = 1;
+
+  strm.buckets = calloc(STREAM_BUCKETS, sizeof(struct stream_block *));
+  strm.groups = calloc(DESCRIPTOR_COUNT, sizeof(struct stream_group));
+  strm.ready = calloc(DESCRIPTOR_COUNT, sizeof(unsigned int));
+  strm.zero = calloc(sb.block_total / 8 + 1, 1);
+  if (strm.buckets == NULL || strm.groups == NULL || strm.ready == NULL || strm.zero == NULL) {
+    perror("calloc"); exit(-1);
+  }
+
+  /* Every group starts out needing its bitmaps and inode table.  */
+  strm.tables_left = DESCRIPTOR_COUNT;
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
+    strm.groups[i].meta_pending = 3 + table_blocks;
+    stream_want(i, gd[i].block_bitmap_block, -1, 0, 0);
+    stream_want(i, gd[i].inode_bitmap_block, -1, 0, 0);
+    table = gd[i].inode_table_start_block;
+    for (unsigned int t = 0; t < table_blocks; t++)
+      stream_want(i, table + t, -1, 0, 0);
+    /* The extra count keeps the group from being walked before all of the above is asked for.  */
+    stream_deliver(NULL, &(struct stream_waiter) { i, -1, 0, 0, NULL });
+    stream_check(i);
+  }
+
+  if ((chunk = malloc(READ_CHUNK)) == NULL) {
+    perror("malloc"); exit(-1);
+  }
+  have = 0;
+
+  for (;;) {
+    while (strm.ready_count > 0) {
+      stream_finish_group(strm.ready[--strm.ready_count], passes, pass_count);
+      finished++;
+    }
+    if (finished == DESCRIPTOR_COUNT)
+      break;
+
+    got = read(img.fd, chunk + have, READ_CHUNK - have);
+    stats_read(got);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      if (got == -1)
+	image_fail(errno, "%s", img.path);
+      else
+	image_fail(EIO, "%s: image ended before block %u, which is still needed", img.path, strm.next_block);
+      free(chunk);
+      return -1;
+    }
+    have += got;
+
+    for (used = 0; used + sb.block_size <= have; used += sb.block_size) {
+      block = strm.next_block++;
+      b = stream_lookup(block);
+      if (b != NULL && b->data == NULL) {
+	if ((b->data = malloc(sb.block_size)) == NULL) {
+	  perror("malloc"); exit(-1);
+	}
+	memcpy(b->data, chunk + used, sb.block_size);
+	for (w = b->waiters, b->waiters = NULL; w != NULL; w = next) {
+	  next = w->next;
+	  strm.groups[w->group].pending--;
+	  if (w->level > 0)
+	    strm.maps_left--;
+	  stream_deliver(b, w);
+	  stream_check(w->group);
+	  free(w);
+	}
+      }
+      else if (b == NULL && stream_is_zero(chunk + used))
+	strm.zero[block / 8] |= (1 << (block % 8));
+      else if (b == NULL && (strm.tables_left > 0 || strm.maps_left > 0) && stream_worth_keeping(chunk + used)) {
+	b = stream_insert(block);
+	if ((b->data = malloc(sb.block_size)) == NULL) {
+	  perror("malloc"); exit(-1);
+	}
+	memcpy(b->data, chunk + used, sb.block_size);
+      }
+
+      if (strm.tables_left == 0 && strm.maps_left == 0 && !strm.dropped) {
+	stream_drop_unclaimed();
+	strm.dropped = 1;
+      }
+    }
+    memmove(chunk, chunk + used, have - used);
+    have -= used;
+  }
+  free(chunk);
+  return pass_result(failures);
+}
+
+
+/*
+ * Run each pass over every group. A seekable image runs them one after
+ * the other (each spread over the -j workers), each timed as a phase of
+ * its own; a stream interleaves them in its single forward pass, which is
+ * timed as one "stream" phase. Returns 0, or -1 once a pass has failed.
+ */
+int run_group_passes(struct group_pass *passes, int pass_count) {
+
+  if (img.streaming) {
+    stats_begin("stream");
+    stats.groups_due = DESCRIPTOR_COUNT * pass_count;
+    return stream_groups(passes, pass_count);
+  }
+  for (int p = 0; p < pass_count; p++) {
+    stats_begin(passes[p].name);
+    if (for_each_group(passes[p].fn, passes[p].arg, passes[p].out, passes[p].stream_count) == -1)
+      return -1;
+  }
+  return 0;
+}
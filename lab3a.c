@@ -1,730 +1,1659 @@
+#include <ctype.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "lab3a.h"
 
 
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                  TABLES                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* The columns of each output file, in the order they are written below.  */
+const struct column SUPER_COLUMNS[] = {
+  { "magic",            'x', 0 },
+  { "inodes",           'd', 0 },
+  { "blocks",           'd', 0 },
+  { "block_size",       'd', 0 },
+  { "fragment_size",    'd', 0 },
+  { "blocks_per_group", 'd', 0 },
+  { "inodes_per_group", 'd', 0 },
+  { "frags_per_group",  'd', 0 },
+  { "first_data_block", 'd', 0 },
+};
+
+const struct column GROUP_COLUMNS[] = {
+  { "blocks",           'd', 0 },
+  { "free_blocks",      'd', 0 },
+  { "free_inodes",      'd', 0 },
+  { "directories",      'd', 0 },
+  { "inode_bitmap",     'x', 0 },
+  { "block_bitmap",     'x', 0 },
+  { "inode_table",      'x', 0 },
+};
+
+const struct column BITMAP_COLUMNS[] = {
+  { "map",              'x', 1 },
+  { "number",           'd', 1 },
+};
+
+const struct column EXTENT_COLUMNS[] = {
+  { "map",              'x', 1 },
+  { "start",            'd', 1 },
+  { "length",           'd', 0 },
+};
+
+const struct column FRAGMENT_COLUMNS[] = {
+  { "group",            'd', 0 },
+  { "free_blocks",      'd', 0 },
+  { "extents",          'd', 0 },
+  { "largest",          'd', 0 },
+  { "len1",     'd', 0 }, { "len2",     'd', 0 }, { "len4",     'd', 0 }, { "len8",     'd', 0 },
+  { "len16",    'd', 0 }, { "len32",    'd', 0 }, { "len64",    'd', 0 }, { "len128",   'd', 0 },
+  { "len256",   'd', 0 }, { "len512",   'd', 0 }, { "len1024",  'd', 0 }, { "len2048",  'd', 0 },
+  { "len4096",  'd', 0 }, { "len8192",  'd', 0 }, { "len16384", 'd', 0 }, { "len32768", 'd', 0 },
+};
+
+const struct column INODE_COLUMNS[] = {
+  { "inode",            'd', 0 },
+  { "type",             'c', 0 },
+  { "mode",             'o', 0 },
+  { "owner",            'd', 0 },
+  { "group",            'd', 0 },
+  { "links",            'd', 0 },
+  { "ctime",            'x', 0 },
+  { "mtime",            'x', 0 },
+  { "atime",            'x', 0 },
+  { "size",             'd', 0 },
+  { "blocks",           'd', 0 },
+  { "block0",  'x', 1 }, { "block1",  'x', 1 }, { "block2",  'x', 1 }, { "block3",  'x', 1 },
+  { "block4",  'x', 1 }, { "block5",  'x', 1 }, { "block6",  'x', 1 }, { "block7",  'x', 1 },
+  { "block8",  'x', 1 }, { "block9",  'x', 1 }, { "block10", 'x', 1 }, { "block11", 'x', 1 },
+  { "block12", 'x', 1 }, { "block13", 'x', 1 }, { "block14", 'x', 1 },
+};
+
+const struct column DIRECTORY_COLUMNS[] = {
+  { "parent",           'd', 0 },
+  { "entry",            'd', 0 },
+  { "rec_len",          'd', 0 },
+  { "name_len",         'd', 0 },
+  { "inode",            'd', 0 },
+  { "name",             's', 0 },
+};
+
+const struct column INDIRECT_COLUMNS[] = {
+  { "container",        'x', 1 },
+  { "entry",            'd', 0 },
+  { "pointer",          'x', 1 },
+};
+
+const struct column PATH_COLUMNS[] = {
+  { "inode",            'd', 0 },
+  { "path",             's', 0 },
+};
+
+const struct column HTREE_COLUMNS[] = {
+  { "directory",        'd', 0 },
+  { "level",            'd', 0 },
+  { "node",             'd', 0 },
+  { "entry",            'd', 0 },
+  { "hash",             'x', 0 },
+  { "child",            'd', 0 },
+};
+
+const struct column MANIFEST_COLUMNS[] = {
+  { "inode",            'd', 0 },
+  { "size",             'u', 0 },
+  { "blocks",           'd', 0 },
+  { "crc32c",           'x', 0 },
+};
+
+const struct column BLOCKHASH_COLUMNS[] = {
+  { "inode",            'd', 0 },
+  { "logical",          'd', 0 },
+  { "block",            'x', 1 },
+  { "crc32c",           'x', 0 },
+};
+
+const struct table SUPER_TABLE     = { "super",     SUPER_COLUMNS,     sizeof(SUPER_COLUMNS) / sizeof(SUPER_COLUMNS[0]) };
+const struct table GROUP_TABLE     = { "group",     GROUP_COLUMNS,     sizeof(GROUP_COLUMNS) / sizeof(GROUP_COLUMNS[0]) };
+const struct table BITMAP_TABLE    = { "bitmap",    BITMAP_COLUMNS,    sizeof(BITMAP_COLUMNS) / sizeof(BITMAP_COLUMNS[0]) };
+const struct table EXTENT_TABLE    = { "bitmap",    EXTENT_COLUMNS,    sizeof(EXTENT_COLUMNS) / sizeof(EXTENT_COLUMNS[0]) };
+const struct table FRAGMENT_TABLE  = { "fragment",  FRAGMENT_COLUMNS,  sizeof(FRAGMENT_COLUMNS) / sizeof(FRAGMENT_COLUMNS[0]) };
+const struct table INODE_TABLE     = { "inode",     INODE_COLUMNS,     sizeof(INODE_COLUMNS) / sizeof(INODE_COLUMNS[0]) };
+const struct table DIRECTORY_TABLE = { "directory", DIRECTORY_COLUMNS, sizeof(DIRECTORY_COLUMNS) / sizeof(DIRECTORY_COLUMNS[0]) };
+const struct table INDIRECT_TABLE  = { "indirect",  INDIRECT_COLUMNS,  sizeof(INDIRECT_COLUMNS) / sizeof(INDIRECT_COLUMNS[0]) };
+const struct table PATH_TABLE      = { "path",      PATH_COLUMNS,      sizeof(PATH_COLUMNS) / sizeof(PATH_COLUMNS[0]) };
+const struct table HTREE_TABLE     = { "htree",     HTREE_COLUMNS,     sizeof(HTREE_COLUMNS) / sizeof(HTREE_COLUMNS[0]) };
+const struct table MANIFEST_TABLE  = { "manifest",  MANIFEST_COLUMNS,  sizeof(MANIFEST_COLUMNS) / sizeof(MANIFEST_COLUMNS[0]) };
+const struct table BLOCKHASH_TABLE = { "blockhash", BLOCKHASH_COLUMNS, sizeof(BLOCKHASH_COLUMNS) / sizeof(BLOCKHASH_COLUMNS[0]) };
+
+const size_t PATH_BUFFER_SIZE = 1 << 16;    /* Longest path written to 'path.csv'                    */
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                  FILTERS                               //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+struct dump_filter filter = { NULL, NULL, -1, 0, UINT32_MAX };
+
+/* The tables '-t' can name.  */
+const char *const TABLE_NAMES[] = { "super", "group", "bitmap", "inode", "directory", "indirect",
+				    "htree", "manifest", "blockhash" };
+
+/* Whether table 'name' is in the '-t' list (every table is, without one).  */
+int table_wanted(const char *name) {
+
+  const char *p = filter.tables;
+  size_t len = strlen(name);
+
+  if (p == NULL)
+    return 1;
+  while (*p) {
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return 1;
+    p += strcspn(p, ",");
+    p += (*p == ',');
+  }
+  return 0;
+}
 
-struct super_block sb;                      /* Stores the values to be reported in 'super.csv'       */ 
-const int SUPER_OFFSET            = 1024;   /* Offset of super block from beginning of file system.  */
-const int I_CNT_OFFSET            = 0;      /* Rest are offsets from beginning of super block:       */
-const int B_CNT_OFFSET            = 4;          /* Total number of blocks                            */
-const int FIRST_DATA_BLOCK_OFFSET = 20;         /* Superblock's block number                         */
-const int B_SIZ_OFFSET            = 24;         /* Block size                                        */
-const int F_SIZ_OFFSET            = 28;         /* Fragment size                                     */
-const int B_GRP_OFFSET            = 32;         /* Blocks per group                                  */
-const int F_GRP_OFFSET            = 36;         /* Fragments per group                               */
-const int I_GRP_OFFSET            = 40;         /* Inodes per group                                  */
-const int MAGIC_OFFSET            = 56;         /* Magic number                                      */
-int END_OF_SUPER;                           /* Computed once we have found block size for system     */
-
-unsigned int DESCRIPTOR_COUNT = 0;          /* Total number of groups / group descriptors in system  */
-struct group_descr *gd;                     /* Stores fields of the group descriptor                 */
-                                            /* Rest are offsets from beginning of group descriptor:  */
-const int B_FREE_OFFSET   = 12;                 /* Number of free blocks per group                   */
-const int I_FREE_OFFSET   = 14;                 /* Number of free inodes per group                   */
-const int D_USED_OFFSET   = 16;                 /* Number of directories per group                   */
-const int I_BITMAP_OFFSET = 4;                  /* Block id of inode bitmap for a group              */
-const int B_BITMAP_OFFSET = 0;                  /* Block id of block bitmap for a group              */
-const int I_TABLE_OFFSET  = 8;                  /* Block id of inode table for a group               */
-const int GROUP_DESC_SIZE = 32;                 /* Size of a block group descriptor                  */
-
-                                           /* These are all offsets from start of inode table entry  */ 
-const int I_MODE_OFFSET       = 0;
-const int I_UID_OFFSET        = 2;
-const int I_GID_OFFSET        = 24;
-const int I_LINK_COUNT_OFFSET = 26;
-const int I_CREATE_OFFSET     = 12;
-const int I_MOD_OFFSET        = 16;
-const int I_ACCESS_OFFSET     = 8;
-const int I_SIZE_OFFSET       = 4;
-const int I_BLOCK_OFFSET      = 28;
-const int B_PTRS_OFFSET       = 40;
-
-/* Computes offset into file system, based on the given block number / block ID.  */
-int compute_offset(int block_num) {
-  return (SUPER_OFFSET + (block_num - 1) * sb.block_size);
+/* The letter inode.csv gives a file type.  */
+char type_letter(unsigned int mode) {
+  switch (mode & 0xF000) {
+    case 0x8000:
+      return 'f';
+    case 0x4000:
+      return 'd';
+    case 0xA000:
+      return 's';
+    default:
+      return '?';
+  }
 }
 
+/* Whether row 'k' of a batch passes the '-T', '-u' and '-m' filters.  */
+int filter_inode(const struct inode_batch *b, unsigned int k) {
+  if (filter.types != NULL && strchr(filter.types, type_letter(b->mode[k])) == NULL)
+    return 0;
+  if (filter.uid != -1 && b->uid[k] != (unsigned long) filter.uid)
+    return 0;
+  return (b->mtime[k] >= filter.mtime_first && b->mtime[k] <= filter.mtime_last);
+}
 
-/* Analyze file system image and output to six csv files.  */
-int main(int argc, char* argv[]) {
+/* Check that a '-t' list names only tables there are; -1 if it doesn't.  */
+int parse_tables(const char *list) {
+
+  size_t len, t;
+
+  do {
+    len = strcspn(list, ",");
+    for (t = 0; t < sizeof(TABLE_NAMES) / sizeof(TABLE_NAMES[0]); t++)
+      if (strlen(TABLE_NAMES[t]) == len && strncmp(list, TABLE_NAMES[t], len) == 0)
+	break;
+    if (t == sizeof(TABLE_NAMES) / sizeof(TABLE_NAMES[0]))
+      return -1;
+    list += len;
+  } while (*list++ == ',');
+  return 0;
+}
 
-  int imageFD;        /* File descriptor for file system image we read in.  */
+/* Read "FIRST-LAST", "FIRST-", "-LAST" or "N" into [*first, *last]; -1 if it is none of those.
+   Each number has to start with a digit, as strtoul() would also take a sign or spaces.  */
+int parse_range(const char *arg, unsigned long *first, unsigned long *last) {
+
+  char *end;
+
+  *first = 0;
+  *last = ULONG_MAX;
+  if (*arg != '-') {
+    if (!isdigit((unsigned char) *arg))
+      return -1;
+    *first = strtoul(arg, &end, 10);
+    arg = end;
+    if (*arg == '\0') {
+      *last = *first;
+      return 0;
+    }
+  }
+  if (*arg++ != '-')
+    return -1;
+  if (*arg != '\0') {
+    if (!isdigit((unsigned char) *arg))
+      return -1;
+    *last = strtoul(arg, &end, 10);
+    if (*end != '\0')
+      return -1;
+  }
+  return (*first <= *last) ? 0 : -1;
+}
 
-  if (argc < 2) {
-    fprintf(stderr, "%s: name for file system image not provided\n", argv[0]);
-    exit(-1);
+/* Point GROUP_SELECT at the groups within [first, last] that also hold some of
+   the '-i' inodes, keeping out any group a diff already left out.  */
+void select_groups(unsigned long first, unsigned long last) {
+
+  unsigned int from, to;
+
+  if (GROUP_SELECT == NULL) {
+    if ((GROUP_SELECT = malloc(DESCRIPTOR_COUNT)) == NULL) {
+      perror("malloc"); exit(-1);
+    }
+    memset(GROUP_SELECT, 1, DESCRIPTOR_COUNT);
   }
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
+    group_inode_slots(i, &from, &to);
+    if (i < first || i > last || from == to)
+      GROUP_SELECT[i] = 0;
+  }
+}
 
-  /* Read in the provided file system image.  */
-  if ((imageFD=open(argv[1],O_RDONLY)) == -1) {
-    fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
-    exit(-1);
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                BITMAP SCAN                             //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write the rows of 'bitmap.csv' (out[0]) for one group's free blocks and inodes.  */
+void emit_bitmap_group(unsigned int i, struct csv_out **out, void *arg) {
+
+  /* Variables used for getting / traversing through bitmap.  */
+  struct bitmap_iter it;
+  int bit;
+  struct csv_out *bitmap = out[0];
+
+  (void) arg;
+
+  /* First, look at the block bitmap and determine which blocks are free  */
+  bitmap_iter_init(&it, group_block_bitmap(i), gd[i].contained_blocks, 0);
+  while ((bit = bitmap_next(&it)) != -1) {
+    csv_hex(bitmap, gd[i].block_bitmap_block, ',');
+    csv_dec(bitmap, sb.first_data_block+(sb.blocks_per_group*i)+bit, '\n');
   }
 
+  /* Next, look at the inode bitmap and find free inodes (those '-i' leaves in)  */
+  group_inode_iter_init(&it, i, 0);
+  while ((bit = bitmap_next(&it)) != -1) {
+    csv_hex(bitmap, gd[i].inode_bitmap_block, ',');
+    csv_dec(bitmap, (sb.inodes_per_group*i)+bit+1, '\n');
+  }
+}
+
+/* With '-e': write one row of 'bitmap.csv' (out[0]) per run of free blocks or
+   inodes in one group, as bitmap block, first number and length, and one row
+   of 'fragment.csv' (out[1]) saying how the group's free blocks are spread:
+   how many runs there are, the longest, and how many of each length, with
+   bucket k counting runs of 2^k to 2^(k+1)-1 blocks (the last one, all
+   longer runs too).  */
+void emit_free_extents(unsigned int i, struct csv_out **out, void *arg) {
+
+  struct bitmap_iter it;
+  int start;
+  unsigned int length, extents = 0, largest = 0, free_blocks = 0, k;
+  unsigned int histogram[16] = { 0 };
+  struct csv_out *bitmap = out[0];
+  struct csv_out *fragment = out[1];
+
+  (void) arg;
+
+  /* Runs of free blocks, counted up as they go by  */
+  bitmap_iter_init(&it, group_block_bitmap(i), gd[i].contained_blocks, 0);
+  while ((start = bitmap_next_run(&it, &length)) != -1) {
+    csv_hex(bitmap, gd[i].block_bitmap_block, ',');
+    csv_dec(bitmap, sb.first_data_block+(sb.blocks_per_group*i)+start, ',');
+    csv_dec(bitmap, length, '\n');
+
+    k = 31 - __builtin_clz(length);
+    histogram[k < 15 ? k : 15]++;
+    extents++;
+    free_blocks += length;
+    if (length > largest)
+      largest = length;
+  }
+
+  /* Runs of free inodes (of those '-i' leaves in)  */
+  group_inode_iter_init(&it, i, 0);
+  while ((start = bitmap_next_run(&it, &length)) != -1) {
+    csv_hex(bitmap, gd[i].inode_bitmap_block, ',');
+    csv_dec(bitmap, (sb.inodes_per_group*i)+start+1, ',');
+    csv_dec(bitmap, length, '\n');
+  }
+
+  /* GROUP, FREE BLOCKS, EXTENT COUNT, LARGEST EXTENT, HISTOGRAM - DEC FORMAT  */
+  csv_dec(fragment, i, ',');
+  csv_dec(fragment, free_blocks, ',');
+  csv_dec(fragment, extents, ',');
+  csv_dec(fragment, largest, ',');
+  for (k = 0; k < 16; k++)
+    csv_dec(fragment, histogram[k], k == 15 ? '\n' : ',');
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                             INODE TABLE SCAN                           //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+
+/* Write one row of 'inode.csv' for the given (allocated) inode.  */
+int emit_inode_row(const struct inode_batch *b, unsigned int k, struct csv_out *inode) {
+
+  /* INODE NUMBER - DEC FORMAT  */
+  csv_dec(inode, b->number[k], ',');
+
+  /* FILE TYPE - CHAR FORMAT */
+  csv_letter(inode, type_letter(b->mode[k]), ',');
+
+  /* MODE - OCT FORMAT */
+  csv_oct(inode, b->mode[k], ',');
+
+  /* OWNER - DEC FORMAT */
+  csv_dec(inode, b->uid[k], ',');
+
+  /* GROUP - DEC FORMAT */
+  csv_dec(inode, b->gid[k], ',');
+
+  /* LINK COUNT - DEC FORMAT */
+  csv_dec(inode, b->links_count[k], ',');
+
+  /* CREATION TIME - HEX FORMAT */
+  csv_hex(inode, b->ctime[k], ',');
+
+  /* MODIFICATION TIME - HEX FORMAT */
+  csv_hex(inode, b->mtime[k], ',');
+
+  /* ACCESS TIME - HEX FORMAT */
+  csv_hex(inode, b->atime[k], ',');
+
+  /* FILE SIZE - DEC FORMAT */
+  csv_dec(inode, b->size[k], ',');
+
+  /* NUMBER OF BLOCKS - DEC FORMAT (i_blocks counts 512-byte sectors) */
+  csv_dec(inode, b->blocks[k] / (sb.block_size / 512), ',');
+
+  /* BLOCK POINTERS * 15 - HEX FORMAT */
+  for (unsigned int i = 0; i < 15; i++)
+    csv_hex(inode, b->block[15*k + i], i == 14 ? '\n' : ',');
+  return 0;
+}
+
+/* Ask for the block map of directories, whose blocks feed 'directory.csv'.  */
+int emit_directory_inode(const struct inode_batch *b, unsigned int k, struct csv_out *directory) {
+
+  (void) directory;
+
+  return ((b->mode[k] & 0xF000) == 0x4000);
+}
+
+/* Write one row of 'directory.csv' for an in-use directory entry.  */
+static int emit_directory_entry(unsigned int inode_number, const struct dirent_ref *d, void *arg) {
+
+  struct csv_out *directory = arg;
+
+  /* PARENT INODE NUMBER - DEC FORMAT */
+  csv_dec(directory, inode_number, ',');
+
+  /* ENTRY NUMBER - DEC FORMAT */
+  csv_dec(directory, d->entry, ',');
+
+  /* ENTRY LENGTH - DEC FORMAT */
+  csv_dec(directory, d->rec_len, ',');
+
+  /* NAME LENGTH - DEC FORMAT */
+  csv_dec(directory, d->name_len, ',');
+
+  /* INODE NUMBER OF THE FILE ENTRY - DEC FORMAT */
+  csv_dec(directory, d->inode, ',');
+
+
+  /* NAME - STRING FORMAT */
+  csv_quoted(directory, d->name, d->name_bytes, '\n');
+
+  /* With '-P' or '-L', the entry also goes into the directory tree.  */
+  if (tree.link != NULL)
+    dir_tree_add(inode_number, d);
+  return 0;
+}
+
+/* Write the rows of 'directory.csv' for one data block of a directory.  */
+void emit_directory_block(unsigned int inode_number, const unsigned char *inodes,
+			  uint64_t logical, unsigned int block, struct csv_out *directory) {
+  iterate_dirent_block(inode_number, inodes, logical, block, emit_directory_entry, directory);
+}
+
+/* Ask for the block map of every inode that has one; its indirect blocks feed 'indirect.csv'.  */
+int emit_indirect_inode(const struct inode_batch *b, unsigned int k, struct csv_out *indirect) {
+
+  (void) indirect;
+
+  return has_block_map(b->raw[k]);
+}
+
+/* Write one row of 'indirect.csv': a non-zero pointer held in an indirect block.  */
+void emit_indirect_row(unsigned int inode_number, unsigned int container, unsigned int entry,
+		       unsigned int pointer, struct csv_out *indirect) {
+
+  (void) inode_number;
+
+  /* CONTAINING BLOCK - HEX FORMAT, ENTRY NUMBER - DEC FORMAT, POINTER - HEX FORMAT */
+  csv_hex(indirect, container, ',');
+  csv_dec(indirect, entry, ',');
+  csv_hex(indirect, pointer, '\n');
+}
+
+/* A data block reached by the walk: hand it to every emitter that asked for data blocks.  */
+static void scan_walk_block(struct block_walk *w, uint64_t logical, unsigned int block) {
+
+  struct emitter_walk *ew = w->arg;
+
+  for (int e = 0; e < ew->scan->emitter_count; e++)
+    if (ew->wanted[e] && ew->scan->emitters[e].block)
+      ew->scan->emitters[e].block(w->inode_number, w->raw, logical, block, ew->out[e]);
+}
+
+/* A pointer held in an indirect block: hand it to every emitter that asked for those.  */
+static void scan_walk_indirect(struct block_walk *w, unsigned int container, unsigned int entry, unsigned int pointer) {
+
+  struct emitter_walk *ew = w->arg;
+
+  for (int e = 0; e < ew->scan->emitter_count; e++)
+    if (ew->wanted[e] && ew->scan->emitters[e].indirect)
+      ew->scan->emitters[e].indirect(w->inode_number, container, entry, pointer, ew->out[e]);
+}
+
+/* Hand each inode of a decoded batch to every emitter, then walk its block map once for all that asked.  */
+static int scan_batch(const struct inode_batch *b, void *arg) {
+
+  struct emitter_walk *ew = arg;
+  struct inode_emitter *emitters = ew->scan->emitters;
+  struct block_walk walk;
+  int any_wanted;
+
+  for (unsigned int k = 0; k < b->count; k++) {
+    if (!filter_inode(b, k))
+      continue;
+    walk = (struct block_walk) { b->number[k], b->raw[k], NULL, NULL, ew, 0 };
+    any_wanted = 0;
+    for (int e = 0; e < ew->scan->emitter_count; e++) {
+      ew->wanted[e] = emitters[e].emit(b, k, ew->out[e]);
+      any_wanted |= ew->wanted[e];
+      if (ew->wanted[e] && emitters[e].block)
+	walk.data = scan_walk_block;
+      if (ew->wanted[e] && emitters[e].indirect)
+	walk.indirect = scan_walk_indirect;
+    }
+
+    if (any_wanted && has_block_map(b->raw[k]))
+      walk_blocks(&walk);
+  }
+  return 0;
+}
+
+/* Hand each allocated inode of one group to every emitter; emitter e writes to out[e].  */
+void scan_inode_group(unsigned int i, struct csv_out **out, void *arg) {
+
+  struct inode_scan *scan = arg;
+  int wanted[scan->emitter_count];
+  struct emitter_walk ew = { scan, wanted, out };
+
+  iterate_inode_batches(i, scan_batch, &ew);
+}
 
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
-  //                                                                        //
-  //                                 SUPER.CSV                              //
-  //                                                                        //          
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
 
-  /* First, create / open 'super.csv' for writing.  */
-  FILE* super = fopen("super.csv", "w");
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                               SUPER.CSV                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write 'super.csv' from the decoded super block.  */
+void write_super_csv(void) {
+
+  /* First, create / open 'super.csv' (or 'super.bin') for writing.  */
+  struct csv_out* super = table_open(&SUPER_TABLE);
   if (super == NULL) {
-    perror("fopen"); exit(-1);
+    perror("open"); exit(-1);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* MAGIC NUMBER - HEX FORMAT  */
-  unsigned char magic[2];
-  int ret;
-  ret = pread(imageFD, magic, 2, SUPER_OFFSET + MAGIC_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  /* We have to do bit-shifting b/c values in file system are little endian */
-  sb.magic_number = (magic[0]<<0) | (magic[1]<<8);
-  fprintf(super, "%x,", sb.magic_number);
+  csv_hex(super, sb.magic_number, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
   
   /* TOTAL NUMBER OF INODES - DEC FORMAT  */
-  unsigned char inode_tot[4];
-  ret = pread(imageFD, inode_tot, 4, SUPER_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-  sb.inode_total = (inode_tot[0]<<0) | (inode_tot[1]<<8) | (inode_tot[2]<<16) | (inode_tot[3]<<24);
-  fprintf(super, "%d,", sb.inode_total);
+  csv_dec(super, sb.inode_total, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* TOTAL NUMBER OF BLOCKS - DEC FORMAT  */
-  unsigned char block_tot[4];
-  ret = pread(imageFD, block_tot, 4, SUPER_OFFSET + B_CNT_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-  sb.block_total = (block_tot[0]<<0) | (block_tot[1]<<8) | (block_tot[2]<<16) | (block_tot[3]<<24);
-  fprintf(super, "%d,", sb.block_total);
+  csv_dec(super, sb.block_total, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* BLOCK SIZE - DEC FORMAT  */
-  unsigned char block_siz[4];
-  ret = pread(imageFD, block_siz, 4, SUPER_OFFSET + B_SIZ_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  sb.block_size = (block_siz[0]<<0) | (block_siz[1]<<8) | (block_siz[2]<<16) | (block_siz[3]<<24);
-  sb.block_size = 1024 << sb.block_size;
-  fprintf(super, "%d,", sb.block_size);
+  csv_dec(super, sb.block_size, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* FRAGMENT SIZE - DEC FORMAT  */
-  unsigned char frag_siz[4];
-  ret = pread(imageFD, frag_siz, 4, SUPER_OFFSET + F_SIZ_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  sb.fragment_size = (frag_siz[0]<<0) | (frag_siz[1]<<8) | (frag_siz[2]<<16) | (frag_siz[3]<<24);
-  if ( sb.fragment_size >= 0)
-    sb.fragment_size = 1024 << sb.fragment_size;
-  else
-    sb.fragment_size = 1024 >> -sb.fragment_size;
-  fprintf(super, "%d,", sb.fragment_size);
+  csv_dec(super, sb.fragment_size, ',');
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* BLOCKS PER GROUP - DEC FORMAT  */
-  unsigned char bpg[4];
-  ret = pread(imageFD, bpg, 4, SUPER_OFFSET + B_GRP_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  sb.blocks_per_group = (bpg[0]<<0) | (bpg[1]<<8) | (bpg[2]<<16) | (bpg[3]<<24);
-  fprintf(super, "%d,", sb.blocks_per_group);
+  csv_dec(super, sb.blocks_per_group, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* INODES PER GROUP - DEC FORMAT  */
-  unsigned char ipg[4];
-  ret = pread(imageFD, ipg, 4, SUPER_OFFSET + I_GRP_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  sb.inodes_per_group = (ipg[0]<<0) | (ipg[1]<<8) | (ipg[2]<<16) | (ipg[3]<<24);
-  fprintf(super, "%d,", sb.inodes_per_group);
+  csv_dec(super, sb.inodes_per_group, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* FRAGMENTS PER GROUP - DEC FORMAT  */
-  unsigned char fpg[4];
-  ret = pread(imageFD, fpg, 4, SUPER_OFFSET + F_GRP_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  sb.fragments_per_group = (fpg[0]<<0) | (fpg[1]<<8) | (fpg[2]<<16) | (fpg[3]<<24);
-  fprintf(super, "%d,", sb.fragments_per_group);
+  csv_dec(super, sb.fragments_per_group, ',');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* FIRST DATA BLOCK - DEC FORMAT  */
-  unsigned char fdb[4];
-  ret = pread(imageFD, fdb, 4, SUPER_OFFSET + FIRST_DATA_BLOCK_OFFSET);
-  if (ret == -1) {
-    perror("pread"); exit(-1);
-  }
-
-  sb.first_data_block = (fdb[0]<<0) | (fdb[1]<<8) | (fdb[2]<<16) | (fdb[3]<<24);
-  fprintf(super, "%d\n", sb.first_data_block);
+  csv_dec(super, sb.first_data_block, '\n');
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
-  /* Now that we know block size, compute the offset to end of super block  */
-  END_OF_SUPER = SUPER_OFFSET + sb.block_size;
-
   /* Lastly, close the file stream.  */
-  if (fclose(super) != 0) {
-    perror("fclose"); exit(-1);
+  if (table_close(super, &SUPER_TABLE) != 0) {
+    perror("close"); exit(-1);
   }
 
   
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
-  //                                                                        //
-  //                                 GROUP.CSV                              //
-  //                                                                        //          
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
+}
+
 
-  /* First, create / open 'group.csv' for writing.  */
-  FILE* group = fopen("group.csv", "w");
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                               GROUP.CSV                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write 'group.csv' from the decoded group descriptors.  */
+void write_group_csv(void) {
+
+  /* First, create / open 'group.csv' (or 'group.bin') for writing.  */
+  struct csv_out* group = table_open(&GROUP_TABLE);
   if (group == NULL) {
-    perror("fopen"); exit(-1);
+    perror("open"); exit(-1);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
-  /* Create a list of group descriptors in the file system.  */
-  DESCRIPTOR_COUNT = 1 + (sb.block_total - 1) / sb.blocks_per_group;
-  gd = (struct group_descr *) malloc( sizeof(struct group_descr) * DESCRIPTOR_COUNT );
-  if (gd == NULL) {
-    perror("malloc"); exit(-1);
-  }
-
-  unsigned char fbpg[2]; //Free blocks per group
-  unsigned char fipg[2]; //Free inodes per group
-  unsigned char dpg[2];  //Number of directories per group
-  unsigned char ibm[4];  //Inode bitmap id
-  unsigned char bbm[4];  //Block bitmap id
-  unsigned char its[4];  //Inode table start block
-  
   for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
 
     /* NUMBER OF CONTAINED BLOCKS - DEC FORMAT  */
-    if (i == (DESCRIPTOR_COUNT - 1)) //Last block
-      gd[i].contained_blocks = sb.block_total % sb.blocks_per_group;
-    else
-      gd[i].contained_blocks = sb.blocks_per_group;
-    fprintf(group, "%d,", gd[i].contained_blocks);
+    csv_dec(group, gd[i].contained_blocks, ',');
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
     /* NUMBER OF FREE BLOCKS - DEC FORMAT  */
-    ret = pread(imageFD, fbpg, 2, ((END_OF_SUPER + (i*GROUP_DESC_SIZE)) + B_FREE_OFFSET));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    gd[i].free_blocks_per_group = (fbpg[0]<<0) | (fbpg[1]<<8);
-    fprintf(group, "%d,", gd[i].free_blocks_per_group);
+    csv_dec(group, gd[i].free_blocks_per_group, ',');
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
     /* NUMBER OF FREE INODES - DEC FORMAT  */
-    ret = pread(imageFD, fipg, 2, ((END_OF_SUPER + (i*GROUP_DESC_SIZE)) + I_FREE_OFFSET));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    gd[i].free_inodes_per_group = (fipg[0]<<0) | (fipg[1]<<8);
-    fprintf(group, "%d,", gd[i].free_inodes_per_group);
+    csv_dec(group, gd[i].free_inodes_per_group, ',');
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
     /* NUMBER OF DIRECTORIES - DEC FORMAT  */
-    ret = pread(imageFD, dpg, 2, ((END_OF_SUPER + (i*GROUP_DESC_SIZE)) + D_USED_OFFSET));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    gd[i].directories_per_group = (dpg[0]<<0) | (dpg[1]<<8);
-    fprintf(group, "%d,", gd[i].directories_per_group);    
+    csv_dec(group, gd[i].directories_per_group, ',');    
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
     /* (FREE) INODE BITMAP BLOCK - HEX FORMAT  */
-    ret = pread(imageFD, ibm, 4, ((END_OF_SUPER + (i*GROUP_DESC_SIZE)) + I_BITMAP_OFFSET));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    gd[i].inode_bitmap_block = (ibm[0]<<0) | (ibm[1]<<8) | (ibm[2]<<16) | (ibm[3]<<24);
-    fprintf(group, "%x,", gd[i].inode_bitmap_block);
+    csv_hex(group, gd[i].inode_bitmap_block, ',');
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
     /* (FREE) BLOCK BITMAP BLOCK - HEX FORMAT  */
-    ret = pread(imageFD, bbm, 4, ((END_OF_SUPER + (i*GROUP_DESC_SIZE)) + B_BITMAP_OFFSET));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    gd[i].block_bitmap_block = (bbm[0]<<0) | (bbm[1]<<8) | (bbm[2]<<16) | (bbm[3]<<24);
-    fprintf(group, "%x,", gd[i].block_bitmap_block);
+    csv_hex(group, gd[i].block_bitmap_block, ',');
     
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
     /* INODE TABLE (START) BLOCK - HEX FORMAT  */
-    ret = pread(imageFD, its, 4, ((END_OF_SUPER + (i*GROUP_DESC_SIZE)) + I_TABLE_OFFSET));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    gd[i].inode_table_start_block = (its[0]<<0) | (its[1]<<8) | (its[2]<<16) | (its[3]<<24);
-    fprintf(group, "%x\n", gd[i].inode_table_start_block);
+    csv_hex(group, gd[i].inode_table_start_block, '\n');
     
   }  
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* Lastly, close the file stream.  */
-  if (fclose(group) != 0) {
-    perror("fclose"); exit(-1);
+  if (table_close(group, &GROUP_TABLE) != 0) {
+    perror("close"); exit(-1);
   }
+}
 
 
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
-  //                                                                        //
-  //                                BITMAP.CSV                              //
-  //                                                                        //          
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
 
-  /* First, create / open 'bitmap.csv' for writing.  */
-  FILE* bitmap = fopen("bitmap.csv", "w");
-  if (bitmap == NULL) {
-    perror("fopen"); exit(-1);
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                              CHANGED.CSV                               //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write 'changed.csv' for a diff run ('-d'): one row per group that was dumped
+   again, with the inodes and blocks it covers, so that its rows can replace
+   the same ranges in the earlier dump.  */
+void write_changed_csv(void) {
+
+  /* First, create / open 'changed.csv' for writing.  */
+  struct csv_out* changed = csv_open("changed.csv");
+  if (changed == NULL) {
+    perror("open"); exit(-1);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
-  /* Variables used for getting / traversing through bitmap.  */
-  unsigned char bitmap_block[sb.block_size];
-  int bitmap_byte, bit_free, counter;
+  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {
 
-  for (unsigned int i = 0; i < DESCRIPTOR_COUNT; i++) {   // For each group...
+    if (GROUP_SELECT != NULL && !GROUP_SELECT[i])
+      continue;
 
-    /* First, read in the block bitmap and determine which blocks are free  */
-    ret = pread(imageFD, bitmap_block, sb.block_size, compute_offset(gd[i].block_bitmap_block));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    counter = 1;
-    for (unsigned int j = 0; j < sb.block_size; j++) { //TODO: Change to contained blocks?
-      bitmap_byte = bitmap_block[j];
-      for (unsigned int k = 1; k <= 128; k *= 2) {
-	bit_free = !(bitmap_byte & k);
-	if (bit_free)
-	  fprintf(bitmap, "%x,%d\n", gd[i].block_bitmap_block, (sb.blocks_per_group*i)+(8*j)+counter);
-	counter++;
-      }
-      counter = 1;
-    }
+    /* GROUP NUMBER - DEC FORMAT  */
+    csv_dec(changed, i, ',');
 
-    /* Next, read in the inode bitmap and find free inodes  */
-    ret = pread(imageFD, bitmap_block, sb.block_size, compute_offset(gd[i].inode_bitmap_block));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
-    }
-    counter = 1;
-    for (unsigned int j = 0; j < sb.block_size; j++) { //TODO: Change to contained blocks?
-      bitmap_byte = bitmap_block[j];
-      for (unsigned int k = 1; k <= 128; k *= 2) {
-	bit_free = !(bitmap_byte & k);
-	if (bit_free)
-	  fprintf(bitmap, "%x,%d\n", gd[i].inode_bitmap_block, (sb.inodes_per_group*i)+(8*j)+counter);
-	counter++;
-      }
-      counter = 1;
-    }
+    /* FIRST AND LAST INODE - DEC FORMAT  */
+    csv_dec(changed, i * sb.inodes_per_group + 1, ',');
+    csv_dec(changed, (i + 1) * sb.inodes_per_group, ',');
+
+    /* FIRST AND LAST BLOCK - DEC FORMAT  */
+    csv_dec(changed, sb.first_data_block + i * sb.blocks_per_group, ',');
+    csv_dec(changed, sb.first_data_block + i * sb.blocks_per_group + gd[i].contained_blocks - 1, '\n');
   }
-    
+
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
   /* Lastly, close the file stream.  */
-  if (fclose(bitmap) != 0) {
-    perror("fclose"); exit(-1);
+  if (csv_close(changed) != 0) {
+    perror("close"); exit(-1);
   }
+}
 
 
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
-  //                                                                        //
-  //                                 INODE.CSV                              //
-  //                                                                        //          
-  ////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                PATH.CSV                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
 
-  /* First, create / open 'inode.csv' for writing.  */
-  FILE* inode = fopen("inode.csv", "w");
-  if (inode == NULL) {
-    perror("fopen"); exit(-1);
+/* Write 'path.csv' ('-P'): the full path of every inode that has one, in
+   inode order, from the tree the directory pass built.  */
+void write_path_csv(void) {
+
+  char *buf;
+  const char *path;
+
+  /* First, create / open 'path.csv' for writing.  */
+  struct csv_out* paths = table_open(&PATH_TABLE);
+  if (paths == NULL) {
+    perror("open"); exit(-1);
+  }
+  if ((buf = malloc(PATH_BUFFER_SIZE)) == NULL) {
+    perror("malloc"); exit(-1);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
-  unsigned int table_offset;
-  unsigned int table_index;
-  unsigned int inode_number;
+  for (unsigned int i = 1; i <= tree.inode_count; i++) {
 
-  unsigned char imod[2];
-  unsigned int i_mode;
-  unsigned int file_type;
-  
+    if ((path = dir_tree_path(i, buf, PATH_BUFFER_SIZE)) == NULL)
+      continue;
 
-  unsigned char i_uid[2];
-  unsigned int i_uidf;
+    /* INODE NUMBER - DEC FORMAT, PATH - STRING FORMAT  */
+    csv_dec(paths, i, ',');
+    csv_quoted(paths, path, strlen(path), '\n');
+  }
 
-  unsigned char i_gid[2];
-  unsigned int i_gidf;
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
-  unsigned char i_link_count[2];
-  unsigned int i_lcf;
+  /* Lastly, close the file stream.  */
+  free(buf);
+  if (table_close(paths, &PATH_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+}
 
-  unsigned char i_ctime[4];
-  unsigned int i_ctimef;
-  
-  unsigned char i_mtime[4];
-  unsigned int i_mtimef;
+/* Resolve each path listed in 'list' ('-L', one per line, '-' for stdin)
+   and print 'inode,"path"' to stdout, with inode 0 for paths that lead
+   nowhere.  */
+void write_path_lookups(const char *list) {
 
-  unsigned char i_atime[4];
-  unsigned int i_atimef;
+  FILE *in = (strcmp(list, "-") == 0) ? stdin : fopen(list, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  struct csv_out out;
 
-  unsigned char i_size[4];
-  unsigned int i_sizef;
+  if (in == NULL) {
+    perror(list); exit(-1);
+  }
+  csv_init(&out, STDOUT_FILENO);
 
-  unsigned char i_b[4];
-  unsigned int i_blocks;
+  while ((len = getline(&line, &cap, in)) != -1) {
+    if (len > 0 && line[len-1] == '\n')
+      line[--len] = '\0';
+    csv_dec(&out, dir_tree_lookup(line), ',');
+    csv_quoted(&out, line, len, '\n');
+  }
 
-  unsigned char b_ptr[4];
-  unsigned int block_id;
+  csv_flush(&out);
+  free(out.buf);
+  free(line);
+  if (in != stdin)
+    fclose(in);
+}
 
-  unsigned char inodes[128];
-  
-  for (unsigned int i =  0; i < DESCRIPTOR_COUNT; i++) {
+/* Resolve each of 'paths' ('-l') by reading only the directories along the
+   way, through their hash indexes where they have them, and print
+   'inode,"path"' to stdout like '-L'.  */
+void write_index_lookups(char **paths, int count) {
+
+  struct csv_out out;
+  size_t mark;
+
+  csv_init(&out, STDOUT_FILENO);
+  for (int p = 0; p < count; p++) {
+    mark = cache_hold();
+    csv_dec(&out, lookup_path(paths[p]), ',');
+    csv_quoted(&out, paths[p], strlen(paths[p]), '\n');
+    cache_release(mark);
+  }
+  csv_flush(&out);
+  free(out.buf);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                HTREE.CSV                               //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write one row of 'htree.csv': an entry of a directory's hash index.  */
+static int emit_htree_row(unsigned int inode_number, const struct htree_ref *e, void *arg) {
+
+  struct csv_out *htree = arg;
+
+  /* DIRECTORY INODE NUMBER - DEC FORMAT, LEVEL BELOW THE ROOT - DEC FORMAT  */
+  csv_dec(htree, inode_number, ',');
+  csv_dec(htree, e->level, ',');
+
+  /* INDEX BLOCK, ENTRY NUMBER - DEC FORMAT, HASH - HEX FORMAT, CHILD BLOCK - DEC FORMAT
+     (both blocks are logical blocks of the directory)  */
+  csv_dec(htree, e->node, ',');
+  csv_dec(htree, e->entry, ',');
+  csv_hex(htree, e->hash, ',');
+  csv_dec(htree, e->child, '\n');
+  return 0;
+}
+
+/* '-H': write out the hash index of each indexed directory. The index
+   blocks are read here, so the inode's block map isn't asked for.  */
+int emit_htree_inode(const struct inode_batch *b, unsigned int k, struct csv_out *htree) {
+
+  if ((b->mode[k] & 0xF000) == 0x4000)
+    iterate_htree(b->number[k], b->raw[k], emit_htree_row, htree);
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                      MANIFEST.CSV & BLOCKHASH.CSV                      //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/* Write one row of 'blockhash.csv': a data block of a regular file and its CRC.  */
+static void emit_blockhash_row(unsigned int inode_number, uint64_t logical, unsigned int block,
+			       uint32_t crc, void *arg) {
+
+  struct csv_out *blockhash = arg;
 
-    ret = pread(imageFD, bitmap_block, sb.block_size, compute_offset(gd[i].inode_bitmap_block));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
+  /* INODE NUMBER, LOGICAL BLOCK - DEC FORMAT, BLOCK, CRC-32C - HEX FORMAT  */
+  csv_dec(blockhash, inode_number, ',');
+  csv_dec(blockhash, logical, ',');
+  csv_hex(blockhash, block, ',');
+  csv_hex(blockhash, crc, '\n');
+}
+
+/* Hash each regular file of a batch that passes the filters (the reserved
+   inodes, like the resize inode, aren't anyone's files).  */
+static int manifest_batch(const struct inode_batch *b, void *arg) {
+
+  struct manifest_walk *m = arg;
+  const unsigned char *raw;
+  unsigned int blocks;
+  uint32_t crc;
+
+  for (unsigned int k = 0; k < b->count; k++) {
+    if ((b->mode[k] & 0xF000) != 0x8000 || b->number[k] < sb.first_ino || !filter_inode(b, k))
+      continue;
+    raw = b->raw[k];
+    crc = hash_file(b->number[k], raw, m->blocks ? emit_blockhash_row : NULL, m->blocks, &blocks);
+    if (m->files == NULL)
+      continue;
+
+    /* INODE NUMBER, 64-BIT SIZE, DATA BLOCKS - DEC FORMAT, CRC-32C - HEX FORMAT  */
+    csv_dec(m->files, b->number[k], ',');
+    csv_u64(m->files, get_le32(raw + I_SIZE_OFFSET) | (uint64_t) get_le32(raw + I_SIZE_HIGH_OFFSET) << 32, ',');
+    csv_dec(m->files, blocks, ',');
+    csv_hex(m->files, crc, '\n');
+  }
+  return 0;
+}
+
+/* '-M': hash the contents of every regular file in one group, writing to
+   'manifest.csv' and 'blockhash.csv' (whichever '-t' leaves in, in that
+   order in 'out'). The groups are spread over the '-j' threads in order,
+   so the files are read roughly in the order they sit on disk.  */
+void emit_manifest_group(unsigned int i, struct csv_out **out, void *arg) {
+
+  const int *streams = arg;
+  struct manifest_walk m = { streams[0] < 0 ? NULL : out[streams[0]],
+			     streams[1] < 0 ? NULL : out[streams[1]] };
+
+  iterate_inode_batches(i, manifest_batch, &m);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                AUDIT.CSV                               //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * An audit ('-a') checks the file system against itself while the inode
+ * pass runs: what each group can tell on its own (its free counts, inodes
+ * that are in use but free in the bitmap, bad "." entries) is written with
+ * that group's rows, and the rest (blocks claimed twice or not at all, link
+ * counts, ".." entries) is gathered into 'seen' and written once every
+ * group is done. Each row of 'audit.csv' is a check's name followed by the
+ * numbers it is about.
+ */
+
+struct audit seen;                          /* What the audit has gathered so far                    */
+const unsigned int FIRST_INODE  = 11;       /* Inodes below this are reserved for the file system    */
+const unsigned int RESIZE_INODE = 7;        /* Holds the reserved GDT blocks, which are metadata     */
+
+static uint64_t *audit_bits(uint64_t count) {
+
+  uint64_t *bits = calloc((count + 63) / 64, sizeof(uint64_t));
+
+  if (bits == NULL) {
+    perror("calloc"); exit(-1);
+  }
+  return bits;
+}
+
+static void *audit_array(uint64_t count, size_t size) {
+
+  void *array = calloc(count, size);
+
+  if (array == NULL) {
+    perror("calloc"); exit(-1);
+  }
+  return array;
+}
+
+/* Set up 'seen' for the whole file system; called before the passes.  */
+void audit_init(void) {
+  seen.allocated = audit_bits(sb.block_total);
+  seen.owned = audit_bits(sb.block_total);
+  seen.shared = audit_bits(sb.block_total);
+  seen.used = audit_bits((uint64_t) sb.inode_total + 1);
+  seen.is_dir = audit_bits((uint64_t) sb.inode_total + 1);
+  seen.links = audit_array((uint64_t) sb.inode_total + 1, sizeof(uint16_t));
+  seen.refs = audit_array((uint64_t) sb.inode_total + 1, sizeof(uint32_t));
+  seen.parent = audit_array((uint64_t) sb.inode_total + 1, sizeof(uint32_t));
+  seen.dotdot = audit_array((uint64_t) sb.inode_total + 1, sizeof(uint32_t));
+}
+
+/* Set bit 'n' from any thread and return whether it was set already.  */
+static int audit_set(uint64_t *bits, uint64_t n) {
+
+  uint64_t mask = (uint64_t) 1 << (n % 64);
+
+  return (__atomic_fetch_or(&bits[n / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static int audit_test(const uint64_t *bits, uint64_t n) {
+  return (bits[n / 64] >> (n % 64)) & 1;
+}
+
+/* Write one row: the check's name and then 'count' numbers.  */
+static void audit_row(struct csv_out *audit, const char *check, int count,
+		      unsigned int a, unsigned int b, unsigned int c) {
+
+  unsigned int v[3] = { a, b, c };
+
+  csv_bytes(audit, check, strlen(check));
+  csv_char(audit, count ? ',' : '\n');
+  for (int i = 0; i < count; i++)
+    csv_dec(audit, v[i], i == count - 1 ? '\n' : ',');
+}
+
+/* 'owner' (an inode, or 0 for a group's metadata) claims 'block'.  */
+static void audit_claim(unsigned int owner, unsigned int block, struct csv_out *audit) {
+
+  if (block < sb.first_data_block || block >= sb.block_total) {
+    audit_row(audit, "INVALID_BLOCK", 2, owner, block, 0);
+    return;
+  }
+  if (audit_set(seen.owned, block))
+    audit_set(seen.shared, block);
+}
+
+/* An extent tree claims its nodes below the root and every block of its
+   leaf extents, initialized or not (one pointing nowhere is one bad block).  */
+static int audit_extent(unsigned int inode_number, const struct extent_ref *e, void *arg) {
+
+  struct csv_out *audit = arg;
+
+  if (e->depth > 0 || e->start == 0) {
+    audit_claim(inode_number, e->start, audit);
+    return 0;
+  }
+  for (unsigned int b = 0; b < e->len; b++)
+    audit_claim(inode_number, e->start + b, audit);
+  return 0;
+}
+
+/* Note what an allocated inode is and claim the blocks its i_block points at;
+   ask for the block map when there are indirect blocks to look in. An
+   extent tree is claimed here and now, nodes and all.  */
+int audit_block_inode(const struct inode_batch *b, unsigned int k, struct csv_out *audit) {
+
+  unsigned int n = b->number[k];
+  const uint32_t *i_block = &b->block[15*k];
+
+  if (b->mode[k] == 0) {
+    if (n >= FIRST_INODE)
+      audit_row(audit, "UNUSED_INODE_ALLOCATED", 1, n, 0, 0);
+    return 0;
+  }
+  audit_set(seen.used, n);
+  seen.links[n] = b->links_count[k];
+  if ((b->mode[k] & 0xF000) == 0x4000)
+    audit_set(seen.is_dir, n);
+
+  if (!has_block_map(b->raw[k]))
+    return 0;
+  if (has_extents(b->raw[k])) {
+    iterate_extents(n, b->raw[k], audit_extent, audit);
+    return 0;
+  }
+
+  /* The resize inode's indirect blocks are the reserved GDT blocks, which
+     the groups claim as their own metadata, so only its top block counts.  */
+  if (n == RESIZE_INODE) {
+    if (i_block[13] != 0)
+      audit_claim(n, i_block[13], audit);
+    return 0;
+  }
+  for (int e = 0; e < 15; e++)
+    if (i_block[e] != 0)
+      audit_claim(n, i_block[e], audit);
+  return (i_block[12] | i_block[13] | i_block[14]) != 0;
+}
+
+/* Every pointer held in an indirect block is a block the inode claims.  */
+void audit_indirect_row(unsigned int inode_number, unsigned int container, unsigned int entry,
+			unsigned int pointer, struct csv_out *audit) {
+
+  (void) container;
+  (void) entry;
+
+  audit_claim(inode_number, pointer, audit);
+}
+
+/* Ask for the data blocks of directories, whose entries are counted up.  */
+int audit_directory_inode(const struct inode_batch *b, unsigned int k, struct csv_out *audit) {
+
+  (void) audit;
+
+  return ((b->mode[k] & 0xF000) == 0x4000);
+}
+
+/* Count a reference to the entry's inode, and note where "." and ".." point.  */
+static int audit_entry(unsigned int inode_number, const struct dirent_ref *d, void *arg) {
+
+  struct csv_out *audit = arg;
+  int dots = 0;
+  uint32_t parent;
+
+  if (d->inode > sb.inode_total) {
+    audit_row(audit, "INVALID_ENTRY", 2, inode_number, d->inode, 0);
+    return 0;
+  }
+  __atomic_fetch_add(&seen.refs[d->inode], 1, __ATOMIC_RELAXED);
+
+  if (d->name_bytes >= 1 && d->name_bytes <= 2 && d->name[0] == '.' && d->name[d->name_bytes-1] == '.')
+    dots = d->name_bytes;
+  if (dots == 1 && d->inode != inode_number)
+    audit_row(audit, "DOT", 2, inode_number, d->inode, 0);
+  else if (dots == 2)
+    seen.dotdot[inode_number] = d->inode;
+  else if (dots == 0) {
+    /* Keep the lowest directory that names the inode, whichever thread gets here first.  */
+    parent = __atomic_load_n(&seen.parent[d->inode], __ATOMIC_RELAXED);
+    while ((parent == 0 || inode_number < parent) &&
+	   !__atomic_compare_exchange_n(&seen.parent[d->inode], &parent, inode_number, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+  return 0;
+}
+
+void audit_directory_block(unsigned int inode_number, const unsigned char *inodes,
+			   uint64_t logical, unsigned int block, struct csv_out *audit) {
+  iterate_dirent_block(inode_number, inodes, logical, block, audit_entry, audit);
+}
+
+/* Run the inode scan for one group, then the checks that only need this group.  */
+void audit_inode_group(unsigned int i, struct csv_out **out, void *arg) {
+
+  struct inode_scan *scan = arg;
+  struct csv_out *audit = out[scan->emitter_count - 1];
+  struct bitmap_iter it;
+  const unsigned char *raw;
+  unsigned int group_start = sb.first_data_block + sb.blocks_per_group*i;
+  unsigned int table_blocks = ((uint64_t) sb.inodes_per_group*INODE_SIZE + sb.block_size - 1) / sb.block_size;
+  unsigned int length, free_count, directories = 0, b;
+  int start;
+
+  scan_inode_group(i, out, arg);
+
+  /* The group's own metadata: the super block and descriptor copies (with
+     the reserved GDT blocks), the two bitmaps and the inode table, which
+     with flex_bg may live in another group.  */
+  for (b = 0; b < group_super_blocks(i); b++)
+    audit_claim(0, group_start + b, audit);
+  audit_claim(0, gd[i].block_bitmap_block, audit);
+  audit_claim(0, gd[i].inode_bitmap_block, audit);
+  for (b = 0; b < table_blocks; b++)
+    audit_claim(0, gd[i].inode_table_start_block + b, audit);
+
+  /* The block bitmap: note what it says is in use, and count what is free.  */
+  bitmap_iter_init(&it, group_block_bitmap(i), gd[i].contained_blocks, 1);
+  while ((start = bitmap_next_run(&it, &length)) != -1)
+    for (b = group_start + start; b < group_start + start + length; b++)
+      audit_set(seen.allocated, b);
+  free_count = 0;
+  bitmap_iter_init(&it, group_block_bitmap(i), gd[i].contained_blocks, 0);
+  while (bitmap_next_run(&it, &length) != -1)
+    free_count += length;
+  if (free_count != gd[i].free_blocks_per_group)
+    audit_row(audit, "GROUP_FREE_BLOCKS", 3, i, gd[i].free_blocks_per_group, free_count);
+
+  /* The inode bitmap: count what is free, and look for free inodes still in
+     use (unless the inode table was never initialized, when it's garbage).  */
+  free_count = 0;
+  bitmap_iter_init(&it, group_inode_bitmap(i), sb.inodes_per_group, 0);
+  while ((start = bitmap_next(&it)) != -1) {
+    free_count++;
+    if (img.streaming || (gd[i].flags & BG_INODE_UNINIT))
+      continue;
+    if ((raw = get_inode(sb.inodes_per_group*i + start + 1)) == NULL)
+      continue;
+    if (get_le16(raw + I_MODE_OFFSET) != 0 && get_le16(raw + I_LINK_COUNT_OFFSET) != 0 &&
+	get_le32(raw + I_DELETE_OFFSET) == 0)
+      audit_row(audit, "USED_INODE_FREE", 1, sb.inodes_per_group*i + start + 1, 0, 0);
+  }
+  if (free_count != gd[i].free_inodes_per_group)
+    audit_row(audit, "GROUP_FREE_INODES", 3, i, gd[i].free_inodes_per_group, free_count);
+
+  for (b = sb.inodes_per_group*i + 1; b <= sb.inodes_per_group*(i + 1) && b <= sb.inode_total; b++)
+    directories += audit_test(seen.is_dir, b);
+  if (directories != gd[i].directories_per_group)
+    audit_row(audit, "GROUP_DIRECTORIES", 3, i, gd[i].directories_per_group, directories);
+}
+
+/* Once every group is done: blocks claimed twice, claimed but free, or in
+   use but unclaimed (found a word at a time), then every inode's link count
+   against the entries naming it, and every directory's ".." against the
+   directory it is named in.  */
+void write_audit_csv(struct csv_out *audit) {
+
+  uint64_t words = ((uint64_t) sb.block_total + 63) / 64, odd;
+  unsigned int n, expected;
+  int bit;
+
+  for (uint64_t w = 0; w < words; w++) {
+    odd = seen.shared[w] | (seen.owned[w] ^ seen.allocated[w]);
+    while (odd) {
+      bit = __builtin_ctzll(odd);
+      odd &= odd - 1;
+      n = 64*w + bit;
+      if (n < sb.first_data_block)
+	continue;
+      if (audit_test(seen.shared, n))
+	audit_row(audit, "DUPLICATE_BLOCK", 1, n, 0, 0);
+      if (!audit_test(seen.allocated, n))
+	audit_row(audit, "FREE_BLOCK_USED", 1, n, 0, 0);
+      else if (!audit_test(seen.owned, n))
+	audit_row(audit, "UNREFERENCED_BLOCK", 1, n, 0, 0);
     }
+  }
 
-    counter = 1;
-    
-    for (unsigned int j = 0; j < sb.block_size; j++) {
-      bitmap_byte = bitmap_block[j];
-      for (unsigned int k = 1; k <= 128; k *= 2) {
-	bit_free = !(bitmap_byte & k);
-	if (!bit_free) {
-	  table_index = (8*j) + counter;
-	  if (table_index < sb.inodes_per_group) {
-
-
-	    inode_number = (sb.inodes_per_group * i) + table_index;
-	    table_offset = compute_offset(gd[i].inode_table_start_block) + (128*(table_index-1));
-
-	    
-	    /* INODE NUMBER - DEC FORMAT  */
-	    fprintf(inode, "%d,", inode_number);
-
-	    ret = pread(imageFD, inodes, 128, table_offset);
-	    if (ret == -1) {
-	      perror("pread"); exit(-1);
-	    }
-
-	    int l;
-
-	    /* FILE TYPE - CHAR FORMAT */
-	    for (l = 0; l < 2; l++) {
-	      imod[l] = inodes[I_MODE_OFFSET+l];
-	    }
-	    i_mode = (imod[0]<<0) | (imod[1]<<8);
-	    file_type = (i_mode & 0xF000);
-	    switch (file_type) {
-	      case 0x8000:
-		fprintf(inode, "f,");
-		break;
-	      case 0x4000:
-		fprintf(inode, "d,");
-		break;
-	      case 0xA000:
-		fprintf(inode, "s,");
-		break;
-	      default:
-		fprintf(inode, "?,");
-		break;
-	    }
-
-	    /* MODE - OCT FORMAT */
-	    fprintf(inode, "%o,", i_mode);
-	      
-
-	    /* OWNER - DEC FORMAT */
-	    for (l = 0; l < 2; l++) {
-	      i_uid[l] = inodes[I_UID_OFFSET+l];
-	    }
-	    i_uidf = (i_uid[0]<<0) | (i_uid[1]<<8);
-	    fprintf(inode, "%d,", i_uidf);
-
-
-	    /* GROUP - DEC FORMAT */
-	    for (l = 0; l < 2; l++) {
-	      i_gid[l] = inodes[I_GID_OFFSET+l];
-	    }
-	    i_gidf = (i_gid[0]<<0) | (i_gid[1]<<8);
-	    fprintf(inode, "%d,", i_gidf);
-
-	    /* LINK COUNT - DEC FORMAT */
-	    for (l = 0; l < 2; l++) {
-	      i_link_count[l] = inodes[I_LINK_COUNT_OFFSET+l];
-	    }
-	    i_lcf = (i_link_count[0]<<0) | (i_link_count[1]<<8);
-	    fprintf(inode, "%d,", i_lcf);
-
-	    /* CREATION TIME - HEX FORMAT */
-	    for (l = 0; l < 4; l++) {
-	      i_ctime[l] = inodes[I_CREATE_OFFSET+l];
-	    }
-	    i_ctimef = (i_ctime[0]<<0) | (i_ctime[1]<<8) | (i_ctime[2]<<16) | (i_ctime[3]<<24);
-	    fprintf(inode, "%x,", i_ctimef);
-
-	    /* MODIFICATION TIME - HEX FORMAT */
-	    for (l = 0; l < 4; l++) {
-	      i_mtime[l] = inodes[I_MOD_OFFSET+l];
-	    }
-	    i_mtimef = (i_mtime[0]<<0) | (i_mtime[1]<<8) | (i_mtime[2]<<16) | (i_mtime[3]<<24);
-	    fprintf(inode, "%x,", i_mtimef);
-
-	    /* ACCESS TIME - HEX FORMAT */
-	    for (l = 0; l < 4; l++) {
-	      i_atime[l] = inodes[I_ACCESS_OFFSET+l];
-	    }
-	    i_atimef = (i_atime[0]<<0) | (i_atime[1]<<8) | (i_atime[2]<<16) | (i_atime[3]<<24);
-	    fprintf(inode, "%x,", i_atimef);
-
-	    /* FILE SIZE - DEC FORMAT */
-	    for (l = 0; l < 4; l++) {
-	      i_size[l] = inodes[I_SIZE_OFFSET+l];
-	    }
-	    i_sizef = (i_size[0]<<0) | (i_size[1]<<8) | (i_size[2]<<16) | (i_size[3]<<24);
-	    fprintf(inode, "%d,", i_sizef);
-
-	    /* NUMBER OF BLOCKS - DEC FORMAT */
-	    for (l = 0; l < 4; l++) {
-	      i_b[l] = inodes[I_BLOCK_OFFSET+l];
-	    }
-	    i_blocks = (i_b[0]<<0) | (i_b[1]<<8) | (i_b[2]<<16) | (i_b[3]<<24);
-	    i_blocks /= (2 << sb.block_size);
-	    fprintf(inode, "%d,", i_blocks);
-
-	    /* BLOCK POINTERS * 15 - HEX FORMAT */
-	    for (unsigned i = 0; i < 15; i++) {
-	      for (l = 0; l < 4; l++) {
-		b_ptr[l] = inodes[B_PTRS_OFFSET+(4*i)+l];
-	      }
-	      block_id = (b_ptr[0]<<0) | (b_ptr[1]<<8) | (b_ptr[2]<<16) | (b_ptr[3]<<24);
-	      if (i == 14)
-		fprintf(inode, "%x\n", block_id);
-	      else
-		fprintf(inode, "%x,", block_id);
-	    }
-	  }
+  for (n = 1; n <= sb.inode_total; n++) {
+    if (!audit_test(seen.used, n)) {
+      if (seen.refs[n] != 0)
+	audit_row(audit, "UNALLOCATED_REFERENCED", 2, n, seen.refs[n], 0);
+      continue;
+    }
+    if ((n >= FIRST_INODE || n == ROOT_INODE) && seen.links[n] != seen.refs[n])
+      audit_row(audit, "LINK_COUNT", 3, n, seen.links[n], seen.refs[n]);
+    if (audit_test(seen.is_dir, n)) {
+      expected = (n == ROOT_INODE) ? ROOT_INODE : seen.parent[n];
+      if (expected != 0 && seen.dotdot[n] != expected)
+	audit_row(audit, "DOTDOT", 3, n, expected, seen.dotdot[n]);
+    }
+  }
+}
+
+
+#ifndef LAB3A_NO_MAIN
+/* Analyze file system image and output to six csv files.  */
+int main(int argc, char* argv[]) {
+
+  int opt;
+  const char *index_path = NULL;
+  const char *stats_path = NULL;
+  const char *diff_path = NULL;
+  double progress = 0;
+  int extents = 0;
+  int paths = 0;
+  int audit = 0;
+  const char *lookup_path = NULL;
+  int htree = 0;
+  int manifest = 0;
+  char **lookups = calloc(argc, sizeof(char *));
+  int lookup_count = 0;
+  struct extract_job *extracts = calloc(argc, sizeof(struct extract_job));
+  int extract_count = 0, failed = 0;
+  char *dest, *end;
+  unsigned long group_first = 0, group_last = ULONG_MAX, first, last, uid;
+  int filtered = 0;
+
+  if (lookups == NULL || extracts == NULL) {
+    perror("calloc"); exit(-1);
+  }
+
+  /* '-j N' spreads the per-group work over N threads; '-x FILE' keeps an index in FILE;
+     '-s FILE' writes a JSON report of where the time went; '-p SECS' prints progress;
+     '-C MB' reads the image through a block cache of that size instead of mapping it;
+     '-d OLD' only dumps the groups that changed since OLD (an image, or its '-x' index);
+     '-f binary' writes '.bin' table files in place of the csv files ('-f packed' packs block numbers);
+     '-e' writes runs of free blocks and inodes to 'bitmap.csv', and how fragmented each group is;
+     '-P' writes the full path of every inode to 'path.csv'; '-L LIST' prints the inode of each path in LIST;
+     '-a' audits the file system as it goes, writing what doesn't add up to 'audit.csv';
+     '-g FIRST-LAST' and '-i FIRST-LAST' only scan those groups and inodes; '-T TYPES' ('fds?'),
+     '-u UID' and '-m FROM-TO' (mtime) pick which inodes get rows; '-t LIST' names the tables to write;
+     '-H' writes the hash index of each indexed directory to 'htree.csv';
+     '-l PATH' (any number of times) only looks PATH up, through the directories' hash indexes;
+     '-X SOURCE=DEST' (any number of times) only copies the file at path SOURCE (or '#INODE') to DEST;
+     '-M' writes the CRC-32C of every regular file to 'manifest.csv', and of each of its blocks to 'blockhash.csv'.  */
+  while ((opt = getopt(argc, argv, "j:x:s:p:C:d:f:ePL:ag:i:T:u:m:t:Hl:X:M")) != -1) {
+    switch (opt) {
+      case 'j':
+	if (atoi(optarg) < 1) {
+	  fprintf(stderr, "%s: -j needs a positive number of jobs\n", argv[0]);
+	  exit(-1);
+	}
+	JOB_COUNT = atoi(optarg);
+	break;
+      case 'x':
+	index_path = optarg;
+	break;
+      case 's':
+	stats_path = optarg;
+	break;
+      case 'p':
+	if ((progress = atof(optarg)) <= 0) {
+	  fprintf(stderr, "%s: -p needs a positive number of seconds\n", argv[0]);
+	  exit(-1);
 	}
-	counter++;
+	break;
+      case 'C':
+	if (atoi(optarg) < 1) {
+	  fprintf(stderr, "%s: -C needs a positive cache size in MB\n", argv[0]);
+	  exit(-1);
+	}
+	CACHE_SIZE = (size_t) atoi(optarg) << 20;
+	break;
+      case 'd':
+	diff_path = optarg;
+	break;
+      case 'f':
+	if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "binary") != 0 && strcmp(optarg, "packed") != 0) {
+	  fprintf(stderr, "%s: -f needs csv, binary or packed\n", argv[0]);
+	  exit(-1);
+	}
+	OUTPUT_FORMAT = optarg;
+	break;
+      case 'e':
+	extents = 1;
+	break;
+      case 'P':
+	paths = 1;
+	break;
+      case 'L':
+	lookup_path = optarg;
+	break;
+      case 'a':
+	audit = 1;
+	break;
+      case 'g':
+	if (parse_range(optarg, &group_first, &group_last) != 0) {
+	  fprintf(stderr, "%s: -g needs a group or range of groups, like 3-7\n", argv[0]);
+	  exit(-1);
+	}
+	filtered = 1;
+	break;
+      case 'i':
+	if (parse_range(optarg, &first, &last) != 0 || last == 0 || first > UINT_MAX ||
+	    (last != ULONG_MAX && last > UINT_MAX)) {
+	  fprintf(stderr, "%s: -i needs an inode or range of inodes, like 12-4000\n", argv[0]);
+	  exit(-1);
+	}
+	INODE_FIRST = first;
+	INODE_LAST = (last == ULONG_MAX) ? 0 : last;
+	filtered = 1;
+	break;
+      case 'T':
+	if (optarg[strspn(optarg, "fds?")] != '\0') {
+	  fprintf(stderr, "%s: -T needs file type letters out of f, d, s and ?\n", argv[0]);
+	  exit(-1);
+	}
+	filter.types = optarg;
+	filtered = 1;
+	break;
+      case 'u':
+	uid = strtoul(optarg, &end, 10);
+	if (!isdigit((unsigned char) *optarg) || *end != '\0' || uid > UINT32_MAX) {
+	  fprintf(stderr, "%s: -u needs a numeric uid\n", argv[0]);
+	  exit(-1);
+	}
+	filter.uid = uid;
+	filtered = 1;
+	break;
+      case 'm':
+	if (parse_range(optarg, &first, &last) != 0) {
+	  fprintf(stderr, "%s: -m needs a range of times in seconds, like 1500000000-\n", argv[0]);
+	  exit(-1);
+	}
+	filter.mtime_first = (first > UINT32_MAX) ? UINT32_MAX : first;
+	filter.mtime_last = (last > UINT32_MAX) ? UINT32_MAX : last;
+	filtered = 1;
+	break;
+      case 't':
+	if (parse_tables(optarg) != 0) {
+	  fprintf(stderr, "%s: -t needs a comma-separated list of super, group, bitmap, inode, directory,\n"
+		  "  indirect, htree, manifest and blockhash\n", argv[0]);
+	  exit(-1);
+	}
+	filter.tables = optarg;
+	break;
+      case 'H':
+	htree = 1;
+	break;
+      case 'M':
+	manifest = 1;
+	break;
+      case 'l':
+	lookups[lookup_count++] = optarg;
+	break;
+      case 'X':
+	/* Without '=DEST', the file goes to the current directory under its own name.  */
+	if ((dest = strchr(optarg, '=')) != NULL)
+	  *dest++ = '\0';
+	else
+	  dest = (strrchr(optarg, '/') != NULL) ? strrchr(optarg, '/') + 1 : optarg + (optarg[0] == '#');
+	if (*optarg == '\0' || *dest == '\0') {
+	  fprintf(stderr, "%s: -X needs a file to extract, as SOURCE=DEST\n", argv[0]);
+	  exit(-1);
+	}
+	extracts[extract_count].source = optarg;
+	extracts[extract_count++].dest = dest;
+	break;
+      default:
+	fprintf(stderr, "usage: %s [-j jobs] [-x index] [-s stats] [-p seconds] [-C cache MB] [-d old image|index] [-f csv|binary|packed] [-e] [-P] [-L paths] [-a]\n"
+		"       [-g groups] [-i inodes] [-T types] [-u uid] [-m mtimes] [-t tables]\n"
+		"       [-H] [-l path] [-X source=dest] [-M] image|-\n", argv[0]);
+	exit(-1);
+    }
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "%s: name for file system image not provided\n", argv[0]);
+    exit(-1);
+  }
+  if (audit && (diff_path != NULL || filtered)) {
+    fprintf(stderr, "%s: -a needs every inode, so it can't be used with -d, -g, -i, -T, -u or -m\n", argv[0]);
+    exit(-1);
+  }
+
+  stats_progress(progress);
+
+  /* With '-d', take the group hashes of the earlier snapshot before opening this one.  */
+  if (diff_path != NULL) {
+    stats_begin("base");
+    if (load_diff_base(diff_path) == -1) {
+      perror(img.error_text); exit(-1);
+    }
+  }
+
+  /* Map (or read in, or start streaming) the provided file system image; '-' is stdin.  */
+  stats_begin("super");
+  if (open_image(argv[optind]) == -1) {
+    perror(img.error_text); exit(-1);
+  }
+
+  /* Decode the super block and group descriptors, which every csv file below draws on.  */
+  if (load_file_system() == -1) {
+    perror(img.error_text); exit(-1);
+  }
+
+  /* With '-l' or '-X', only look the paths up or copy the files out, straight
+     from the image, and write nothing else.  */
+  if (lookup_count > 0 || extract_count > 0) {
+    if (img.streaming) {
+      fprintf(stderr, "%s: -l and -X need to seek around the image, so they can't read a pipe\n", argv[0]);
+      exit(-1);
+    }
+    stats_begin("lookup");
+    write_index_lookups(lookups, lookup_count);
+    stats_begin("extract");
+    extract_files(extracts, extract_count);
+    if (img.error != 0) {
+      errno = img.error;
+      perror(img.error_text);
+      failed = 1;
+    }
+    for (int x = 0; x < extract_count; x++) {
+      if (extracts[x].result != 0) {
+	fprintf(stderr, "%s: %s to %s: %s\n", argv[0], extracts[x].source, extracts[x].dest,
+		strerror(extracts[x].result));
+	failed = 1;
       }
-      counter = 1;
     }
+    stats_end();
+    stats_progress(0);
+    if (stats_path != NULL && stats_report(stats_path) != 0) {
+      perror(stats_path); exit(-1);
+    }
+    free(lookups);
+    free(extracts);
+    exit(failed ? -1 : 0);
+  }
+  if (manifest && img.streaming) {
+    fprintf(stderr, "%s: -M reads every file's data, so it can't read a pipe\n", argv[0]);
+    exit(-1);
   }
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+  /* The two small tables come straight from what was just decoded.  */
+  if (table_wanted("super"))
+    write_super_csv();
+  stats_begin("group");
+  if (table_wanted("group"))
+    write_group_csv();
+
+  /* With '-x', the bitmaps and inode locations come from the index from here on.  */
+  stats_begin("index");
+  if (open_index(index_path) == -1) {
+    perror(img.error_text); exit(-1);
+  }
 
-  /* Lastly, close the file stream.  */
-  if (fclose(inode) != 0) {
-    perror("fclose"); exit(-1);
+  /* With '-d', the passes below only run on the groups that changed.  */
+  if (diff_path != NULL) {
+    stats_begin("diff");
+    if (select_changed_groups() == -1) {
+      perror(img.error_text); exit(-1);
+    }
+    write_changed_csv();
   }
 
-  
+  /* With '-g' or '-i', the passes below only run on the groups asked for.  */
+  if (group_first != 0 || group_last != ULONG_MAX || INODE_FIRST != 0 || INODE_LAST != 0)
+    select_groups(group_first, group_last);
+
+  /* With '-P' or '-L', the directory pass also builds the directory tree.  */
+  if (paths || lookup_path != NULL)
+    dir_tree_init();
+
+
   ////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////
   //                                                                        //
-  //                                 DIRECTORY.CSV                          //
+  //                                BITMAP.CSV                              //
   //                                                                        //          
   ////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////
 
-  /* First, create / open 'directory.csv' for writing.  */
-  FILE* directory = fopen("directory.csv", "w");
-  if (directory == NULL) {
-    perror("fopen"); exit(-1);
+  /* First, create / open 'bitmap.csv' for writing (unless '-t' leaves it out);
+     with '-e', in its extent form along with 'fragment.csv'.  */
+  const struct table *bitmap_table = extents ? &EXTENT_TABLE : &BITMAP_TABLE;
+  struct csv_out* bitmap = NULL;
+  if (table_wanted("bitmap") && (bitmap = table_open(bitmap_table)) == NULL) {
+    perror("open"); exit(-1);
+  }
+
+  struct csv_out* fragment = NULL;
+  if (bitmap != NULL && extents && (fragment = table_open(&FRAGMENT_TABLE)) == NULL) {
+    perror("open"); exit(-1);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
-  unsigned int block_offset;
-  unsigned int entry_offset = 0;
-  unsigned char inum[4];
-  unsigned char recl[2];
-  unsigned char i_block[60];
-  unsigned char i_block_num[4];
-  unsigned int i_block_numf;
-  unsigned int in_num;
-  unsigned int rec_ln;
-  unsigned char entry_namel[1];
-  unsigned int enamel;
-  unsigned char name[255];
-  
-  for (unsigned int i =  0; i < DESCRIPTOR_COUNT; i++) {
+  /* The rows are written by the group passes run below.  */
+  struct group_pass passes[3];
+  int pass_count = 0;
+  struct csv_out *bitmap_out[] = { bitmap, fragment };
+  if (bitmap != NULL && extents)
+    passes[pass_count++] = (struct group_pass) { emit_free_extents, NULL, bitmap_out, 2, "bitmap" };
+  else if (bitmap != NULL)
+    passes[pass_count++] = (struct group_pass) { emit_bitmap_group, NULL, bitmap_out, 1, "bitmap" };
+
+
+  ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
+  //                                                                        //
+  //                 INODE.CSV, DIRECTORY.CSV & INDIRECT.CSV                //
+  //                                                                        //          
+  ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
+
+  /* All three files come out of a single scan of the inode tables, so open
+     all of them that '-t' asks for ('-P' and '-L' need the directories).  */
+  struct csv_out* inode = NULL;
+  if (table_wanted("inode") && (inode = table_open(&INODE_TABLE)) == NULL) {
+    perror("open"); exit(-1);
+  }
+
+  struct csv_out* directory = NULL;
+  if ((table_wanted("directory") || paths || lookup_path != NULL) &&
+      (directory = table_open(&DIRECTORY_TABLE)) == NULL) {
+    perror("open"); exit(-1);
+  }
 
-    ret = pread(imageFD, bitmap_block, sb.block_size, compute_offset(gd[i].inode_bitmap_block));
-    if (ret == -1) {
-      perror("pread"); exit(-1);
+  struct csv_out* indirect = NULL;
+  if (table_wanted("indirect") && (indirect = table_open(&INDIRECT_TABLE)) == NULL) {
+    perror("open"); exit(-1);
+  }
+
+  /* With '-H', the hash indexes come out of the same scan.  */
+  struct csv_out* htree_out = NULL;
+  if (htree && table_wanted("htree") && (htree_out = table_open(&HTREE_TABLE)) == NULL) {
+    perror("open"); exit(-1);
+  }
+
+  /* With '-a', the audit rides on the same scan, with two emitters of its own.  */
+  struct csv_out* audit_out = NULL;
+  if (audit) {
+    if ((audit_out = csv_open("audit.csv")) == NULL) {
+      perror("open"); exit(-1);
     }
+    audit_init();
+  }
 
-    counter = 1;
-    
-    for (unsigned int j = 0; j < sb.block_size; j++) {
-      bitmap_byte = bitmap_block[j];
-      for (unsigned int k = 1; k <= 128; k *= 2) {
-	bit_free = !(bitmap_byte & k);
-	if (!bit_free) {
-	  table_index = (8*j) + counter;
-	  if (table_index < sb.inodes_per_group) {
-	    
-	    inode_number = (sb.inodes_per_group * i) + table_index;
-	    table_offset = compute_offset(gd[i].inode_table_start_block) + (128*(table_index-1));
-	    
-	    int l;
-	    
-	    ret = pread(imageFD, inodes, 128, table_offset);
-	    if (ret == -1) {
-	      perror("pread"); exit(-1);
-	    }
-
-	    ret = pread(imageFD, i_block, 60, table_offset + 40);
-	    if (ret == -1) {
-	      perror("pread"); exit(-1);
-	    }
-	    
-	    for (l = 0; l < 2; l++) {
-	      imod[l] = inodes[I_MODE_OFFSET+l];
-	    }
-	    i_mode = (imod[0]<<0) | (imod[1]<<8);
-	    file_type = (i_mode & 0xF000);
-	    
-	    if (file_type == 0x4000) {
-
-	      for (l = 0; l < 4; l++) {
-		i_b[l] = inodes[I_BLOCK_OFFSET+l];
-	      }
-	      i_blocks = (i_b[0]<<0) | (i_b[1]<<8) | (i_b[2]<<16) | (i_b[3]<<24);
-	      i_blocks /= (2 << sb.block_size);
-
-	      
-	      for (unsigned int i = 0; i < i_blocks; i++) {
-		for (unsigned int l = 0; l < 4; l++) {
-		  i_block_num[l] = i_block[4*i+l];
-		}
-		i_block_numf = (i_block_num[0]<<0) | (i_block_num[1]<<8) | (i_block_num[2]<<16) | (i_block_num[3]<<24);
-		
-		block_offset = compute_offset(i_block_numf);
-
-		int count = 0;
-	        while (entry_offset < sb.block_size) {
-		  pread(imageFD, inum, 4, block_offset + entry_offset);
-		  in_num = (inum[0]<<0) | (inum[1]<<8) | (inum[2]<<16) | (inum[3]<<24);
-
-		  if (in_num) {
-
-		    /* PARENT INODE NUMBER - DEC FORMAT */
-		    fprintf(directory, "%d,", inode_number);
-
-		    /* ENTRY NUMBER - DEC FORMAT */
-		    fprintf(directory, "%d,", count);
-
-		    /* ENTRY LENGTH - DEC FORMAT */
-		    pread(imageFD, recl, 2, block_offset + entry_offset + 4);
-		    rec_ln = (recl[0]<<0) | (recl[1]<<8) | (recl[2]<<16) | (recl[3]<<24);
-		    fprintf(directory, "%d,", rec_ln);
-
-		    pread(imageFD, entry_namel, 1, block_offset + entry_offset + 6);
-		    enamel = (entry_namel[0]<<0);
-		    fprintf(directory, "%d,", enamel);
-
-		    /* INODE NUMBER OF THE FILE ENTRY - DEC FORMAT */
-		    fprintf(directory, "%d,", in_num);
-
-		    
-		    /* NAME - STRING FORMAT */
-		    fprintf(directory, "\"");
-		    pread(imageFD, name, 255, block_offset + entry_offset + 8);
-		    for (int h = 0; h < 255; h++) {
-		      if (name[h] == '\0') {
-			break;
-		      }
-		      fprintf(directory, "%c", name[h]);
-		    }
-		    fprintf(directory, "\"");
-		    fprintf(directory, "\n");
-		    
-		    count++;
-		  }
-		  else {
-		    pread(imageFD, recl, 2, block_offset + entry_offset + 4);
-		    rec_ln = (recl[0]<<0) | (recl[1]<<8) | (recl[2]<<16) | (recl[3]<<24);
-		  }
-		  
-		  entry_offset += rec_ln;
-		}
-		entry_offset = 0;
-	      }
-	    }
-	  }
-	}
-	counter++;
-      }
-      counter = 1;
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+
+  struct inode_emitter emitters[] = {
+    { emit_inode_row,        NULL,                  NULL,               inode     },
+    { emit_directory_inode,  emit_directory_block,  NULL,               directory },
+    { emit_indirect_inode,   NULL,                  emit_indirect_row,  indirect  },
+    { emit_htree_inode,      NULL,                  NULL,               htree_out },
+    { audit_block_inode,     NULL,                  audit_indirect_row, audit_out },
+    { audit_directory_inode, audit_directory_block, NULL,               audit_out },
+  };
+
+  /* Keep only the emitters that have somewhere to write, in order (the audit's last).  */
+  struct inode_scan scan = { emitters, 0 };
+  struct csv_out *scan_out[6];
+  for (int e = 0; e < 6; e++)
+    if (emitters[e].out != NULL) {
+      emitters[scan.emitter_count] = emitters[e];
+      scan_out[scan.emitter_count++] = emitters[e].out;
     }
+
+  /* Only the inode table's own rows need every column of every inode decoded.  */
+  DECODE_ALL = (inode != NULL || audit);
+  if (scan.emitter_count > 0)
+    passes[pass_count++] = (struct group_pass) { audit ? audit_inode_group : scan_inode_group,
+						 &scan, scan_out, scan.emitter_count, "inode" };
+
+
+  ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
+  //                                                                        //
+  //                      MANIFEST.CSV & BLOCKHASH.CSV                      //
+  //                                                                        //          
+  ////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////
+
+  /* With '-M', the file contents are hashed in a pass of their own, after
+     the inode scan, into whichever of the two files '-t' asks for.  */
+  struct csv_out* manifest_out = NULL;
+  if (manifest && table_wanted("manifest") && (manifest_out = table_open(&MANIFEST_TABLE)) == NULL) {
+    perror("open"); exit(-1);
+  }
+
+  struct csv_out* blockhash = NULL;
+  if (manifest && table_wanted("blockhash") && (blockhash = table_open(&BLOCKHASH_TABLE)) == NULL) {
+    perror("open"); exit(-1);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
-  
-  /* Lastly, close the file stream.  */
-  if (fclose(directory) != 0) {
-    perror("fclose"); exit(-1);
+
+  struct csv_out *manifest_streams[2];
+  int manifest_at[2] = { -1, -1 };
+  int manifest_count = 0;
+  if (manifest_out != NULL) {
+    manifest_at[0] = manifest_count;
+    manifest_streams[manifest_count++] = manifest_out;
   }
+  if (blockhash != NULL) {
+    manifest_at[1] = manifest_count;
+    manifest_streams[manifest_count++] = blockhash;
+  }
+  if (manifest_count > 0)
+    passes[pass_count++] = (struct group_pass) { emit_manifest_group, manifest_at, manifest_streams,
+						 manifest_count, "manifest" };
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
+  /* Run the passes over every group: one after the other for an image
+     file, interleaved in a single forward pass for a stream.  */
+  if (pass_count > 0 && run_group_passes(passes, pass_count) == -1) {
+    perror(img.error_text); exit(-1);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
   
+  /* Lastly, close the file streams.  */
+  stats_begin("close");
+  if (bitmap != NULL && table_close(bitmap, bitmap_table) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (fragment != NULL && table_close(fragment, &FRAGMENT_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (inode != NULL && table_close(inode, &INODE_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (directory != NULL && table_close(directory, &DIRECTORY_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (indirect != NULL && table_close(indirect, &INDIRECT_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (htree_out != NULL && table_close(htree_out, &HTREE_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (manifest_out != NULL && table_close(manifest_out, &MANIFEST_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  if (blockhash != NULL && table_close(blockhash, &BLOCKHASH_TABLE) != 0) {
+    perror("close"); exit(-1);
+  }
+
+  /* With '-a', finish off with the checks that needed every group.  */
+  if (audit) {
+    stats_begin("audit");
+    write_audit_csv(audit_out);
+    if (csv_close(audit_out) != 0) {
+      perror("close"); exit(-1);
+    }
+  }
+
+  /* With '-P' and '-L', answer from the finished directory tree.  */
+  if (paths) {
+    stats_begin("path");
+    write_path_csv();
+  }
+  if (lookup_path != NULL) {
+    stats_begin("lookup");
+    write_path_lookups(lookup_path);
+  }
+
+  /* With '-s', say where the time went.  */
+  stats_end();
+  stats_progress(0);
+  if (stats_path != NULL && stats_report(stats_path) != 0) {
+    perror(stats_path); exit(-1);
+  }
+
+  free(lookups);
+  free(extracts);
   exit(0);
 }
+#endif
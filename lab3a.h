@@ -2,9 +2,14 @@
  *  super_block
  *
  *  A basic set of file system parameters
- *  the file system's super block. These
- *  are the nine fields to be reported in
- *  file 'super.csv'.
+ *  the file system's super block. The first
+ *  nine are the fields to be reported in
+ *  file 'super.csv'; the rest say how the
+ *  file system is laid out (the first inode
+ *  that isn't reserved, inode and group
+ *  descriptor sizes, the feature flags, the
+ *  reserved GDT blocks and the groups per
+ *  flex group, 0 without flex_bg).
  */
 struct super_block {
 
@@ -17,6 +22,16 @@ struct super_block {
   unsigned int inodes_per_group;
   unsigned int fragments_per_group;
   unsigned int first_data_block;
+  unsigned int rev_level;
+  unsigned int first_ino;
+  unsigned int inode_size;
+  unsigned int desc_size;
+  unsigned int feature_compat;
+  unsigned int feature_incompat;
+  unsigned int feature_ro_compat;
+  unsigned int reserved_gdt_blocks;
+  unsigned int groups_per_flex;
+  unsigned int backup_groups[2];
   
 };
 
@@ -24,8 +39,11 @@ struct super_block {
  *  group_descr
  *
  *  Information for each group descriptor
- *  in the file system. These are the six
- *  fields to be reported in file 'group.csv'.
+ *  in the file system. The first seven are
+ *  the fields to be reported in file
+ *  'group.csv'; 'flags' says whether the
+ *  group's bitmaps were ever written (only
+ *  with group descriptor checksums).
  */
 struct group_descr {
 
@@ -36,5 +54,1200 @@ struct group_descr {
   unsigned int inode_bitmap_block;
   unsigned int block_bitmap_block;
   unsigned int inode_table_start_block;
+  unsigned int flags;
   
 };
+
+/*
+ *  image
+ *
+ *  The file system image being analyzed. When
+ *  possible the image is mapped read-only, and
+ *  otherwise it is pulled into memory with large
+ *  reads. Either way every pass decodes its
+ *  fields straight out of 'data'. A pipe is
+ *  'streaming': 'data' only holds its head and
+ *  later blocks come from the stream reader.
+ *  A 'cached' image is read with pread() into
+ *  the block cache instead, and 'data' is not
+ *  used. 'mtime' is kept to key the index file.
+ *  For a sparse image file, 'runs' holds the
+ *  start and end offsets of its 'run_count'
+ *  runs of data (none when it has no holes),
+ *  and reads that fall in the 'hole_bytes'
+ *  between them are answered with zeros.
+ *  'failures' counts what went wrong reading
+ *  it, and 'error' and 'error_text' keep the
+ *  errno and a description of the first, for
+ *  perror().
+ */
+struct image {
+
+  const char *path;
+  int fd;
+  unsigned char *data;
+  size_t size;
+  int mapped;
+  int streaming;
+  int cached;
+  struct timespec mtime;
+  off_t *runs;
+  unsigned int run_count;
+  uint64_t hole_bytes;
+  unsigned int failures;
+  int error;
+  char error_text[256];
+
+};
+
+/*
+ *  cache_slot
+ *
+ *  One block of the block cache. While callers
+ *  hold pointers into it the slot is pinned
+ *  ('pins' > 0) and can't be evicted; 'ready'
+ *  is clear while its block is still being
+ *  read in, and 'referenced' gives it a second
+ *  chance when the clock hand comes round.
+ *  A 'spill' slot holds a read that did not fit
+ *  in one block, outside the cache, and is
+ *  freed once unpinned. 'error' is the errno
+ *  its read failed with, if it did.
+ */
+struct cache_slot {
+
+  unsigned int block;
+  unsigned char *data;
+  unsigned int pins;
+  int ready;
+  int referenced;
+  int used;
+  int spill;
+  int error;
+  struct cache_slot *next;
+
+};
+
+/*
+ *  block_cache
+ *
+ *  A fixed slab of 'slot_count' block-sized
+ *  buffers, found by block number through
+ *  'buckets' and evicted by CLOCK. Lookups
+ *  from every thread go through 'lock';
+ *  threads wanting a block another thread is
+ *  reading wait on 'loaded'.
+ */
+struct block_cache {
+
+  struct cache_slot *slots;
+  unsigned char *slab;
+  unsigned int slot_count;
+  unsigned int hand;
+  struct cache_slot **buckets;
+  unsigned int bucket_mask;
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+
+};
+
+/*
+ *  uring
+ *
+ *  An io_uring set up with raw system calls to
+ *  fill cache slots ahead of use. Reads are
+ *  queued under 'lock'; a reaper thread takes
+ *  the completions as they arrive and marks
+ *  each slot ready. 'in_flight' counts reads
+ *  submitted and not yet reaped.
+ */
+struct uring {
+
+  int active;
+  int fd;
+  unsigned int entries;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int queued;
+  unsigned int in_flight;
+  pthread_mutex_t lock;
+  pthread_t reaper;
+
+};
+
+/*
+ *  cache_pins
+ *
+ *  The slots one thread has pinned. A group
+ *  run notes 'count' when it starts and unpins
+ *  everything after that when it returns.
+ */
+struct cache_pins {
+
+  struct cache_slot **held;
+  size_t count;
+  size_t cap;
+
+};
+
+/*
+ *  csv_out
+ *
+ *  A buffered csv output stream. Rows are
+ *  formatted straight into 'buf', which is
+ *  written to 'fd' only when it fills up or
+ *  the stream is closed. With fd == -1 the
+ *  stream just grows in memory. A 'binary'
+ *  stream takes the same calls but writes
+ *  each field as raw little-endian bytes, to
+ *  be turned into a table file at the end.
+ */
+struct csv_out {
+
+  int fd;
+  char *buf;
+  size_t len;
+  size_t cap;
+  int binary;
+
+};
+
+/*
+ *  column
+ *
+ *  One column of an output table, in the order
+ *  the csv prints them: 'format' is 'd'ecimal,
+ *  he'x', 'o'ctal (all 32-bit), 'u'nsigned
+ *  64-bit decimal, a 'c'haracter or a quoted
+ *  's'tring. 'packed' columns hold
+ *  block numbers, and are delta-encoded when
+ *  packed output is asked for.
+ */
+struct column {
+
+  const char *name;
+  char format;
+  int packed;
+
+};
+
+/*
+ *  table
+ *
+ *  One of the dump's output files, 'name'.csv
+ *  or 'name'.bin, and its columns.
+ */
+struct table {
+
+  const char *name;
+  const struct column *columns;
+  int column_count;
+
+};
+
+/*
+ *  table_header
+ *
+ *  Start of a binary table file, followed by
+ *  'column_count' table_column_headers and then
+ *  the columns themselves, each 8-byte aligned
+ *  at 'offset' from the start of the file.
+ *  Every field of both is little-endian.
+ */
+struct table_header {
+
+  char magic[8];
+  uint32_t version;
+  uint32_t column_count;
+  uint64_t row_count;
+  char name[16];
+
+};
+
+/*
+ *  table_column_header
+ *
+ *  Where one column lives in a binary table.
+ *  A plain column is 'row_count' little-endian
+ *  values 'width' bytes wide; a string column
+ *  is row_count + 1 64-bit offsets followed by
+ *  the bytes they point into. A packed column
+ *  ('encoding' 1) is a run of varints, each the
+ *  zigzagged difference from the row before.
+ */
+struct table_column_header {
+
+  char name[16];
+  uint8_t format;
+  uint8_t width;
+  uint8_t encoding;
+  uint8_t pad[5];
+  uint64_t offset;
+  uint64_t size;
+
+};
+
+/*
+ *  inode_batch
+ *
+ *  The allocated inodes of one inode table
+ *  block, decoded column by column: row k of
+ *  every array describes the same inode, and
+ *  its 15 block pointers are block[15*k ..].
+ *  'raw' points at each inode's entry.
+ */
+struct inode_batch {
+
+  unsigned int count;
+  const unsigned char **raw;
+  uint32_t *number;
+  uint16_t *mode;
+  uint16_t *links_count;
+  uint32_t *uid;
+  uint32_t *gid;
+  uint32_t *size;
+  uint32_t *atime;
+  uint32_t *ctime;
+  uint32_t *mtime;
+  uint32_t *blocks;
+  uint32_t *block;
+
+};
+
+/*
+ *  inode_emitter
+ *
+ *  One consumer of the inode table scan. The
+ *  scan hands every allocated inode (row 'k'
+ *  of a decoded batch) to 'emit', which writes
+ *  whatever rows it produces to 'out' and
+ *  returns nonzero if it also wants the
+ *  inode's block map. If so, 'block' sees each
+ *  data block and 'indirect' each pointer held
+ *  in an indirect block (either may be NULL).
+ */
+struct inode_emitter {
+
+  int (*emit)(const struct inode_batch *b, unsigned int k, struct csv_out *out);
+  void (*block)(unsigned int inode_number, const unsigned char *raw,
+		uint64_t logical, unsigned int block, struct csv_out *out);
+  void (*indirect)(unsigned int inode_number, unsigned int container,
+		   unsigned int entry, unsigned int pointer, struct csv_out *out);
+  struct csv_out *out;
+
+};
+
+/*
+ *  block_walk
+ *
+ *  One walk over an inode's block map: 'data'
+ *  is called for each data block and
+ *  'indirect' for each pointer held in an
+ *  indirect block (either may be NULL). A
+ *  callback sets 'stop' to end the walk.
+ */
+struct block_walk {
+
+  unsigned int inode_number;
+  const unsigned char *raw;
+  void (*data)(struct block_walk *w, uint64_t logical, unsigned int block);
+  void (*indirect)(struct block_walk *w, unsigned int container,
+		   unsigned int entry, unsigned int pointer);
+  void *arg;
+  int stop;
+
+};
+
+/*
+ *  inode_scan
+ *
+ *  The emitters a scan of the inode tables
+ *  feeds, passed through to each group.
+ */
+struct inode_scan {
+
+  struct inode_emitter *emitters;
+  int emitter_count;
+
+};
+
+/*
+ *  emitter_walk
+ *
+ *  The state of one group's inode scan: the
+ *  emitters (those flagged in 'wanted' for
+ *  the current inode) and the output streams
+ *  they write to.
+ */
+struct emitter_walk {
+
+  struct inode_scan *scan;
+  int *wanted;
+  struct csv_out **out;
+
+};
+
+/*
+ *  group_pool
+ *
+ *  Shared state for spreading per-group work
+ *  over worker threads. Each group writes into
+ *  its own in-memory streams ('bufs', one per
+ *  stream in 'out', and csv or binary like
+ *  it), which are merged in group order once
+ *  'done' is set for that group.
+ */
+typedef void (*group_fn)(unsigned int group, struct csv_out **out, void *arg);
+
+struct group_pool {
+
+  group_fn fn;
+  void *arg;
+  struct csv_out **out;
+  int stream_count;
+  unsigned int next_group;
+  struct csv_out *bufs;
+  unsigned char *done;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+
+};
+
+/*
+ *  index_header
+ *
+ *  Start of an index file ('-x'). The key
+ *  fields tie it to one state of one image;
+ *  the '_at' fields are the byte offsets of
+ *  the sections that follow: a copy of 'sb',
+ *  the 'gd' array, each group's block and
+ *  inode bitmaps (packed 'bitmap_bytes' apart),
+ *  each group's first entry in 'offsets', each
+ *  group's hash (see group_hash()) and the
+ *  image offset of every allocated inode.
+ */
+struct index_header {
+
+  char magic[8];
+  uint32_t version;
+  uint32_t group_count;
+  uint64_t image_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t checksum;
+  uint32_t block_bitmap_bytes;
+  uint32_t inode_bitmap_bytes;
+  uint64_t inode_count;
+  uint64_t super_at;
+  uint64_t groups_at;
+  uint64_t block_bitmaps_at;
+  uint64_t inode_bitmaps_at;
+  uint64_t first_at;
+  uint64_t hashes_at;
+  uint64_t offsets_at;
+  uint64_t file_size;
+
+};
+
+/*
+ *  index
+ *
+ *  An index file in memory: mapped when it
+ *  was loaded, malloc'd when it was just
+ *  built. 'first' has one more entry than
+ *  there are groups.
+ */
+struct index {
+
+  unsigned char *data;
+  size_t size;
+  int mapped;
+  int loaded;
+  const struct index_header *hdr;
+  const unsigned char *block_bitmaps;
+  const unsigned char *inode_bitmaps;
+  const uint64_t *first;
+  const uint64_t *hashes;
+  const uint64_t *offsets;
+
+};
+
+/*
+ *  diff_base
+ *
+ *  The group hashes of an earlier snapshot,
+ *  which a diff run ('-d') compares against
+ *  to find the groups that changed.
+ */
+struct diff_base {
+
+  uint64_t *hashes;
+  unsigned int group_count;
+
+};
+
+/*
+ *  dir_link
+ *
+ *  One name of an inode: the entry 'name' in
+ *  directory 'parent', held in the tree's
+ *  name arena at 'name_at'. 'next' chains the
+ *  links that share a hash bucket (0 ends it;
+ *  links are numbered from 1).
+ */
+struct dir_link {
+
+  uint32_t parent;
+  uint32_t inode;
+  uint32_t next;
+  uint32_t name_len;
+  uint64_t name_at;
+
+};
+
+/*
+ *  dir_memo
+ *
+ *  A path prefix already resolved by a lookup,
+ *  known only by its hash and how many names
+ *  long it is.
+ */
+struct dir_memo {
+
+  uint64_t hash;
+  uint32_t len;
+  uint32_t inode;
+
+};
+
+/*
+ *  dir_tree
+ *
+ *  Every directory entry seen by the directory
+ *  pass, apart from "." and "..". 'link' is
+ *  indexed by inode number and gives the link
+ *  its path goes through (with hard links, the
+ *  one in the lowest-numbered directory, then
+ *  the first name by byte order), so a path is
+ *  read off by following parents up to the root.
+ *  'buckets' index the links by parent and name
+ *  for lookups, which remember the prefixes they
+ *  have resolved in 'memo'. Links are added from
+ *  any thread under 'lock'; lookups are made once
+ *  the pass is over.
+ */
+struct dir_tree {
+
+  uint32_t *link;
+  unsigned int inode_count;
+  struct dir_link *links;
+  uint32_t link_count;
+  uint32_t link_cap;
+  uint32_t *buckets;
+  uint32_t bucket_count;
+  char *names;
+  uint64_t names_len;
+  uint64_t names_cap;
+  struct dir_memo *memo;
+  pthread_mutex_t lock;
+
+};
+
+/*
+ *  dump_filter
+ *
+ *  Which rows the dump writes, from the
+ *  command line. 'tables' is a comma list of
+ *  the tables to write (NULL for all). Rows of
+ *  the inode scan are kept only for inodes of
+ *  a type listed in 'types' ('f', 'd', 's',
+ *  '?'; NULL for any), owned by 'uid' (-1 for
+ *  anyone) and modified within 'mtime_first'
+ *  to 'mtime_last'. Group and inode ranges are
+ *  pushed further down, into GROUP_SELECT and
+ *  INODE_FIRST / INODE_LAST.
+ */
+struct dump_filter {
+
+  const char *tables;
+  const char *types;
+  long uid;
+  uint32_t mtime_first;
+  uint32_t mtime_last;
+
+};
+
+/*
+ *  audit
+ *
+ *  What an audit ('-a') has gathered so far,
+ *  filled in from every group at once. Blocks
+ *  have one bit each: 'allocated' as the block
+ *  bitmaps have it, 'owned' once something
+ *  claims the block (an inode or the group's
+ *  own metadata) and 'shared' when something
+ *  claims it again. Inodes have a bit in 'used'
+ *  (allocated, with a mode) and 'is_dir', their
+ *  i_links_count in 'links', the directory
+ *  entries naming them in 'refs', and, for
+ *  directories, the lowest directory naming
+ *  them in 'parent' and their own ".." entry
+ *  in 'dotdot'.
+ */
+struct audit {
+
+  uint64_t *allocated;
+  uint64_t *owned;
+  uint64_t *shared;
+  uint64_t *used;
+  uint64_t *is_dir;
+  uint16_t *links;
+  uint32_t *refs;
+  uint32_t *parent;
+  uint32_t *dotdot;
+
+};
+
+/*
+ *  bitmap_iter
+ *
+ *  Position in a walk over the first 'nbits'
+ *  bits of a block or inode bitmap, visiting
+ *  only the bits that are set (flip == 0) or
+ *  only those that are clear (flip == ~0).
+ */
+struct bitmap_iter {
+
+  const unsigned char *map;
+  unsigned int nbits;
+  unsigned int pos;
+  uint64_t flip;
+
+};
+
+/*
+ *  group_pass
+ *
+ *  One per-group pass of the dump: 'fn' is run
+ *  for every group and writes to the
+ *  'stream_count' files in 'out'. 'name' is
+ *  the phase it is timed as.
+ */
+struct group_pass {
+
+  group_fn fn;
+  void *arg;
+  struct csv_out **out;
+  int stream_count;
+  const char *name;
+
+};
+
+/*
+ *  stream_waiter
+ *
+ *  A group waiting on a block that has not come
+ *  by yet in the stream. 'level' says what the
+ *  block is: -1 for group metadata, 0 for a
+ *  directory data block, n from 1 to 3 for
+ *  an n-level indirect block and 4 for an
+ *  extent tree node.
+ */
+struct stream_waiter {
+
+  unsigned int group;
+  int level;
+  uint64_t logical;
+  uint64_t dir_blocks;
+  struct stream_waiter *next;
+
+};
+
+/*
+ *  stream_block
+ *
+ *  A block held in memory while streaming,
+ *  chained in a hash bucket. It is freed once
+ *  'refs', the groups holding it, drops to 0.
+ */
+struct stream_block {
+
+  unsigned int block;
+  unsigned char *data;
+  unsigned int refs;
+  struct stream_waiter *waiters;
+  struct stream_block *next;
+
+};
+
+/*
+ *  stream_group
+ *
+ *  Progress of one group while streaming:
+ *  how many of its metadata blocks and of all
+ *  its blocks are still to come, the blocks it
+ *  holds, and its buffered csv output.
+ */
+struct stream_group {
+
+  unsigned int meta_pending;
+  unsigned int pending;
+  unsigned int *held;
+  unsigned int held_count, held_capacity;
+  int queued;
+  int done;
+  struct csv_out **out;
+
+};
+
+/*
+ *  stream
+ *
+ *  State of the single forward pass over a
+ *  piped image: the next block to be read, the
+ *  inode tables and the indirect blocks or
+ *  extent nodes still to come, the blocks held
+ *  in memory, the groups ready to be dumped
+ *  and the next one to flush, and a bit per
+ *  block that went by as all zeros.
+ */
+struct stream {
+
+  int started;
+  int dropped;
+  unsigned int next_block;
+  unsigned int tables_left;
+  unsigned int maps_left;
+  struct stream_block **buckets;
+  struct stream_group *groups;
+  unsigned int *ready;
+  unsigned int ready_count;
+  unsigned int next_flush;
+  unsigned char *zero;
+
+};
+
+/*
+ *  inode
+ *
+ *  Every field of an on-disk inode, as
+ *  decoded by decode_inode(), in fixed-width
+ *  fields laid out with no padding. 'uid' and
+ *  'gid' include their high 16 bits; 'blocks'
+ *  counts 512-byte sectors.
+ */
+struct inode {
+
+  uint16_t mode;
+  uint16_t links_count;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t size;
+  uint32_t atime;
+  uint32_t ctime;
+  uint32_t mtime;
+  uint32_t dtime;
+  uint32_t blocks;
+  uint32_t flags;
+  uint32_t block[15];
+  uint32_t generation;
+  uint32_t file_acl;
+  uint32_t size_high;
+  uint32_t faddr;
+
+};
+
+/*
+ *  inode_cursor
+ *
+ *  Position in the allocated inodes of one
+ *  group: in the index's offset list when
+ *  there is one, else in the inode bitmap.
+ *  Only table slots 'from' up to 'to' are
+ *  visited.
+ */
+struct inode_cursor {
+
+  unsigned int group;
+  off_t table_offset;
+  unsigned int from;
+  unsigned int to;
+  struct bitmap_iter it;
+  uint64_t next;
+  uint64_t end;
+
+};
+
+/*
+ *  dirent_ref
+ *
+ *  An in-use directory entry, as handed to
+ *  iterate_dirents() callbacks. 'name' points
+ *  into the image and is not NUL terminated;
+ *  'name_bytes' is 'name_len' cut short at the
+ *  end of the block. 'entry' counts the in-use
+ *  entries before this one in its block.
+ */
+struct dirent_ref {
+
+  unsigned int inode;
+  unsigned int rec_len;
+  unsigned int name_len;
+  unsigned int name_bytes;
+  unsigned int file_type;
+  unsigned int entry;
+  const unsigned char *name;
+
+};
+
+/*
+ *  extent_ref
+ *
+ *  One entry of an inode's extent tree, as
+ *  handed to iterate_extents() callbacks:
+ *  entry 'entry' of the node in block 'node'
+ *  (0 for the root, which sits in the inode),
+ *  'depth' levels above the leaves. A leaf
+ *  entry (depth 0) maps 'len' blocks from
+ *  logical block 'logical' on to blocks from
+ *  'start' on, which read as zeros if
+ *  'uninit'. An index entry sends logical
+ *  blocks from 'logical' on to the node in
+ *  block 'start'.
+ */
+struct extent_ref {
+
+  unsigned int node;
+  unsigned int entry;
+  unsigned int depth;
+  uint32_t logical;
+  unsigned int start;
+  unsigned int len;
+  int uninit;
+
+};
+
+/*
+ *  htree
+ *
+ *  The hash index of a directory with the
+ *  index flag set, as read from its root
+ *  block (logical block 0) by htree_open().
+ *  Names are hashed with 'hash_version' (0
+ *  legacy, 1 half MD4, 2 TEA), from 'seed',
+ *  reading their bytes as signed chars unless
+ *  'unsigned_chars'. 'levels' is how many
+ *  levels of index blocks sit below the root
+ *  before the leaves, which are ordinary
+ *  directory blocks.
+ */
+struct htree {
+
+  unsigned int hash_version;
+  int unsigned_chars;
+  uint32_t seed[4];
+  unsigned int levels;
+
+};
+
+/*
+ *  htree_ref
+ *
+ *  One entry of an index block, as handed to
+ *  iterate_htree() callbacks: entry 'entry' of
+ *  the index block at logical block 'node',
+ *  'level' levels below the root, sends names
+ *  hashing to 'hash' or more (the first entry
+ *  of a block has no hash, and reads as 0) to
+ *  logical block 'child'.
+ */
+struct htree_ref {
+
+  unsigned int level;
+  unsigned int node;
+  unsigned int entry;
+  uint32_t hash;
+  unsigned int child;
+
+};
+
+typedef int (*group_cb)(unsigned int group, const struct group_descr *descr, void *arg);
+typedef int (*inode_cb)(unsigned int inode_number, const unsigned char *raw, void *arg);
+typedef int (*dirent_cb)(unsigned int inode_number, const struct dirent_ref *d, void *arg);
+typedef int (*batch_cb)(const struct inode_batch *b, void *arg);
+typedef int (*htree_cb)(unsigned int inode_number, const struct htree_ref *e, void *arg);
+typedef int (*extent_cb)(unsigned int inode_number, const struct extent_ref *e, void *arg);
+typedef void (*block_hash_cb)(unsigned int inode_number, uint64_t logical, unsigned int block,
+			      uint32_t crc, void *arg);
+
+/*
+ *  dirent_walk
+ *
+ *  A dirent_cb riding on a block walk, and
+ *  the first non-zero result it returned.
+ */
+struct dirent_walk {
+
+  dirent_cb fn;
+  void *arg;
+  int result;
+
+};
+
+/*
+ *  extract_job
+ *
+ *  One file for extract_files() to copy out
+ *  of the image: the regular file 'source'
+ *  names (a path from the root, or '#' and an
+ *  inode number) is written to 'dest'. Once
+ *  done, 'inode' is what 'source' resolved to,
+ *  'bytes' how much data was copied, and
+ *  'result' 0 or the errno it failed with.
+ */
+struct extract_job {
+
+  const char *source;
+  const char *dest;
+  unsigned int inode;
+  uint64_t bytes;
+  int result;
+
+};
+
+/*
+ *  extract_run
+ *
+ *  The run of data blocks an extraction is
+ *  gathering: 'count' blocks starting at
+ *  'block' on disk and at 'logical' in the
+ *  file. A block that carries on from both is
+ *  added to the run; any other block has the
+ *  run copied to 'fd' first. 'size' is the
+ *  file's size, 'bytes' what has been copied
+ *  and 'error' the first errno hit.
+ */
+struct extract_run {
+
+  int fd;
+  uint64_t size;
+  uint64_t logical;
+  unsigned int block;
+  unsigned int count;
+  uint64_t bytes;
+  int error;
+
+};
+
+/*
+ *  extract_pool
+ *
+ *  The jobs extract_files() spreads over its
+ *  worker threads, each of which takes the
+ *  next job not yet taken until none are left.
+ */
+struct extract_pool {
+
+  struct extract_job *jobs;
+  unsigned int count;
+  unsigned int next;
+
+};
+
+/*
+ *  file_hash
+ *
+ *  One walk of hash_file() over a regular
+ *  file: the CRC-32C of its first 'next' of
+ *  'size' bytes so far, and how many data
+ *  blocks went into it. 'shift' appends a
+ *  whole block's CRC to it. Each block's own
+ *  CRC goes to 'block', if set.
+ */
+struct file_hash {
+
+  uint64_t size;
+  uint64_t next;
+  uint32_t crc;
+  uint32_t shift;
+  unsigned int blocks;
+  block_hash_cb block;
+  void *arg;
+
+};
+
+/*
+ *  manifest_walk
+ *
+ *  Where one group's manifest rows go:
+ *  'files' gets a row per regular file and
+ *  'blocks' one per data block (either may
+ *  be NULL, if '-t' leaves it out).
+ */
+struct manifest_walk {
+
+  struct csv_out *files;
+  struct csv_out *blocks;
+
+};
+
+/*
+ *  stats_phase
+ *
+ *  What one phase of a run cost, from
+ *  stats_begin() to the next phase. Every
+ *  group run in it is timed: 'histogram[b]'
+ *  counts groups that took under 2^b
+ *  microseconds, and the slowest few are
+ *  kept, slowest first.
+ */
+struct stats_phase {
+
+  const char *name;
+  double wall;
+  double cpu;
+  uint64_t read_bytes;
+  uint64_t read_calls;
+  uint64_t write_bytes;
+  uint64_t write_calls;
+  long minflt;
+  long majflt;
+  unsigned int groups;
+  uint64_t histogram[32];
+  unsigned int slowest_count;
+  unsigned int slowest[8];
+  double slowest_us[8];
+
+};
+
+/*
+ *  stats
+ *
+ *  Running totals for the whole process, and
+ *  the phases so far. The totals are added to
+ *  from any thread; a phase keeps the totals
+ *  as they were when it began and takes the
+ *  difference when it ends. 'groups_done' of
+ *  'groups_due' group runs of the phase have
+ *  finished. 'cache_hits' and
+ *  'cache_misses' are left at zero while no
+ *  block cache is in use, and 'hole_reads'
+ *  counts reads answered from an image's holes.
+ */
+struct stats {
+
+  uint64_t read_bytes;
+  uint64_t read_calls;
+  uint64_t write_bytes;
+  uint64_t write_calls;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t hole_reads;
+  unsigned int groups_done;
+  unsigned int groups_due;
+  double start;
+  struct stats_phase *phases;
+  int phase_count;
+  int current;
+  struct stats_phase begun;
+  pthread_mutex_t lock;
+  pthread_t progress;
+  pthread_cond_t wake;
+  int progress_running;
+  double progress_every;
+
+};
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                 LIBRARY                                //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * ext2dump.c reads one image per process. open_image() and
+ * load_file_system() fill in 'img', 'sb' and 'gd'; the iterators then
+ * hand out pointers into the image rather than copies, which stay valid
+ * until the process exits (or, for a streamed or cached image, until the
+ * group pass that was handed them returns). Outside a group pass, a
+ * cached image's pointers stay pinned until cache_release() is given the
+ * mark cache_hold() returned beforehand. Callbacks return non-zero to stop.
+ *
+ * Nothing here exits on a bad image. The entry points return -1 (or NULL,
+ * or 0 for a lookup) with errno set, and img.error_text says what went
+ * wrong first. A block that can't be read is passed over as empty by
+ * whatever was reading it, and the iterator or group pass it was read for
+ * returns -1 once it is done. Only running out of memory, or failing to
+ * write an output file, still ends the process.
+ */
+
+extern struct image img;
+extern struct super_block sb;
+extern struct group_descr *gd;
+extern unsigned int DESCRIPTOR_COUNT;
+extern unsigned int JOB_COUNT;
+extern size_t CACHE_SIZE;
+extern unsigned char *GROUP_SELECT;
+extern const char *OUTPUT_FORMAT;
+extern unsigned int INODE_FIRST;
+extern unsigned int INODE_LAST;
+extern int DECODE_ALL;
+extern struct stats stats;
+extern struct dir_tree tree;
+
+extern const int I_MODE_OFFSET;
+extern const int I_UID_OFFSET;
+extern const int I_GID_OFFSET;
+extern const int I_LINK_COUNT_OFFSET;
+extern const int I_CREATE_OFFSET;
+extern const int I_MOD_OFFSET;
+extern const int I_ACCESS_OFFSET;
+extern const int I_SIZE_OFFSET;
+extern const int I_SIZE_HIGH_OFFSET;
+extern const int I_BLOCK_OFFSET;
+extern const int B_PTRS_OFFSET;
+extern const int I_DELETE_OFFSET;
+extern int INODE_SIZE;
+extern const unsigned int ROOT_INODE;
+extern const unsigned int BG_INODE_UNINIT;
+
+int open_image(const char *path);
+void close_image(void);
+int load_file_system(void);
+unsigned int group_super_blocks(unsigned int i);
+int open_index(const char *path);
+const unsigned char *image_ptr(off_t offset, size_t len);
+const unsigned char *read_block(unsigned int block_num);
+size_t cache_hold(void);
+void cache_release(size_t mark);
+unsigned int get_le16(const unsigned char *p);
+unsigned int get_le32(const unsigned char *p);
+
+int iterate_groups(group_cb fn, void *arg);
+int iterate_inodes(unsigned int group, inode_cb fn, void *arg);
+int iterate_inode_batches(unsigned int group, batch_cb fn, void *arg);
+void group_inode_slots(unsigned int group, unsigned int *from, unsigned int *to);
+int group_inode_iter_init(struct bitmap_iter *it, unsigned int group, int want_set);
+int iterate_dirents(unsigned int inode_number, const unsigned char *raw, dirent_cb fn, void *arg);
+int iterate_dirent_block(unsigned int inode_number, const unsigned char *raw,
+			 uint64_t logical, unsigned int block, dirent_cb fn, void *arg);
+void decode_inode(const unsigned char *raw, struct inode *ino);
+void decode_inode_batch(struct inode_batch *b, const unsigned char *entries,
+			unsigned int first_number, const unsigned int *slots, unsigned int count);
+const unsigned char *get_inode(unsigned int inode_number);
+int has_block_map(const unsigned char *raw);
+int has_extents(const unsigned char *raw);
+int iterate_extents(unsigned int inode_number, const unsigned char *raw, extent_cb fn, void *arg);
+int walk_blocks(struct block_walk *w);
+unsigned int map_block(const unsigned char *raw, uint64_t logical);
+int htree_open(const unsigned char *raw, struct htree *h);
+uint32_t htree_hash(const struct htree *h, const void *name, size_t len);
+int iterate_htree(unsigned int inode_number, const unsigned char *raw, htree_cb fn, void *arg);
+int htree_lookup(const unsigned char *raw, const struct htree *h, const char *name, size_t len,
+		 unsigned int *inode);
+unsigned int lookup_name(unsigned int dir, const char *name, size_t len);
+unsigned int lookup_path(const char *path);
+int extract_inode(unsigned int inode, const char *dest, uint64_t *bytes);
+void extract_files(struct extract_job *jobs, unsigned int count);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t hash_file(unsigned int inode_number, const unsigned char *raw, block_hash_cb fn, void *arg,
+		   unsigned int *blocks);
+
+uint64_t group_hash(unsigned int i);
+int load_diff_base(const char *path);
+int select_changed_groups(void);
+void dir_tree_init(void);
+void dir_tree_add(unsigned int parent, const struct dirent_ref *d);
+const char *dir_tree_path(unsigned int inode, char *buf, size_t size);
+unsigned int dir_tree_lookup(const char *path);
+
+const unsigned char *group_block_bitmap(unsigned int i);
+const unsigned char *group_inode_bitmap(unsigned int i);
+void bitmap_iter_init(struct bitmap_iter *it, const unsigned char *map, unsigned int nbits, int want_set);
+int bitmap_next(struct bitmap_iter *it);
+int bitmap_next_run(struct bitmap_iter *it, unsigned int *length);
+
+void csv_init(struct csv_out *o, int fd);
+struct csv_out *csv_open(const char *path);
+void csv_flush(struct csv_out *o);
+int csv_close(struct csv_out *o);
+void csv_bytes(struct csv_out *o, const void *p, size_t n);
+void csv_char(struct csv_out *o, char c);
+void csv_dec(struct csv_out *o, int v, char sep);
+void csv_u64(struct csv_out *o, uint64_t v, char sep);
+void csv_hex(struct csv_out *o, unsigned int v, char sep);
+void csv_oct(struct csv_out *o, unsigned int v, char sep);
+void csv_letter(struct csv_out *o, char c, char sep);
+void csv_quoted(struct csv_out *o, const void *p, size_t n, char sep);
+struct csv_out *table_open(const struct table *t);
+int table_close(struct csv_out *o, const struct table *t);
+int table_to_csv(const char *path, struct csv_out *out);
+
+int for_each_group(group_fn fn, void *arg, struct csv_out **out, int stream_count);
+int run_group_passes(struct group_pass *passes, int pass_count);
+
+void stats_begin(const char *name);
+void stats_end(void);
+void stats_progress(double seconds);
+int stats_report(const char *path);
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                                 CSV DUMP                               //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The pieces of lab3a.c, which writes the six csv files (and
+ * 'changed.csv' for a diff, 'fragment.csv' for free extents,
+ * 'path.csv' for paths, 'audit.csv' for an audit). Built with
+ * -DLAB3A_NO_MAIN it leaves out main(), so that other programs (the
+ * benchmarks in bench/) can run each piece on its own.
+ */
+
+void write_super_csv(void);
+void write_group_csv(void);
+void write_changed_csv(void);
+int table_wanted(const char *name);
+char type_letter(unsigned int mode);
+int filter_inode(const struct inode_batch *b, unsigned int k);
+int parse_tables(const char *list);
+int parse_range(const char *arg, unsigned long *first, unsigned long *last);
+void select_groups(unsigned long first, unsigned long last);
+void write_path_csv(void);
+void write_path_lookups(const char *list);
+void write_index_lookups(char **paths, int count);
+int emit_htree_inode(const struct inode_batch *b, unsigned int k, struct csv_out *htree);
+void emit_manifest_group(unsigned int i, struct csv_out **out, void *arg);
+void audit_init(void);
+int audit_block_inode(const struct inode_batch *b, unsigned int k, struct csv_out *audit);
+void audit_indirect_row(unsigned int inode_number, unsigned int container, unsigned int entry,
+			unsigned int pointer, struct csv_out *audit);
+int audit_directory_inode(const struct inode_batch *b, unsigned int k, struct csv_out *audit);
+void audit_directory_block(unsigned int inode_number, const unsigned char *inodes,
+			   uint64_t logical, unsigned int block, struct csv_out *audit);
+void audit_inode_group(unsigned int i, struct csv_out **out, void *arg);
+void write_audit_csv(struct csv_out *audit);
+void emit_bitmap_group(unsigned int i, struct csv_out **out, void *arg);
+void emit_free_extents(unsigned int i, struct csv_out **out, void *arg);
+int emit_inode_row(const struct inode_batch *b, unsigned int k, struct csv_out *inode);
+int emit_directory_inode(const struct inode_batch *b, unsigned int k, struct csv_out *directory);
+void emit_directory_block(unsigned int inode_number, const unsigned char *inodes,
+			  uint64_t logical, unsigned int block, struct csv_out *directory);
+int emit_indirect_inode(const struct inode_batch *b, unsigned int k, struct csv_out *indirect);
+void emit_indirect_row(unsigned int inode_number, unsigned int container, unsigned int entry,
+		       unsigned int pointer, struct csv_out *indirect);
+void scan_inode_group(unsigned int i, struct csv_out **out, void *arg);